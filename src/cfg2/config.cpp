@@ -1,11 +1,62 @@
 #include "config.hpp"
+#include "logger/logger.hpp"
+#include "utils/cached_file.hpp"
 #include "utils/string.hpp"
+#include <filesystem>
 #include <fmt/core.h>
 #include <stdexcept>
 #include <unordered_set>
 
 namespace cfg2 {
 
+namespace {
+
+std::shared_ptr<const gwmilter::utils::cached_file> preload(const std::string &section, const std::string &path)
+{
+    if (path.empty())
+        return nullptr;
+
+    auto file = std::make_shared<const gwmilter::utils::cached_file>(path);
+    try {
+        (void) file->content();
+    } catch (const std::exception &e) {
+        // not fatal here: loading is retried (and fails the message) when the file is needed
+        spdlog::warn("Section '{}': {}", section, e.what());
+    }
+    return file;
+}
+
+void check_gnupg_home(const std::string &section, const std::string &path)
+{
+    std::error_code ec;
+    if (!path.empty() && !std::filesystem::is_directory(path, ec))
+        spdlog::warn("Section '{}': gnupg_home {} is not a directory", section, path);
+}
+
+} // namespace
+
+void PgpEncryptionSection::prepare()
+{
+    check_gnupg_home(sectionName, gnupg_home);
+}
+
+void SmimeEncryptionSection::prepare()
+{
+    check_gnupg_home(sectionName, gnupg_home);
+
+    // every recipient of the section would fail otherwise
+    std::error_code ec;
+    if (cms_backend == CmsBackend::Openssl && !std::filesystem::is_directory(certificate_dir, ec))
+        throw std::invalid_argument(
+            fmt::format("Section '{}': certificate_dir {} is not a directory", sectionName, certificate_dir));
+}
+
+void PdfEncryptionSection::prepare()
+{
+    email_body_replacement_file = preload(sectionName, email_body_replacement);
+    pdf_main_page_if_missing_file = preload(sectionName, pdf_main_page_if_missing);
+}
+
 // Implementation of custom deserializer for Config
 template<> Config deserialize<Config>(const ConfigNode &node)
 {
@@ -4,12 +4,19 @@
 #include <algorithm>
 #include <array>
 #include <fmt/core.h>
+#include <memory>
 #include <optional>
 #include <regex>
+#include <sstream>
+#include <string>
 #include <string_view>
 #include <type_traits>
 #include <vector>
 
+namespace gwmilter::utils {
+class cached_file;
+} // namespace gwmilter::utils
+
 namespace cfg2 {
 
 using namespace std::string_view_literals;
@@ -26,7 +33,24 @@ struct GeneralSection final : BaseSection {
     int milter_timeout = -1;
     std::string smtp_server = "smtp://127.0.0.1";
     int smtp_server_timeout = -1;
+    int smtp_relay_max_failures = 3;
+    int smtp_relay_retry_interval = 30;
     bool dump_email_on_panic = false;
+    bool batch_key_lookup = false;
+    int key_cache_ttl = 300;
+    bool warm_up = true;
+    int memory_budget = 0;
+    int max_concurrent_encryptions = 0;
+    int workers = 0;
+    int worker_max_messages = 0;
+    int drain_timeout = 60;
+    int crypto_helpers = 0;
+    int crypto_helper_max_jobs = 1000;
+    int encryption_threads = 0;
+    bool pgp_encrypt_once = false;
+    int encryption_cache_size = 0;
+    int encryption_cache_ttl = 300;
+    TransferEncoding smime_transfer_encoding = TransferEncoding::Base64;
     std::string signing_key;
     std::vector<std::string> strip_headers;
 
@@ -61,11 +85,63 @@ struct GeneralSection final : BaseSection {
         if (smtp_server_timeout < -1)
             throw std::invalid_argument("Section 'general' must set smtp_server_timeout >= -1");
 
+        if (smtp_relay_max_failures < 0)
+            throw std::invalid_argument("Section 'general' must set smtp_relay_max_failures >= 0");
+
+        if (smtp_relay_retry_interval < 0)
+            throw std::invalid_argument("Section 'general' must set smtp_relay_retry_interval >= 0");
+
+        if (key_cache_ttl < 0)
+            throw std::invalid_argument("Section 'general' must set key_cache_ttl >= 0");
+
+        if (memory_budget < 0)
+            throw std::invalid_argument("Section 'general' must set memory_budget >= 0");
+
+        if (max_concurrent_encryptions < 0)
+            throw std::invalid_argument("Section 'general' must set max_concurrent_encryptions >= 0");
+
+        if (encryption_threads < 0)
+            throw std::invalid_argument("Section 'general' must set encryption_threads >= 0");
+
+        if (workers < 0)
+            throw std::invalid_argument("Section 'general' must set workers >= 0");
+
+        if (worker_max_messages < 0)
+            throw std::invalid_argument("Section 'general' must set worker_max_messages >= 0");
+
+        if (drain_timeout < 0)
+            throw std::invalid_argument("Section 'general' must set drain_timeout >= 0");
+
+        if (crypto_helpers < 0)
+            throw std::invalid_argument("Section 'general' must set crypto_helpers >= 0");
+
+        if (crypto_helper_max_jobs < 0)
+            throw std::invalid_argument("Section 'general' must set crypto_helper_max_jobs >= 0");
+
+        if (encryption_cache_size < 0)
+            throw std::invalid_argument("Section 'general' must set encryption_cache_size >= 0");
+
+        if (encryption_cache_ttl < 0)
+            throw std::invalid_argument("Section 'general' must set encryption_cache_ttl >= 0");
+
         if (!smtp_server.empty()) {
-            static const std::regex smtp_pattern(R"(^smtps?://.+)");
+            // comma-separated relays
+            static const std::regex smtp_pattern(R"(^\s*smtps?://[^,\s][^,]*(,\s*smtps?://[^,\s][^,]*)*$)");
             if (!std::regex_match(smtp_server, smtp_pattern))
                 throw std::invalid_argument(
-                    "Section 'general' must set smtp_server starting with 'smtp://' or 'smtps://' and include a host");
+                    "Section 'general' must set smtp_server to URLs starting with 'smtp://' or 'smtps://' and "
+                    "including a host, separated by commas");
+        }
+
+        if (smime_transfer_encoding == TransferEncoding::Binary) {
+            // only the native client can send binary data; the body would be prepared for nothing
+            static const std::regex native_option(R"([?&]client=native(&|$))");
+            std::stringstream relays(smtp_server);
+            std::string relay;
+            while (std::getline(relays, relay, ','))
+                if (!std::regex_search(relay, native_option))
+                    throw std::invalid_argument("Section 'general' must set client=native on every smtp_server relay "
+                                                "to use smime_transfer_encoding = binary");
         }
     }
 };
@@ -79,7 +155,24 @@ REGISTER_STATIC_SECTION_MANDATORY(GeneralSection, "general", field("milter_socke
                                   field("milter_timeout", &GeneralSection::milter_timeout),
                                   field("smtp_server", &GeneralSection::smtp_server),
                                   field("smtp_server_timeout", &GeneralSection::smtp_server_timeout),
+                                  field("smtp_relay_max_failures", &GeneralSection::smtp_relay_max_failures),
+                                  field("smtp_relay_retry_interval", &GeneralSection::smtp_relay_retry_interval),
                                   field("dump_email_on_panic", &GeneralSection::dump_email_on_panic),
+                                  field("batch_key_lookup", &GeneralSection::batch_key_lookup),
+                                  field("key_cache_ttl", &GeneralSection::key_cache_ttl),
+                                  field("warm_up", &GeneralSection::warm_up),
+                                  field("memory_budget", &GeneralSection::memory_budget),
+                                  field("max_concurrent_encryptions", &GeneralSection::max_concurrent_encryptions),
+                                  field("workers", &GeneralSection::workers),
+                                  field("worker_max_messages", &GeneralSection::worker_max_messages),
+                                  field("drain_timeout", &GeneralSection::drain_timeout),
+                                  field("crypto_helpers", &GeneralSection::crypto_helpers),
+                                  field("crypto_helper_max_jobs", &GeneralSection::crypto_helper_max_jobs),
+                                  field("encryption_threads", &GeneralSection::encryption_threads),
+                                  field("pgp_encrypt_once", &GeneralSection::pgp_encrypt_once),
+                                  field("encryption_cache_size", &GeneralSection::encryption_cache_size),
+                                  field("encryption_cache_ttl", &GeneralSection::encryption_cache_ttl),
+                                  field("smime_transfer_encoding", &GeneralSection::smime_transfer_encoding),
                                   field("signing_key", &GeneralSection::signing_key),
                                   field("strip_headers", &GeneralSection::strip_headers))
 
@@ -101,12 +194,17 @@ struct BaseEncryptionSection : BaseDynamicSection {
 struct PgpEncryptionSection final : BaseEncryptionSection {
     // optional to detect missing field; validate() enforces presence.
     std::optional<KeyNotFoundPolicy> key_not_found_policy;
+    // Keyring directory used by this section only; the default GnuPG home when empty
+    std::string gnupg_home;
+    Compression compression = Compression::Default;
 
     [[nodiscard]] std::optional<KeyNotFoundPolicy> key_not_found_policy_value() const override
     {
         return key_not_found_policy;
     }
 
+    void prepare() override;
+
     void validate() const
     {
         BaseEncryptionSection::validate();
@@ -121,17 +219,26 @@ struct PgpEncryptionSection final : BaseEncryptionSection {
 
 REGISTER_DYNAMIC_SECTION_INLINE(PgpEncryptionSection, "pgp", field("match", &PgpEncryptionSection::match),
                                 field("encryption_protocol", &PgpEncryptionSection::encryption_protocol),
-                                field("key_not_found_policy", &PgpEncryptionSection::key_not_found_policy))
+                                field("key_not_found_policy", &PgpEncryptionSection::key_not_found_policy),
+                                field("gnupg_home", &PgpEncryptionSection::gnupg_home),
+                                field("compression", &PgpEncryptionSection::compression))
 
 struct SmimeEncryptionSection final : BaseEncryptionSection {
     // optional to detect missing field; validate() enforces presence.
     std::optional<KeyNotFoundPolicy> key_not_found_policy;
+    // Keyring directory used by this section only; the default GnuPG home when empty
+    std::string gnupg_home;
+    CmsBackend cms_backend = CmsBackend::Gpgsm;
+    // Directory of PEM recipient certificates, used by the openssl backend instead of the keyring
+    std::string certificate_dir;
 
     [[nodiscard]] std::optional<KeyNotFoundPolicy> key_not_found_policy_value() const override
     {
         return key_not_found_policy;
     }
 
+    void prepare() override;
+
     void validate() const
     {
         BaseEncryptionSection::validate();
@@ -147,12 +254,26 @@ struct SmimeEncryptionSection final : BaseEncryptionSection {
             throw std::invalid_argument(fmt::format("Section '{}' must set key_not_found_policy to 'discard' or "
                                                     "'reject' (retrieve is not supported for S/MIME)",
                                                     sectionName));
+
+        if (cms_backend == CmsBackend::Openssl) {
+            if (certificate_dir.empty())
+                throw std::invalid_argument(
+                    fmt::format("Section '{}' must define certificate_dir when cms_backend='openssl'", sectionName));
+#ifndef GWMILTER_OPENSSL_CMS
+            throw std::invalid_argument(fmt::format("Section '{}' sets cms_backend='openssl', but gwmilter was built "
+                                                    "without OpenSSL CMS support (ENABLE_OPENSSL_CMS)",
+                                                    sectionName));
+#endif
+        }
     }
 };
 
 REGISTER_DYNAMIC_SECTION_INLINE(SmimeEncryptionSection, "smime", field("match", &SmimeEncryptionSection::match),
                                 field("encryption_protocol", &SmimeEncryptionSection::encryption_protocol),
-                                field("key_not_found_policy", &SmimeEncryptionSection::key_not_found_policy))
+                                field("key_not_found_policy", &SmimeEncryptionSection::key_not_found_policy),
+                                field("gnupg_home", &SmimeEncryptionSection::gnupg_home),
+                                field("cms_backend", &SmimeEncryptionSection::cms_backend),
+                                field("certificate_dir", &SmimeEncryptionSection::certificate_dir))
 
 struct PdfEncryptionSection final : BaseEncryptionSection {
     std::string email_body_replacement;
@@ -163,6 +284,13 @@ struct PdfEncryptionSection final : BaseEncryptionSection {
     float pdf_font_size = 10.0f;
     float pdf_margin = 10.0f;
 
+    // Contents of email_body_replacement and pdf_main_page_if_missing, loaded by prepare().
+    // Shared by all messages; reloaded only when the files change on disk.
+    std::shared_ptr<const gwmilter::utils::cached_file> email_body_replacement_file;
+    std::shared_ptr<const gwmilter::utils::cached_file> pdf_main_page_if_missing_file;
+
+    void prepare() override;
+
     void validate() const
     {
         BaseEncryptionSection::validate();
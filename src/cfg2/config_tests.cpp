@@ -1,8 +1,10 @@
 #include "config.hpp"
 #include "core.hpp"
 #include <algorithm>
+#include <filesystem>
 #include <gtest/gtest.h>
 #include <stdexcept>
+#include <string>
 
 using namespace cfg2;
 
@@ -362,6 +364,153 @@ TEST_F(ConfigTest, DynamicSectionsWithSameNameAsTypeAreHandledCorrectly)
     EXPECT_EQ(smimeMatch->encryption_protocol, EncryptionProtocol::Smime);
 }
 
+TEST_F(ConfigTest, PgpSectionReadsGnupgHome)
+{
+    ConfigNode configNode{"config",
+                          "",
+                          {{"general",
+                            "",
+                            {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE},
+                             {"smtp_server", "smtp://localhost", {}, NodeType::VALUE}},
+                            NodeType::SECTION},
+                           {"encrypt_pgp",
+                            "",
+                            {{"encryption_protocol", "pgp", {}, NodeType::VALUE},
+                             {"match", ".*@test\\.com", {}, NodeType::VALUE},
+                             {"key_not_found_policy", "discard", {}, NodeType::VALUE},
+                             {"gnupg_home", "/tmp/gwmilter-test-gnupg", {}, NodeType::VALUE}},
+                            NodeType::SECTION}},
+                          NodeType::ROOT};
+
+    Config config = parse<Config>(configNode);
+
+    const auto *pgp = dynamic_cast<const PgpEncryptionSection *>(config.find_match("user@test.com"));
+    ASSERT_NE(pgp, nullptr);
+    EXPECT_EQ(pgp->gnupg_home, "/tmp/gwmilter-test-gnupg");
+}
+
+TEST_F(ConfigTest, PgpSectionReadsCompression)
+{
+    ConfigNode configNode{"config",
+                          "",
+                          {{"general",
+                            "",
+                            {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE},
+                             {"smtp_server", "smtp://localhost", {}, NodeType::VALUE},
+                             {"signing_key", "gwmilter-signing-key", {}, NodeType::VALUE}},
+                            NodeType::SECTION},
+                           {"encrypt_pgp",
+                            "",
+                            {{"encryption_protocol", "pgp", {}, NodeType::VALUE},
+                             {"match", ".*@test\\.com", {}, NodeType::VALUE},
+                             {"key_not_found_policy", "discard", {}, NodeType::VALUE},
+                             {"compression", "Auto", {}, NodeType::VALUE}},
+                            NodeType::SECTION},
+                           {"encrypt_pgp_default",
+                            "",
+                            {{"encryption_protocol", "pgp", {}, NodeType::VALUE},
+                             {"match", ".*@example\\.com", {}, NodeType::VALUE},
+                             {"key_not_found_policy", "discard", {}, NodeType::VALUE}},
+                            NodeType::SECTION}},
+                          NodeType::ROOT};
+
+    Config config = parse<Config>(configNode);
+
+    const auto *pgp = dynamic_cast<const PgpEncryptionSection *>(config.find_match("user@test.com"));
+    ASSERT_NE(pgp, nullptr);
+    EXPECT_EQ(pgp->compression, Compression::Auto);
+
+    const auto *pgp_default = dynamic_cast<const PgpEncryptionSection *>(config.find_match("user@example.com"));
+    ASSERT_NE(pgp_default, nullptr);
+    EXPECT_EQ(pgp_default->compression, Compression::Default);
+}
+
+TEST_F(ConfigValidationTest, PgpSectionRejectsInvalidCompression)
+{
+    ConfigNode invalidCompression{"config",
+                                  "",
+                                  {{"general",
+                                    "",
+                                    {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE}},
+                                    NodeType::SECTION},
+                                   {"encrypt_pgp",
+                                    "",
+                                    {{"encryption_protocol", "pgp", {}, NodeType::VALUE},
+                                     {"match", ".*@test\\.com", {}, NodeType::VALUE},
+                                     {"key_not_found_policy", "discard", {}, NodeType::VALUE},
+                                     {"compression", "zlib", {}, NodeType::VALUE}},
+                                    NodeType::SECTION}},
+                                  NodeType::ROOT};
+
+    EXPECT_THROW({ Config config = parse<Config>(invalidCompression); }, std::invalid_argument);
+}
+
+TEST_F(ConfigValidationTest, SmimeSectionOpensslBackendRequiresCertificateDir)
+{
+    ConfigNode missingDir{"config",
+                          "",
+                          {{"general",
+                            "",
+                            {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE}},
+                            NodeType::SECTION},
+                           {"encrypt_smime",
+                            "",
+                            {{"encryption_protocol", "smime", {}, NodeType::VALUE},
+                             {"match", ".*@test\\.com", {}, NodeType::VALUE},
+                             {"key_not_found_policy", "discard", {}, NodeType::VALUE},
+                             {"cms_backend", "openssl", {}, NodeType::VALUE}},
+                            NodeType::SECTION}},
+                          NodeType::ROOT};
+
+    EXPECT_THROW({ Config config = parse<Config>(missingDir); }, std::invalid_argument);
+}
+
+TEST_F(ConfigValidationTest, SmimeSectionOpensslBackendRequiresExistingCertificateDir)
+{
+    const auto config = [](const std::string &certificate_dir) {
+        return ConfigNode{"config",
+                          "",
+                          {{"general",
+                            "",
+                            {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE}},
+                            NodeType::SECTION},
+                           {"encrypt_smime",
+                            "",
+                            {{"encryption_protocol", "smime", {}, NodeType::VALUE},
+                             {"match", ".*@test\\.com", {}, NodeType::VALUE},
+                             {"key_not_found_policy", "discard", {}, NodeType::VALUE},
+                             {"cms_backend", "openssl", {}, NodeType::VALUE},
+                             {"certificate_dir", certificate_dir, {}, NodeType::VALUE}},
+                            NodeType::SECTION}},
+                          NodeType::ROOT};
+    };
+
+#ifdef GWMILTER_OPENSSL_CMS
+    EXPECT_NO_THROW({ Config c = parse<Config>(config(std::filesystem::temp_directory_path().string())); });
+#endif
+    EXPECT_THROW({ Config c = parse<Config>(config("/nonexistent/gwmilter-certificates")); }, std::invalid_argument);
+}
+
+TEST_F(ConfigValidationTest, SmimeSectionRejectsInvalidCmsBackend)
+{
+    ConfigNode invalidBackend{"config",
+                              "",
+                              {{"general",
+                                "",
+                                {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE}},
+                                NodeType::SECTION},
+                               {"encrypt_smime",
+                                "",
+                                {{"encryption_protocol", "smime", {}, NodeType::VALUE},
+                                 {"match", ".*@test\\.com", {}, NodeType::VALUE},
+                                 {"key_not_found_policy", "discard", {}, NodeType::VALUE},
+                                 {"cms_backend", "nss", {}, NodeType::VALUE}},
+                                NodeType::SECTION}},
+                              NodeType::ROOT};
+
+    EXPECT_THROW({ Config config = parse<Config>(invalidBackend); }, std::invalid_argument);
+}
+
 TEST_F(ConfigValidationTest, PgpSectionRejectsInvalidKeyPolicy)
 {
     ConfigNode invalidPolicy{"config",
@@ -474,6 +623,92 @@ TEST_F(ConfigValidationTest, GeneralSectionRejectsInvalidLogFacility)
     EXPECT_THROW({ Config config = parse<Config>(invalidFacility); }, std::invalid_argument);
 }
 
+TEST_F(ConfigValidationTest, GeneralSectionRejectsNegativeWorkers)
+{
+    ConfigNode negativeWorkers{"config",
+                               "",
+                               {{"general",
+                                 "",
+                                 {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE},
+                                  {"workers", "-1", {}, NodeType::VALUE}},
+                                 NodeType::SECTION}},
+                               NodeType::ROOT};
+
+    EXPECT_THROW({ Config config = parse<Config>(negativeWorkers); }, std::invalid_argument);
+}
+
+TEST_F(ConfigValidationTest, GeneralSectionRejectsNegativeEncryptionCacheSize)
+{
+    ConfigNode negativeCacheSize{"config",
+                                 "",
+                                 {{"general",
+                                   "",
+                                   {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE},
+                                    {"encryption_cache_size", "-1", {}, NodeType::VALUE}},
+                                   NodeType::SECTION}},
+                                 NodeType::ROOT};
+
+    EXPECT_THROW({ Config config = parse<Config>(negativeCacheSize); }, std::invalid_argument);
+}
+
+TEST_F(ConfigValidationTest, GeneralSectionRejectsInvalidSmimeTransferEncoding)
+{
+    ConfigNode invalidEncoding{"config",
+                               "",
+                               {{"general",
+                                 "",
+                                 {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE},
+                                  {"smime_transfer_encoding", "8bit", {}, NodeType::VALUE}},
+                                 NodeType::SECTION}},
+                               NodeType::ROOT};
+
+    EXPECT_THROW({ Config config = parse<Config>(invalidEncoding); }, std::invalid_argument);
+}
+
+TEST_F(ConfigValidationTest, GeneralSectionAcceptsSeveralSmtpRelays)
+{
+    const auto general = [](const std::string &smtp_server) {
+        return ConfigNode{"config",
+                          "",
+                          {{"general",
+                            "",
+                            {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE},
+                             {"smtp_server", smtp_server, {}, NodeType::VALUE}},
+                            NodeType::SECTION}},
+                          NodeType::ROOT};
+    };
+
+    Config config = parse<Config>(general("smtp://relay1:25?weight=2, smtps://relay2"));
+    EXPECT_EQ(config.general.smtp_server, "smtp://relay1:25?weight=2, smtps://relay2");
+    EXPECT_EQ(config.general.smtp_relay_max_failures, 3);
+    EXPECT_EQ(config.general.smtp_relay_retry_interval, 30);
+
+    EXPECT_THROW({ Config c = parse<Config>(general("smtp://relay1,relay2")); }, std::invalid_argument);
+    EXPECT_THROW({ Config c = parse<Config>(general("smtp://relay1,")); }, std::invalid_argument);
+}
+
+TEST_F(ConfigValidationTest, BinarySmimeTransferEncodingRequiresNativeRelays)
+{
+    const auto general = [](const std::string &smtp_server) {
+        return ConfigNode{"config",
+                          "",
+                          {{"general",
+                            "",
+                            {{"milter_socket", "unix:/tmp/test.sock", {}, NodeType::VALUE},
+                             {"smtp_server", smtp_server, {}, NodeType::VALUE},
+                             {"smime_transfer_encoding", "Binary", {}, NodeType::VALUE}},
+                            NodeType::SECTION}},
+                          NodeType::ROOT};
+    };
+
+    Config config = parse<Config>(general("smtp://relay1?client=native, smtp://relay2?weight=2&client=native"));
+    EXPECT_EQ(config.general.smime_transfer_encoding, TransferEncoding::Binary);
+
+    EXPECT_THROW({ Config c = parse<Config>(general("smtp://relay1")); }, std::invalid_argument);
+    EXPECT_THROW({ Config c = parse<Config>(general("smtp://relay1?client=native, smtp://relay2")); },
+                 std::invalid_argument);
+}
+
 TEST_F(ConfigValidationTest, MissingEncryptionProtocolThrowsException)
 {
     ConfigNode missingProtocol{
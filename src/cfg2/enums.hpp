@@ -13,6 +13,15 @@ enum class EncryptionProtocol { Pgp, Smime, Pdf, None };
 // Key not found policy options
 enum class KeyNotFoundPolicy { Discard, Retrieve, Reject };
 
+// Compression of OpenPGP messages: as configured in GnuPG, never, or skipped for mostly compressed bodies
+enum class Compression { Default, None, Auto };
+
+// Implementation of S/MIME encryption: GnuPG's gpgsm engine, or OpenSSL in process
+enum class CmsBackend { Gpgsm, Openssl };
+
+// Content-Transfer-Encoding of the re-injected S/MIME emails
+enum class TransferEncoding { Base64, Binary };
+
 // String conversion for EncryptionProtocol
 template<typename T> T fromString(const std::string &str);
 
@@ -43,6 +52,38 @@ template<> [[nodiscard]] inline KeyNotFoundPolicy fromString<KeyNotFoundPolicy>(
                                 " (expected: discard, retrieve, reject)");
 }
 
+template<> [[nodiscard]] inline Compression fromString<Compression>(const std::string &str)
+{
+    const std::string lower = gwmilter::utils::string::to_lower(str);
+    if (lower == "default")
+        return Compression::Default;
+    if (lower == "none")
+        return Compression::None;
+    if (lower == "auto")
+        return Compression::Auto;
+    throw std::invalid_argument("Invalid compression value: " + str + " (expected: default, none, auto)");
+}
+
+template<> [[nodiscard]] inline CmsBackend fromString<CmsBackend>(const std::string &str)
+{
+    const std::string lower = gwmilter::utils::string::to_lower(str);
+    if (lower == "gpgsm")
+        return CmsBackend::Gpgsm;
+    if (lower == "openssl")
+        return CmsBackend::Openssl;
+    throw std::invalid_argument("Invalid cms_backend value: " + str + " (expected: gpgsm, openssl)");
+}
+
+template<> [[nodiscard]] inline TransferEncoding fromString<TransferEncoding>(const std::string &str)
+{
+    const std::string lower = gwmilter::utils::string::to_lower(str);
+    if (lower == "base64")
+        return TransferEncoding::Base64;
+    if (lower == "binary")
+        return TransferEncoding::Binary;
+    throw std::invalid_argument("Invalid transfer encoding value: " + str + " (expected: base64, binary)");
+}
+
 // toString functions for logging and error messages
 [[nodiscard]] inline std::string_view toString(EncryptionProtocol p)
 {
@@ -72,4 +113,39 @@ template<> [[nodiscard]] inline KeyNotFoundPolicy fromString<KeyNotFoundPolicy>(
     __builtin_unreachable();
 }
 
+[[nodiscard]] inline std::string_view toString(Compression c)
+{
+    switch (c) {
+    case Compression::Default:
+        return "default";
+    case Compression::None:
+        return "none";
+    case Compression::Auto:
+        return "auto";
+    }
+    __builtin_unreachable();
+}
+
+[[nodiscard]] inline std::string_view toString(CmsBackend b)
+{
+    switch (b) {
+    case CmsBackend::Gpgsm:
+        return "gpgsm";
+    case CmsBackend::Openssl:
+        return "openssl";
+    }
+    __builtin_unreachable();
+}
+
+[[nodiscard]] inline std::string_view toString(TransferEncoding e)
+{
+    switch (e) {
+    case TransferEncoding::Base64:
+        return "base64";
+    case TransferEncoding::Binary:
+        return "binary";
+    }
+    __builtin_unreachable();
+}
+
 } // namespace cfg2
@@ -35,6 +35,10 @@ struct BaseDynamicSection : BaseSection {
         return false;
     }
 
+    // Prepares runtime state derived from the section's settings (e.g. files the section refers to).
+    // Called once, after the section is deserialized and validated.
+    virtual void prepare() { }
+
     // Compile regex patterns from match strings
     void compileMatches()
     {
@@ -112,6 +116,7 @@ public:
                                                     obj->sectionName = node.key;                                       \
                                                     obj->type = TypeName;                                              \
                                                     obj->compileMatches();                                             \
+                                                    obj->prepare();                                                    \
                                                     return obj;                                                        \
                                                 });                                                                    \
         return true;                                                                                                   \
@@ -1,7 +1,15 @@
 #include "body_handler.hpp"
+#include "keys/crypto_helpers.hpp"
+#include "keys/gpgme_context.hpp"
+#include "keys/key_importer.hpp"
 #include "logger/logger.hpp"
+#include "utils/mime.hpp"
 #include "utils/string.hpp"
+#include <ctime>
+#include <memory>
 #include <random>
+#include <stdexcept>
+#include <utility>
 
 namespace gwmilter {
 
@@ -22,6 +30,16 @@ void body_handler_base::write(const std::string &)
 }
 
 
+std::set<std::string> body_handler_base::find_public_keys(const std::vector<std::string> &recipients) const
+{
+    std::set<std::string> found;
+    for (const auto &r: recipients)
+        if (has_public_key(r))
+            found.insert(r);
+    return found;
+}
+
+
 void body_handler_base::preprocess()
 {
     if (preprocessed_)
@@ -91,27 +109,148 @@ std::string body_handler_base::extract_content_headers(headers_type &content_hea
 }
 
 
-egpgcrypt_body_handler::egpgcrypt_body_handler(gpgme_protocol_t protocol)
-    : crypto_{protocol}
+gpgme_body_handler::gpgme_body_handler(gpgme_protocol_t protocol, std::string gnupg_home,
+                                       std::chrono::seconds key_cache_ttl, cfg2::Compression compression)
+    : keyring_{protocol, std::move(gnupg_home), key_cache_ttl}, compression_{compression}
 { }
 
 
-void egpgcrypt_body_handler::write(const std::string &data)
+void gpgme_body_handler::write(const std::string &data)
 {
     body_handler_base::write(data);
     body_.write(data);
 }
 
 
-bool egpgcrypt_body_handler::has_public_key(const std::string &recipient) const
+bool gpgme_body_handler::has_public_key(const std::string &recipient) const
+{
+    return !keyring_.resolve({recipient}).empty();
+}
+
+
+std::set<std::string> gpgme_body_handler::find_public_keys(const std::vector<std::string> &recipients) const
+{
+    return keyring_.find(recipients);
+}
+
+
+bool gpgme_body_handler::import_public_key(const std::string &recipient)
+{
+    // imports are serialized and coalesced across all messages
+    return keys::key_importer::instance().import(keyring_, recipient);
+}
+
+
+std::string gpgme_body_handler::key_fingerprints(const recipients_type &recipients) const
+{
+    const auto resolved = keyring_.resolve({recipients.begin(), recipients.end()});
+    const std::time_t now = std::time(nullptr);
+
+    std::string fingerprints;
+    for (const auto &[_, keys]: resolved)
+        for (const auto &key: keys)
+            if (keys::key_cache::usable(key.get(), now))
+                fingerprints += std::string{key->fpr} + '\n';
+    return fingerprints;
+}
+
+
+std::string gpgme_body_handler::encrypt_body(const recipients_type &recipients)
 {
-    return crypto_.has_public_key(recipient);
+    const auto keys = select_keys(recipients);
+    const std::string plain = body_.content();
+    return encrypt_to(keys, plain, encrypt_options(plain));
 }
 
 
-bool egpgcrypt_body_handler::import_public_key(const std::string &recipient)
+std::vector<keys::key_ptr> gpgme_body_handler::select_keys(const recipients_type &recipients)
 {
-    return crypto_.import_public_key(recipient);
+    // The keys were resolved while checking the recipients, hence they are normally taken from the cache.
+    // Recipients without a usable key are reported as failed, instead of failing the encryption.
+    const auto resolved = keyring_.resolve({recipients.begin(), recipients.end()});
+    const std::time_t now = std::time(nullptr);
+
+    std::vector<keys::key_ptr> keys;
+    for (const auto &r: recipients) {
+        bool usable = false;
+        if (auto it = resolved.find(r); it != resolved.end()) {
+            for (const auto &key: it->second) {
+                if (keys::key_cache::usable(key.get(), now)) {
+                    keys.push_back(key);
+                    usable = true;
+                }
+            }
+        }
+        if (!usable)
+            expired_keys_.insert(r);
+    }
+
+    // with no keys GPGME would fall back to symmetric encryption
+    if (keys.empty())
+        throw std::runtime_error("None of the recipients has a usable public key");
+
+    return keys;
+}
+
+
+keys::encrypt_options gpgme_body_handler::encrypt_options(std::string_view plain) const
+{
+    // compressing data that is compressed already costs CPU time without making it smaller
+    static constexpr double max_compressed_share = 0.5;
+
+    keys::encrypt_options options;
+    switch (compression_) {
+    case cfg2::Compression::Default:
+        break;
+    case cfg2::Compression::None:
+        options.compress = false;
+        break;
+    case cfg2::Compression::Auto:
+        options.compress = utils::mime::compressed_share(plain) < max_compressed_share;
+        if (!options.compress)
+            spdlog::debug("Body is mostly compressed parts, encrypting without compression");
+        break;
+    }
+    return options;
+}
+
+
+std::string gpgme_body_handler::encrypt_to(const std::vector<keys::key_ptr> &keys, std::string_view plain,
+                                           const keys::encrypt_options &options) const
+{
+    auto &helpers = keys::crypto_helpers::instance();
+    if (helpers.enabled()) {
+        std::vector<std::string> fingerprints;
+        for (const auto &key: keys)
+            fingerprints.emplace_back(key->fpr);
+        if (auto encrypted = helpers.encrypt(keyring_.protocol(), keyring_.home_dir(), fingerprints, plain, options))
+            return std::move(*encrypted);
+        // no helper could be spawned, encrypted below
+    }
+
+    keys::gpgme_context ctx(keyring_.protocol(), keyring_.home_dir());
+
+    gpgme_data_t in = nullptr;
+    keys::check(gpgme_data_new_from_mem(&in, plain.data(), plain.size(), 0), "gpgme_data_new_from_mem");
+    const std::unique_ptr<gpgme_data, decltype(&gpgme_data_release)> in_guard{in, gpgme_data_release};
+
+    gpgme_data_t out = nullptr;
+    keys::check(gpgme_data_new(&out), "gpgme_data_new");
+    std::unique_ptr<gpgme_data, decltype(&gpgme_data_release)> out_guard{out, gpgme_data_release};
+
+    std::vector<gpgme_key_t> raw_keys;
+    for (const auto &key: keys)
+        raw_keys.push_back(key.get());
+    keys::encrypt(ctx, std::move(raw_keys), in, out, options);
+
+    std::size_t size = 0;
+    char *data = gpgme_data_release_and_get_mem(out_guard.release(), &size);
+    if (data == nullptr)
+        throw std::runtime_error("gpgme_data_release_and_get_mem() failed");
+    std::string encrypted(data, size);
+    gpgme_free(data);
+
+    return encrypted;
 }
 
 } // namespace gwmilter
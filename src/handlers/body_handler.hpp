@@ -1,12 +1,19 @@
 #pragma once
+#include "cfg2/enums.hpp"
 #include "headers.hpp"
+#include "keys/gpgme_context.hpp"
+#include "keys/keyring.hpp"
+#include <chrono>
 #include <crypto.hpp>
 #include <data_buffers.hpp>
 #include <epdf.hpp>
 #include <map>
+#include <memory>
 #include <mime_unpacker.hpp>
 #include <set>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #ifdef UNIT_TESTING
 #include <gtest/gtest_prod.h>
@@ -16,6 +23,14 @@ namespace cfg2 {
 struct PdfEncryptionSection;
 }
 
+namespace gwmilter::utils {
+class cached_file;
+}
+
+namespace gwmilter::keys {
+class cms_encryptor;
+}
+
 namespace gwmilter {
 
 using recipients_type = std::set<std::string>;
@@ -32,6 +47,8 @@ public:
     virtual void encrypt(const recipients_type &recipients, std::string &out) = 0;
 
     virtual bool has_public_key(const std::string &recipient) const = 0;
+    // Returns the recipients that have a public key; checks them one by one unless overridden
+    virtual std::set<std::string> find_public_keys(const std::vector<std::string> &recipients) const;
     virtual bool import_public_key(const std::string &recipient) = 0;
 
     const std::set<std::string> &failed_recipients() { return expired_keys_; }
@@ -65,41 +82,97 @@ protected:
 };
 
 
-class egpgcrypt_body_handler : public body_handler_base {
+class gpgme_body_handler : public body_handler_base {
 public:
-    explicit egpgcrypt_body_handler(gpgme_protocol_t protocol);
+    // gnupg_home selects the keyring directory; the default GnuPG home is used when empty.
+    // compression applies to OpenPGP only.
+    gpgme_body_handler(gpgme_protocol_t protocol, std::string gnupg_home, std::chrono::seconds key_cache_ttl,
+                       cfg2::Compression compression = cfg2::Compression::Default);
 
     void write(const std::string &data) override;
     bool has_public_key(const std::string &recipient) const override;
+    // Looks up the keys of all recipients with a single keyring search
+    std::set<std::string> find_public_keys(const std::vector<std::string> &recipients) const override;
     bool import_public_key(const std::string &recipient) override;
 
+    // empty for the default GnuPG home
+    [[nodiscard]] const std::string &gnupg_home() const { return keyring_.home_dir(); }
+    // Fingerprints of the usable keys of the recipients, one per line: the keys encrypt() would use.
+    // Taken from the key cache, like the keys resolved while checking the recipients.
+    [[nodiscard]] std::string key_fingerprints(const recipients_type &recipients) const;
+
 protected:
-    egpgcrypt::crypto crypto_;
+    // Encrypts the body with the resolved keys of the recipients; recipients without usable keys
+    // are added to expired_keys_
+    std::string encrypt_body(const recipients_type &recipients);
+    // Returns the usable keys of the recipients, adding the others to expired_keys_.
+    // Throws std::runtime_error if none of the recipients has a usable key.
+    std::vector<keys::key_ptr> select_keys(const recipients_type &recipients);
+    // Encrypts `plain` to the keys, in a crypto helper when they are enabled
+    std::string encrypt_to(const std::vector<keys::key_ptr> &keys, std::string_view plain,
+                           const keys::encrypt_options &options = {}) const;
+    // Options for encrypting `plain`, per compression setting
+    [[nodiscard]] keys::encrypt_options encrypt_options(std::string_view plain) const;
+
+    keys::keyring keyring_;
+    cfg2::Compression compression_;
     // TODO: use file_data_buffer when size is greater than a configurable limit
     egpgcrypt::memory_data_buffer body_;
 };
 
 
-class pgp_body_handler final : public egpgcrypt_body_handler {
+class pgp_body_handler final : public gpgme_body_handler {
 public:
-    pgp_body_handler();
+    explicit pgp_body_handler(std::string gnupg_home = {}, std::chrono::seconds key_cache_ttl = std::chrono::seconds{0},
+                              cfg2::Compression compression = cfg2::Compression::Default);
 
     headers_type get_headers() override;
     void encrypt(const recipients_type &recipients, std::string &out) override;
 
+    // One section of a message, as given to encrypt()
+    struct job {
+        pgp_body_handler *handler;
+        const recipients_type *recipients;
+        std::string *out;
+    };
+
+    // Encrypts the same body for several sections at once: the data is encrypted a single time, to the keys
+    // of all sections, and each section gets the encrypted data with its own session key packets only.
+    // Falls back to encrypting the sections separately if the message cannot be split that way.
+    // Returns false, without doing anything, unless there are several jobs sharing the same GnuPG home and
+    // compression setting.
+    // Throws like encrypt().
+    static bool encrypt_once(const std::vector<job> &jobs);
+
 private:
+    // Appends the RFC 3156 MIME structure around the armored message to `out`, with CRLF line endings
+    void wrap(const std::string &encrypted_body, std::string &out) const;
+
     std::string main_boundary_;
 };
 
 
-class smime_body_handler final : public egpgcrypt_body_handler {
+class smime_body_handler final : public gpgme_body_handler {
 public:
-    smime_body_handler();
+    // With an encryptor, the body is encrypted in process with OpenSSL to the certificates of the encryptor,
+    // instead of the keyring
+    explicit smime_body_handler(std::string gnupg_home = {},
+                                std::chrono::seconds key_cache_ttl = std::chrono::seconds{0},
+                                std::shared_ptr<const keys::cms_encryptor> encryptor = nullptr);
 
     headers_type get_headers() override;
     void encrypt(const recipients_type &recipients, std::string &out) override;
+    bool has_public_key(const std::string &recipient) const override;
+    std::set<std::string> find_public_keys(const std::vector<std::string> &recipients) const override;
+    bool import_public_key(const std::string &recipient) override;
+
+    // Binary (DER) form of an encrypted body, for servers accepting BINARYMIME
+    static std::string to_binary(const std::string &encrypted_body);
+    // Switches the headers returned by get_headers() to the binary form of the body
+    static void set_binary_transfer_encoding(headers_type &headers);
 
 private:
+    std::shared_ptr<const keys::cms_encryptor> encryptor_;
     bool new_headers_added_;
 };
 
@@ -118,9 +191,6 @@ protected:
     void preprocess() override;
     void postprocess() override;
 
-private:
-    static std::string read_file(const std::string &filename);
-
 private:
     epdfcrypt::memory_mime_stream body_;
     std::string main_boundary_;
@@ -131,8 +201,8 @@ private:
     float pdf_font_size_;
     float pdf_margin_;
     std::string pdf_password_;
-    std::string pdf_main_page_if_missing_;
-    std::string email_body_replacement_;
+    std::shared_ptr<const utils::cached_file> pdf_main_page_if_missing_;
+    std::shared_ptr<const utils::cached_file> email_body_replacement_;
 };
 
 
@@ -0,0 +1,137 @@
+#include "encryption_cache.hpp"
+#include "logger/logger.hpp"
+#include "utils/string.hpp"
+#include <algorithm>
+#include <glib.h>
+#include <utility>
+
+namespace gwmilter {
+
+namespace {
+
+// the statistics are logged every so many lookups
+constexpr std::uint64_t stats_interval = 1000;
+
+} // namespace
+
+
+encryption_cache &encryption_cache::instance()
+{
+    static encryption_cache cache;
+    return cache;
+}
+
+
+std::string encryption_cache::make_key(const std::vector<std::string_view> &fields)
+{
+    const std::unique_ptr<GChecksum, decltype(&g_checksum_free)> checksum{g_checksum_new(G_CHECKSUM_SHA256),
+                                                                         g_checksum_free};
+    for (const auto field: fields) {
+        // each field is prefixed with its size, so that moving data between fields changes the key
+        const std::string size = std::to_string(field.size()) + ':';
+        g_checksum_update(checksum.get(), reinterpret_cast<const guchar *>(size.data()),
+                          static_cast<gssize>(size.size()));
+        g_checksum_update(checksum.get(), reinterpret_cast<const guchar *>(field.data()),
+                          static_cast<gssize>(field.size()));
+    }
+    return g_checksum_get_string(checksum.get());
+}
+
+
+std::optional<encryption_cache::entry> encryption_cache::get(const std::string &key)
+{
+    std::lock_guard lock(mutex_);
+
+    std::optional<entry> found;
+    if (auto it = index_.find(key); it != index_.end()) {
+        if (it->second->expires_at <= clock::now()) {
+            erase(it->second);
+        } else {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            found = it->second->value;
+        }
+    }
+
+    if (found)
+        ++stats_.hits;
+    else
+        ++stats_.misses;
+
+    if (const std::uint64_t lookups = stats_.hits + stats_.misses; lookups % stats_interval == 0)
+        spdlog::info("Encryption cache: {} entries, {} bytes, {:.1f}% hits over {} lookups, {} evictions",
+                     stats_.entries, stats_.size, 100.0 * static_cast<double>(stats_.hits) / lookups, lookups,
+                     stats_.evictions);
+
+    return found;
+}
+
+
+void encryption_cache::put(const std::string &key, entry e, std::chrono::seconds ttl, std::size_t max_size)
+{
+    std::size_t size = key.size() + e.encrypted_body->size();
+    for (const auto &h: e.headers)
+        size += h.name.size() + h.value.size();
+
+    if (ttl.count() <= 0 || size > max_size)
+        return;
+
+    const auto now = clock::now();
+    std::lock_guard lock(mutex_);
+
+    if (auto it = index_.find(key); it != index_.end())
+        erase(it->second);
+
+    // the expired entries are usually the least recently used ones
+    while (!lru_.empty() && (lru_.back().expires_at <= now || stats_.size + size > max_size)) {
+        if (lru_.back().expires_at > now)
+            ++stats_.evictions;
+        erase(std::prev(lru_.end()));
+    }
+
+    lru_.push_front(node{key, std::move(e), size, now + ttl});
+    index_[key] = lru_.begin();
+    ++stats_.entries;
+    stats_.size += size;
+}
+
+
+void encryption_cache::clear()
+{
+    std::lock_guard lock(mutex_);
+    lru_.clear();
+    index_.clear();
+    stats_.entries = 0;
+    stats_.size = 0;
+}
+
+
+encryption_cache::statistics encryption_cache::stats() const
+{
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+
+void encryption_cache::restore_headers(headers_type &headers, const headers_type &cached)
+{
+    for (const auto &c: cached) {
+        auto it = std::find_if(headers.begin(), headers.end(), [&c](const header_item &h) {
+            return h.index == c.index && utils::string::iequals(h.name, c.name);
+        });
+        if (it != headers.end())
+            *it = c;
+        else
+            headers.push_back(c);
+    }
+}
+
+
+void encryption_cache::erase(lru_list::iterator it)
+{
+    --stats_.entries;
+    stats_.size -= it->size;
+    index_.erase(it->key);
+    lru_.erase(it);
+}
+
+} // namespace gwmilter
@@ -0,0 +1,75 @@
+#pragma once
+#include "headers.hpp"
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace gwmilter {
+
+// Encrypted bodies of recent emails, shared by all messages, so that an email submitted again with the same
+// content to the same recipients (e.g. by a mailing list exploder) is not encrypted again.
+// Entries are identified by a digest of the section, the Content-* headers, the body and the recipients.
+// They expire after the TTL given when stored, and the least recently used ones are evicted to stay within
+// the size given when stored, so that both limits follow configuration reloads.
+class encryption_cache {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct entry {
+        // never modified once cached
+        std::shared_ptr<std::string> encrypted_body;
+        // Content-* headers set by the body handler
+        headers_type headers;
+    };
+
+    struct statistics {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        std::size_t entries = 0;
+        std::size_t size = 0;
+    };
+
+    static encryption_cache &instance();
+
+    // SHA-256 digest of the fields, in hex
+    [[nodiscard]] static std::string make_key(const std::vector<std::string_view> &fields);
+
+    // Returns the cached entry, or nullopt if it is not cached or has expired; counts a hit or a miss
+    [[nodiscard]] std::optional<entry> get(const std::string &key);
+    // Stores the entry, evicting the least recently used ones beyond max_size bytes; a zero TTL or an entry
+    // larger than max_size is not cached
+    void put(const std::string &key, entry e, std::chrono::seconds ttl, std::size_t max_size);
+    void clear();
+    [[nodiscard]] statistics stats() const;
+
+    // Overrides the headers of a body handler with the cached ones, matched by name and index
+    static void restore_headers(headers_type &headers, const headers_type &cached);
+
+private:
+    struct node {
+        std::string key;
+        entry value;
+        std::size_t size;
+        clock::time_point expires_at;
+    };
+    using lru_list = std::list<node>;
+
+    // called with the mutex locked
+    void erase(lru_list::iterator it);
+
+    mutable std::mutex mutex_;
+    // most recently used first
+    lru_list lru_;
+    std::unordered_map<std::string, lru_list::iterator> index_;
+    statistics stats_;
+};
+
+} // namespace gwmilter
@@ -0,0 +1,93 @@
+#include "encryption_cache.hpp"
+#include <chrono>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+using namespace gwmilter;
+using namespace std::chrono_literals;
+
+class EncryptionCacheTest : public ::testing::Test {
+protected:
+    static encryption_cache::entry make_entry(const std::string &body)
+    {
+        return {std::make_shared<std::string>(body), {{"Content-Type", "multipart/encrypted", 1, true}}};
+    }
+
+    encryption_cache cache_;
+};
+
+TEST_F(EncryptionCacheTest, MakeKeyIsSha256OfSizePrefixedFields)
+{
+    // sha256("5:hello")
+    EXPECT_EQ(encryption_cache::make_key({"hello"}),
+              "a3a285698dc7dbfe23947339ee187d471f643617f88b4af70209bb1a01edd9d9");
+    EXPECT_EQ(encryption_cache::make_key({"ab", "c"}), encryption_cache::make_key({"ab", "c"}));
+    EXPECT_NE(encryption_cache::make_key({"ab", "c"}), encryption_cache::make_key({"a", "bc"}));
+}
+
+TEST_F(EncryptionCacheTest, GetReturnsStoredEntryAndCountsHits)
+{
+    EXPECT_FALSE(cache_.get("key").has_value());
+
+    cache_.put("key", make_entry("encrypted"), 60s, 1024);
+    const auto found = cache_.get("key");
+    ASSERT_TRUE(found.has_value());
+    EXPECT_EQ(*found->encrypted_body, "encrypted");
+    ASSERT_EQ(found->headers.size(), 1U);
+    EXPECT_EQ(found->headers[0].value, "multipart/encrypted");
+
+    const auto stats = cache_.stats();
+    EXPECT_EQ(stats.hits, 1U);
+    EXPECT_EQ(stats.misses, 1U);
+    EXPECT_EQ(stats.entries, 1U);
+}
+
+TEST_F(EncryptionCacheTest, PutWithZeroTtlOrOversizedEntryDoesNotCache)
+{
+    cache_.put("key", make_entry("encrypted"), 0s, 1024);
+    cache_.put("other", make_entry(std::string(2048, 'x')), 60s, 1024);
+    EXPECT_EQ(cache_.stats().entries, 0U);
+}
+
+TEST_F(EncryptionCacheTest, PutEvictsLeastRecentlyUsedEntries)
+{
+    // each entry takes about 140 bytes
+    cache_.put("a", make_entry(std::string(100, 'a')), 60s, 300);
+    cache_.put("b", make_entry(std::string(100, 'b')), 60s, 300);
+    ASSERT_TRUE(cache_.get("a").has_value());
+
+    cache_.put("c", make_entry(std::string(100, 'c')), 60s, 300);
+    EXPECT_TRUE(cache_.get("a").has_value());
+    EXPECT_FALSE(cache_.get("b").has_value());
+    EXPECT_TRUE(cache_.get("c").has_value());
+
+    const auto stats = cache_.stats();
+    EXPECT_EQ(stats.evictions, 1U);
+    EXPECT_EQ(stats.entries, 2U);
+    EXPECT_LE(stats.size, 300U);
+}
+
+TEST_F(EncryptionCacheTest, ClearDropsEntries)
+{
+    cache_.put("key", make_entry("encrypted"), 60s, 1024);
+    cache_.clear();
+    EXPECT_FALSE(cache_.get("key").has_value());
+    EXPECT_EQ(cache_.stats().size, 0U);
+}
+
+TEST_F(EncryptionCacheTest, RestoreHeadersOverridesMatchingHeaders)
+{
+    headers_type headers{{"Subject", "hello", 1, false},
+                         {"content-type", "multipart/encrypted; boundary=\"new\"", 1, true},
+                         {"Content-Transfer-Encoding", "", 1, true}};
+    const headers_type cached{{"Content-Type", "multipart/encrypted; boundary=\"old\"", 1, true},
+                              {"Content-Transfer-Encoding", "", 1, true},
+                              {"Content-Description", "S/MIME Encrypted Message", 1, true}};
+
+    encryption_cache::restore_headers(headers, cached);
+    ASSERT_EQ(headers.size(), 4U);
+    EXPECT_EQ(headers[0].value, "hello");
+    EXPECT_EQ(headers[1].value, "multipart/encrypted; boundary=\"old\"");
+    EXPECT_EQ(headers[3].name, "Content-Description");
+}
@@ -1,9 +1,9 @@
 #include "body_handler.hpp"
 #include "cfg2/config.hpp"
 #include "logger/logger.hpp"
+#include "utils/cached_file.hpp"
 #include "utils/string.hpp"
 #include <algorithm>
-#include <fstream>
 
 namespace gwmilter {
 
@@ -16,8 +16,8 @@ pdf_body_handler::pdf_body_handler(const cfg2::PdfEncryptionSection &settings)
       pdf_font_size_{settings.pdf_font_size},
       pdf_margin_{settings.pdf_margin},
       pdf_password_{settings.pdf_password},
-      pdf_main_page_if_missing_{settings.pdf_main_page_if_missing},
-      email_body_replacement_{settings.email_body_replacement}
+      pdf_main_page_if_missing_{settings.pdf_main_page_if_missing_file},
+      email_body_replacement_{settings.email_body_replacement_file}
 { }
 
 
@@ -55,60 +55,79 @@ void pdf_body_handler::encrypt(const recipients_type &recipients, std::string &o
     postprocess();
 
     body_.flush();
-    mime_unpacker unpacker(body_);
-    unpacker.unpack();
-    string body = unpacker.body_text();
-
-    spdlog::debug("PDF settings: pdf_font_path=\"{}\", pdf_font_size={}, pdf_margin={})", pdf_font_path_,
-                  pdf_font_size_, pdf_margin_);
-    epdf pdf(pdf_font_path_, true, pdf_font_size_, pdf_margin_);
-
-    if (!pdf_password_.empty())
-        pdf.set_password(pdf_password_);
-
-    if (!body.empty()) {
-        spdlog::debug("PDF body created from email; size={}", body.size());
-        pdf.add_text(body);
-    } else if (!pdf_main_page_if_missing_.empty()) {
-        spdlog::debug("PDF body set from file (could not get from email)");
-        pdf.add_text(pdf_body_handler::read_file(pdf_main_page_if_missing_));
-    } else
-        spdlog::debug("PDF body left empty");
-
-    // attach the original unpacked email parts
-    for (const auto &part: unpacker.parts())
-        pdf.attach(part);
+
+    // The document, the unpacked parts and the extracted text are released once the
+    // PDF is encoded, so that they don't coexist with the output assembled below.
+    string encoded_pdf;
+    {
+        mime_unpacker unpacker(body_);
+        unpacker.unpack();
+        const string body = unpacker.body_text();
+
+        spdlog::debug("PDF settings: pdf_font_path=\"{}\", pdf_font_size={}, pdf_margin={})", pdf_font_path_,
+                      pdf_font_size_, pdf_margin_);
+        epdf pdf(pdf_font_path_, true, pdf_font_size_, pdf_margin_);
+
+        if (!pdf_password_.empty())
+            pdf.set_password(pdf_password_);
+
+        if (!body.empty()) {
+            spdlog::debug("PDF body created from email; size={}", body.size());
+            pdf.add_text(body);
+        } else if (pdf_main_page_if_missing_ != nullptr) {
+            spdlog::debug("PDF body set from file (could not get from email)");
+            pdf.add_text(*pdf_main_page_if_missing_->content());
+        } else
+            spdlog::debug("PDF body left empty");
+
+        // attach the original unpacked email parts
+        for (const auto &part: unpacker.parts())
+            pdf.attach(part);
+
+        encoded_pdf = pdf.base64();
+    }
+
+    const auto body_replacement = email_body_replacement_ != nullptr ? email_body_replacement_->content() : nullptr;
+    if (body_replacement != nullptr)
+        spdlog::debug("email body replaced");
 
     // clang-format off
-    out =
+    const string text_part_headers =
         "This is a multi-part message in MIME format.\r\n"
         "--" + main_boundary_ + "\r\n"
         "Content-Type: text/plain; charset=ISO-8859-1\r\n"
         "Content-Transfer-Encoding: 7bit\r\n"
         "\r\n";
-    // clang-format on
-
-    if (!email_body_replacement_.empty()) {
-        spdlog::debug("email body replaced");
-        out += pdf_body_handler::read_file(email_body_replacement_);
-    }
-
-    // clang-format off
-    out += "\r\n\r\n"
+    const string pdf_part_headers = "\r\n\r\n"
         "--" + main_boundary_ + "\r\n"
         "Content-Type: application/pdf;\r\n"
         "   name=\"" + pdf_attachment_ + "\"\r\n"
         "Content-Transfer-Encoding: base64\r\n"
         "Content-Disposition: attachment;\r\n"
         "   filename=\"" + pdf_attachment_ + "\"\r\n\r\n";
+    const string closing_boundary = "--" + main_boundary_ + "--\r\n";
     // clang-format on
 
-    out += pdf.base64();
+    // the closing boundary must start on its own line
+    const bool needs_crlf =
+        !encoded_pdf.empty() && (encoded_pdf.size() < 2 || encoded_pdf.compare(encoded_pdf.size() - 2, 2, "\r\n") != 0);
+
+    // allocate the whole body at once, then append the encoded PDF without intermediate copies
+    out.clear();
+    out.reserve(text_part_headers.size() + (body_replacement != nullptr ? body_replacement->size() : 0) +
+                pdf_part_headers.size() + encoded_pdf.size() + 2 + closing_boundary.size());
+
+    out += text_part_headers;
+    if (body_replacement != nullptr)
+        out += *body_replacement;
+    out += pdf_part_headers;
+    out += encoded_pdf;
+    string().swap(encoded_pdf);
 
-    if (out.substr(out.size() - 2) != "\r\n")
+    if (needs_crlf)
         out += "\r\n";
 
-    out += "--" + main_boundary_ + "--\r\n";
+    out += closing_boundary;
 }
 
 
@@ -160,19 +179,4 @@ bool pdf_body_handler::import_public_key(const std::string &recipient)
 }
 
 
-std::string pdf_body_handler::read_file(const std::string &filename)
-{
-    std::ifstream file(filename, std::ios::binary);
-    if (!file)
-        throw std::runtime_error("Unable to open file: " + filename);
-
-    std::stringstream content;
-    string line;
-    while (std::getline(file, line))
-        content << line << "\r\n";
-
-    return content.str();
-}
-
-
 } // namespace gwmilter
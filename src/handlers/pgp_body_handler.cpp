@@ -1,12 +1,44 @@
 #include "body_handler.hpp"
+#include "keys/openpgp.hpp"
 #include "logger/logger.hpp"
 #include "utils/string.hpp"
 #include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
 
 namespace gwmilter {
 
-pgp_body_handler::pgp_body_handler()
-    : egpgcrypt_body_handler{GPGME_PROTOCOL_OpenPGP}, main_boundary_{generate_boundary(30)}
+namespace {
+
+// Compares the content of the buffer with `data`, reading it by chunks instead of copying it whole
+bool same_content(const egpgcrypt::data_buffer &buffer, std::string_view data)
+{
+    gpgme_data_t d = buffer.get();
+    if (gpgme_data_seek(d, 0, SEEK_END) != static_cast<off_t>(data.size()) || gpgme_data_seek(d, 0, SEEK_SET) != 0)
+        return false;
+
+    std::array<char, 65536> chunk;
+    std::size_t pos = 0;
+    ssize_t n;
+    while ((n = gpgme_data_read(d, chunk.data(), chunk.size())) > 0) {
+        if (data.substr(pos, n) != std::string_view{chunk.data(), static_cast<std::size_t>(n)})
+            return false;
+        pos += n;
+    }
+    return n == 0 && pos == data.size();
+}
+
+} // namespace
+
+
+pgp_body_handler::pgp_body_handler(std::string gnupg_home, std::chrono::seconds key_cache_ttl,
+                                   cfg2::Compression compression)
+    : gpgme_body_handler{GPGME_PROTOCOL_OpenPGP, std::move(gnupg_home), key_cache_ttl, compression},
+      main_boundary_{generate_boundary(30)}
 { }
 
 
@@ -37,11 +69,102 @@ headers_type pgp_body_handler::get_headers()
 
 void pgp_body_handler::encrypt(const std::set<std::string> &recipients, std::string &out)
 {
-    using namespace egpgcrypt;
-
     // the body is complete, do the necessary post-processing
     postprocess();
 
+    // encrypt
+    const std::string encrypted_body = encrypt_body(recipients);
+
+    if (!expired_keys_.empty())
+        spdlog::warn("Following PGP keys have expired: {}", utils::string::set_to_string(expired_keys_));
+
+    wrap(encrypted_body, out);
+}
+
+
+bool pgp_body_handler::encrypt_once(const std::vector<job> &jobs)
+{
+    if (jobs.size() < 2)
+        return false;
+    for (const auto &j: jobs)
+        if (j.handler->gnupg_home() != jobs.front().handler->gnupg_home() ||
+            j.handler->compression_ != jobs.front().handler->compression_)
+            return false;
+
+    for (const auto &j: jobs)
+        j.handler->postprocess();
+
+    // the union of the keys, each one once, and the key IDs (of all subkeys) per job
+    std::vector<keys::key_ptr> all_keys;
+    std::set<std::string> fingerprints;
+    std::vector<std::set<std::string>> key_ids(jobs.size());
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        for (const auto &key: jobs[i].handler->select_keys(*jobs[i].recipients)) {
+            for (gpgme_subkey_t sk = key->subkeys; sk != nullptr; sk = sk->next)
+                if (sk->keyid != nullptr)
+                    key_ids[i].insert(sk->keyid);
+            if (fingerprints.insert(key->fpr).second)
+                all_keys.push_back(key);
+        }
+    }
+
+    for (const auto &j: jobs)
+        if (!j.handler->expired_keys_.empty())
+            spdlog::warn("Following PGP keys have expired: {}",
+                         utils::string::set_to_string(j.handler->expired_keys_));
+
+    const std::string plain = jobs.front().handler->body_.content();
+    std::string reason;
+    if (std::any_of(jobs.begin() + 1, jobs.end(),
+                    [&plain](const job &j) { return !same_content(j.handler->body_, plain); }))
+        reason = "the bodies differ";
+
+    if (reason.empty()) {
+        try {
+            // binary output, as the session key packets are spliced before armoring
+            keys::encrypt_options options = jobs.front().handler->encrypt_options(plain);
+            options.armor = false;
+            const std::string encrypted = jobs.front().handler->encrypt_to(all_keys, plain, options);
+            const keys::openpgp::encrypted_message message = keys::openpgp::split(encrypted);
+
+            std::vector<std::string> binaries(jobs.size());
+            for (const auto &sk: message.session_keys) {
+                bool attributed = false;
+                for (std::size_t i = 0; i < jobs.size(); ++i) {
+                    if (key_ids[i].count(sk.key_id) != 0) {
+                        binaries[i].append(sk.packet);
+                        attributed = true;
+                    }
+                }
+                if (!attributed)
+                    throw std::runtime_error(fmt::format("no recipient for session key packet {}", sk.key_id));
+            }
+
+            for (std::size_t i = 0; i < jobs.size(); ++i) {
+                if (binaries[i].empty())
+                    throw std::runtime_error("no session key packet for a section");
+                binaries[i].append(message.payload);
+            }
+
+            for (std::size_t i = 0; i < jobs.size(); ++i)
+                jobs[i].handler->wrap(keys::openpgp::armor(binaries[i]), *jobs[i].out);
+            spdlog::debug("Encrypted the body once for {} PGP sections", jobs.size());
+            return true;
+        } catch (const std::runtime_error &e) {
+            reason = e.what();
+        }
+    }
+
+    spdlog::warn("Unable to encrypt the body once for {} PGP sections ({}), encrypting them separately", jobs.size(),
+                 reason);
+    for (const auto &j: jobs)
+        j.handler->wrap(j.handler->encrypt_body(*j.recipients), *j.out);
+    return true;
+}
+
+
+void pgp_body_handler::wrap(const std::string &encrypted_body, std::string &out) const
+{
     // Prepare body according to RFC 3156
     // clang-format off
     out.append(
@@ -55,26 +178,12 @@ void pgp_body_handler::encrypt(const std::set<std::string> &recipients, std::str
             "\r\n");
     // clang-format on
 
-    // encrypt
-    memory_data_buffer encrypted_body;
-    body_.seek(0, data_buffer::SET);
-    crypto_.encrypt(recipients, expired_keys_, body_, encrypted_body);
-
-    if (!expired_keys_.empty())
-        spdlog::warn("Following PGP keys have expired: {}", utils::string::set_to_string(expired_keys_));
-
-    // get encrypted data
-    encrypted_body.seek(0, data_buffer::SET);
-    std::string tmpbuf;
-    while (encrypted_body.read(tmpbuf)) {
-        // insert \r before \n
-        std::string::size_type pos = 0;
-        while (pos < tmpbuf.size() && (pos = tmpbuf.find('\n', pos)) != std::string::npos) {
-            tmpbuf.insert(pos, 1, '\r');
-            pos += 2;
-        }
-
-        out += tmpbuf;
+    // insert \r before \n
+    out.reserve(out.size() + encrypted_body.size() + encrypted_body.size() / 32);
+    for (const char c: encrypted_body) {
+        if (c == '\n')
+            out += '\r';
+        out += c;
     }
 
     // end MIME
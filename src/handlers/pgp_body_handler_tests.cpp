@@ -76,3 +76,21 @@ TEST_F(PgpBodyHandlerHeadersTest, GetHeadersCreatesContentTypeIfMissing)
     EXPECT_NE(headers[0].value.find("multipart/encrypted"), std::string::npos);
 }
 
+
+TEST(PgpBodyHandlerEncryptOnceTest, RequiresSeveralSectionsSharingTheKeyring)
+{
+    pgp_body_handler first{"/tmp/first"};
+    pgp_body_handler second{"/tmp/second"};
+    const recipients_type recipients{"user@example.com"};
+    std::string first_out;
+    std::string second_out;
+
+    EXPECT_FALSE(pgp_body_handler::encrypt_once({}));
+    EXPECT_FALSE(pgp_body_handler::encrypt_once({{&first, &recipients, &first_out}}));
+    EXPECT_FALSE(
+        pgp_body_handler::encrypt_once({{&first, &recipients, &first_out}, {&second, &recipients, &second_out}}));
+
+    // nothing was done
+    EXPECT_TRUE(first_out.empty());
+    EXPECT_TRUE(second_out.empty());
+}
@@ -1,15 +1,50 @@
 #include "body_handler.hpp"
+#include "keys/openssl_cms.hpp"
 #include "logger/logger.hpp"
 #include "utils/string.hpp"
 #include <algorithm>
+#include <glib.h>
+#include <utility>
 
 namespace gwmilter {
 
-smime_body_handler::smime_body_handler()
-    : egpgcrypt_body_handler{GPGME_PROTOCOL_CMS}, new_headers_added_{false}
+smime_body_handler::smime_body_handler(std::string gnupg_home, std::chrono::seconds key_cache_ttl,
+                                       std::shared_ptr<const keys::cms_encryptor> encryptor)
+    : gpgme_body_handler{GPGME_PROTOCOL_CMS, std::move(gnupg_home), key_cache_ttl},
+      encryptor_{std::move(encryptor)}, new_headers_added_{false}
 { }
 
 
+bool smime_body_handler::has_public_key(const std::string &recipient) const
+{
+    if (encryptor_)
+        return encryptor_->has_certificate(recipient);
+    return gpgme_body_handler::has_public_key(recipient);
+}
+
+
+std::set<std::string> smime_body_handler::find_public_keys(const std::vector<std::string> &recipients) const
+{
+    if (!encryptor_)
+        return gpgme_body_handler::find_public_keys(recipients);
+
+    std::set<std::string> found;
+    for (const auto &r: recipients)
+        if (encryptor_->has_certificate(r))
+            found.insert(r);
+    return found;
+}
+
+
+bool smime_body_handler::import_public_key(const std::string &recipient)
+{
+    // the certificates come from certificate_dir only
+    if (encryptor_)
+        return false;
+    return gpgme_body_handler::import_public_key(recipient);
+}
+
+
 headers_type smime_body_handler::get_headers()
 {
     // clang-format off
@@ -45,32 +80,46 @@ headers_type smime_body_handler::get_headers()
 
 void smime_body_handler::encrypt(const std::set<std::string> &recipients, std::string &out)
 {
-    using namespace egpgcrypt;
-
     // the body is complete, do the necessary post-processing
     postprocess();
 
     // encrypt
-    memory_data_buffer encrypted_body;
-    body_.seek(0, data_buffer::SET);
-    crypto_.encrypt(recipients, expired_keys_, body_, encrypted_body);
+    const std::string encrypted_body =
+        encryptor_ ? encryptor_->encrypt(recipients, body_.content(), expired_keys_) : encrypt_body(recipients);
 
     if (!expired_keys_.empty())
         spdlog::warn("Following S/MIME keys have expired: {}", utils::string::set_to_string(expired_keys_));
 
-    // get encrypted data
-    encrypted_body.seek(0, data_buffer::SET);
-    std::string tmpbuf;
-    while (encrypted_body.read(tmpbuf)) {
-        // insert \r before \n
-        std::string::size_type pos = 0;
-        while (pos < tmpbuf.size() && (pos = tmpbuf.find('\n', pos)) != std::string::npos) {
-            tmpbuf.insert(pos, 1, '\r');
-            pos += 2;
-        }
-
-        out += tmpbuf;
+    // insert \r before \n
+    out.reserve(out.size() + encrypted_body.size() + encrypted_body.size() / 32);
+    for (const char c: encrypted_body) {
+        if (c == '\n')
+            out += '\r';
+        out += c;
     }
 }
 
+
+std::string smime_body_handler::to_binary(const std::string &encrypted_body)
+{
+    std::string binary;
+    binary.resize(encrypted_body.size() / 4 * 3 + 3);
+
+    // the line endings are skipped by the decoder
+    gint state = 0;
+    guint save = 0;
+    const gsize size = g_base64_decode_step(encrypted_body.data(), encrypted_body.size(),
+                                            reinterpret_cast<guchar *>(binary.data()), &state, &save);
+    binary.resize(size);
+    return binary;
+}
+
+
+void smime_body_handler::set_binary_transfer_encoding(headers_type &headers)
+{
+    for (auto &h: headers)
+        if (utils::string::iequals(h.name, "Content-Transfer-Encoding") && !h.value.empty())
+            h.value = "binary";
+}
+
 } // namespace gwmilter
@@ -112,3 +112,22 @@ TEST_F(SmimeBodyHandlerHeadersTest, GetHeadersOnlyAddsExtraHeadersOnce)
     EXPECT_EQ(description_count, 1);
 }
 
+
+TEST(SmimeBodyHandlerBinaryTest, ToBinaryDecodesBase64Lines)
+{
+    EXPECT_EQ(smime_body_handler::to_binary("aGVs\r\nbG8=\r\n"), "hello");
+    EXPECT_EQ(smime_body_handler::to_binary("AAEC/w==\r\n"), std::string("\x00\x01\x02\xff", 4));
+    EXPECT_EQ(smime_body_handler::to_binary(""), "");
+}
+
+TEST_F(SmimeBodyHandlerHeadersTest, SetBinaryTransferEncodingReplacesBase64)
+{
+    headers_type headers = handler.get_headers();
+    smime_body_handler::set_binary_transfer_encoding(headers);
+
+    auto it = std::find_if(headers.begin(), headers.end(),
+                           [](const header_item &h) { return h.name == "Content-Transfer-Encoding"; });
+    ASSERT_NE(it, headers.end());
+    EXPECT_EQ(it->value, "binary");
+    EXPECT_TRUE(it->modified);
+}
@@ -0,0 +1,389 @@
+#include "crypto_helpers.hpp"
+#include "gpgme_context.hpp"
+#include "key_cache.hpp"
+#include "logger/logger.hpp"
+#include "utils/shared_buffer.hpp"
+#include "utils/string.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <memory>
+#include <poll.h>
+#include <spawn.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace gwmilter::keys {
+
+namespace {
+
+// Request: protocol, GnuPG home, options and fingerprints, one per line, with the plain body descriptor.
+// Options are space separated words, e.g. "binary"; the line is empty for the defaults.
+// Reply: "ok" with the encrypted body descriptor, or "error" followed by the message.
+constexpr std::string_view reply_ok = "ok";
+constexpr std::string_view reply_error = "error\n";
+constexpr std::string_view option_binary = "binary";
+constexpr std::string_view option_no_compress = "no-compress";
+
+
+std::string format_options(const encrypt_options &options)
+{
+    std::string line;
+    if (!options.armor)
+        line += std::string{option_binary} + ' ';
+    if (!options.compress)
+        line += std::string{option_no_compress} + ' ';
+    return line;
+}
+
+
+encrypt_options parse_options(const std::string &line)
+{
+    encrypt_options options;
+    std::istringstream is(line);
+    for (std::string word; is >> word;) {
+        if (word == option_binary)
+            options.armor = false;
+        else if (word == option_no_compress)
+            options.compress = false;
+        else
+            throw std::invalid_argument(fmt::format("Unknown encryption option '{}'", word));
+    }
+    return options;
+}
+
+
+void encrypt_request(const std::string &request, const utils::shared_buffer &in, const utils::shared_buffer &out)
+{
+    std::istringstream is(request);
+    std::string protocol_name;
+    std::string home_dir;
+    std::string options_line;
+    std::getline(is, protocol_name);
+    std::getline(is, home_dir);
+    std::getline(is, options_line);
+    const encrypt_options options = parse_options(options_line);
+
+    std::vector<std::string> fingerprints;
+    for (std::string fpr; std::getline(is, fpr);)
+        fingerprints.push_back(std::move(fpr));
+    // an empty pattern list would select every key
+    if (fingerprints.empty())
+        throw std::invalid_argument("No key to encrypt to");
+
+    const gpgme_protocol_t protocol = protocol_name == "cms" ? GPGME_PROTOCOL_CMS : GPGME_PROTOCOL_OpenPGP;
+    gpgme_context ctx(protocol, home_dir);
+
+    std::vector<const char *> patterns;
+    for (const auto &fpr: fingerprints)
+        patterns.push_back(fpr.c_str());
+    patterns.push_back(nullptr);
+
+    std::vector<key_ptr> keys;
+    check(gpgme_op_keylist_ext_start(ctx.get(), patterns.data(), 0, 0), "gpgme_op_keylist_ext_start");
+    gpgme_key_t key = nullptr;
+    gpgme_error_t err = GPG_ERR_NO_ERROR;
+    while ((err = gpgme_op_keylist_next(ctx.get(), &key)) == GPG_ERR_NO_ERROR)
+        keys.push_back(make_key_ptr(key));
+    gpgme_op_keylist_end(ctx.get());
+    if (gpgme_err_code(err) != GPG_ERR_EOF)
+        check(err, "gpgme_op_keylist_next");
+    if (keys.size() < fingerprints.size())
+        throw std::runtime_error("Some of the recipient keys are no longer in the keyring");
+
+    std::vector<gpgme_key_t> raw_keys;
+    for (const auto &k: keys)
+        raw_keys.push_back(k.get());
+
+    const std::string_view plain = in.view();
+    gpgme_data_t in_data = nullptr;
+    check(gpgme_data_new_from_mem(&in_data, plain.data(), plain.size(), 0), "gpgme_data_new_from_mem");
+    const std::unique_ptr<gpgme_data, decltype(&gpgme_data_release)> in_guard{in_data, gpgme_data_release};
+
+    // GPGME writes straight into the shared buffer
+    gpgme_data_t out_data = nullptr;
+    check(gpgme_data_new_from_fd(&out_data, out.fd()), "gpgme_data_new_from_fd");
+    const std::unique_ptr<gpgme_data, decltype(&gpgme_data_release)> out_guard{out_data, gpgme_data_release};
+
+    encrypt(ctx, std::move(raw_keys), in_data, out_data, options);
+}
+
+
+// Waits for the reply of a helper; returns false on timeout (0: none)
+bool wait_reply(int socket, std::chrono::seconds timeout)
+{
+    pollfd pfd{socket, POLLIN, 0};
+    const int timeout_ms = timeout.count() > 0 ? static_cast<int>(std::chrono::milliseconds(timeout).count()) : -1;
+    int rc = 0;
+    do {
+        rc = poll(&pfd, 1, timeout_ms);
+    } while (rc == -1 && errno == EINTR);
+    if (rc == -1)
+        throw std::runtime_error(fmt::format("poll() failed: {}", utils::string::str_err(errno)));
+    return rc == 1;
+}
+
+} // namespace
+
+
+crypto_helpers &crypto_helpers::instance()
+{
+    static crypto_helpers helpers;
+    return helpers;
+}
+
+
+crypto_helpers::~crypto_helpers()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    respawn_cv_.notify_all();
+    if (respawner_.joinable())
+        respawner_.join();
+}
+
+
+void crypto_helpers::start(const std::string &executable, unsigned int count, unsigned int max_jobs,
+                           std::chrono::seconds timeout)
+{
+    std::lock_guard lock(mutex_);
+    executable_ = executable;
+    max_jobs_ = max_jobs;
+    timeout_ = timeout;
+    for (unsigned int i = 0; i < count; ++i) {
+        idle_.push_back(spawn());
+        ++running_;
+    }
+    enabled_ = running_ > 0;
+    if (enabled_ && !respawner_.joinable())
+        respawner_ = std::thread(&crypto_helpers::respawn, this);
+    spdlog::info("Started {} crypto helpers", running_);
+}
+
+
+bool crypto_helpers::enabled() const
+{
+    std::lock_guard lock(mutex_);
+    return enabled_;
+}
+
+
+std::optional<std::string> crypto_helpers::encrypt(gpgme_protocol_t protocol, const std::string &home_dir,
+                                                   const std::vector<std::string> &fingerprints,
+                                                   std::string_view plain, const encrypt_options &options)
+{
+    std::string request = protocol == GPGME_PROTOCOL_CMS ? "cms" : "openpgp";
+    request += '\n' + home_dir;
+    request += '\n' + format_options(options);
+    for (const auto &fpr: fingerprints)
+        request += '\n' + fpr;
+
+    // the only copy of the body, into the pages shared with the helper
+    utils::shared_buffer in;
+    in.assign(plain);
+
+    const std::optional<helper> acquired = acquire();
+    if (!acquired)
+        return std::nullopt;
+
+    helper h = *acquired;
+    std::string reply;
+    int fd = -1;
+    try {
+        utils::send_message(h.socket, request, in.fd());
+        if (!wait_reply(h.socket, timeout_))
+            throw std::runtime_error(fmt::format("no reply after {}s", timeout_.count()));
+        if (!utils::receive_message(h.socket, reply, fd))
+            throw std::runtime_error("helper exited");
+    } catch (const std::exception &e) {
+        const pid_t pid = h.pid;
+        release(h, false);
+        throw std::runtime_error(fmt::format("Crypto helper {} failed: {}", pid, e.what()));
+    }
+
+    const pid_t pid = h.pid;
+    const bool ok = reply == reply_ok && fd != -1;
+    const bool error = reply.compare(0, reply_error.size(), reply_error) == 0;
+    // a helper breaking the protocol is not given another request
+    release(h, ok || error);
+
+    const utils::shared_buffer out(fd);
+    if (error)
+        throw std::runtime_error(reply.substr(reply_error.size()));
+    if (reply != reply_ok)
+        throw std::runtime_error(fmt::format("Crypto helper {} failed: unexpected reply", pid));
+    if (fd == -1)
+        throw std::runtime_error(fmt::format("Crypto helper {} did not return the encrypted body", pid));
+    return std::string{out.view()};
+}
+
+
+int crypto_helpers::serve(int socket)
+{
+    for (;;) {
+        std::string request;
+        int fd = -1;
+        try {
+            if (!utils::receive_message(socket, request, fd))
+                return EXIT_SUCCESS;
+        } catch (const std::exception &e) {
+            spdlog::error("Crypto helper: {}", e.what());
+            return EXIT_FAILURE;
+        }
+
+        const utils::shared_buffer in(fd);
+        try {
+            if (fd == -1)
+                throw std::invalid_argument("Request without a body");
+            const utils::shared_buffer out;
+            encrypt_request(request, in, out);
+            utils::send_message(socket, reply_ok, out.fd());
+        } catch (const std::exception &e) {
+            utils::send_message(socket, std::string{reply_error} + e.what());
+        }
+    }
+}
+
+
+crypto_helpers::helper crypto_helpers::spawn() const
+{
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+        throw std::runtime_error(fmt::format("socketpair() failed: {}", utils::string::str_err(errno)));
+    fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sockets[1], F_SETFD, FD_CLOEXEC);
+
+    // the helper reads its requests from stdin
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sockets[1], STDIN_FILENO);
+
+    // the calling thread may have signals blocked for SignalManager
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    std::string path = executable_;
+    std::string flag = "-x";
+    char *argv[] = {path.data(), flag.data(), nullptr};
+
+    pid_t pid = -1;
+    const int rc = posix_spawn(&pid, path.c_str(), &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    ::close(sockets[1]);
+
+    if (rc != 0) {
+        ::close(sockets[0]);
+        throw std::runtime_error(fmt::format("posix_spawn() failed: {}", utils::string::str_err(rc)));
+    }
+
+    spdlog::debug("Crypto helper {} started", pid);
+    return helper{pid, sockets[0], 0};
+}
+
+
+std::optional<crypto_helpers::helper> crypto_helpers::acquire()
+{
+    std::unique_lock lock(mutex_);
+    // helpers being replaced are waited for, unless their spawn fails
+    cv_.wait(lock, [this] { return !idle_.empty() || (running_ == 0 && (missing_ == 0 || spawn_failing_)); });
+    if (idle_.empty())
+        return std::nullopt;
+
+    helper h = idle_.back();
+    idle_.pop_back();
+    return h;
+}
+
+
+void crypto_helpers::release(helper h, bool healthy)
+{
+    ++h.jobs;
+    if (healthy && (max_jobs_ == 0 || h.jobs < max_jobs_)) {
+        std::lock_guard lock(mutex_);
+        idle_.push_back(h);
+        cv_.notify_one();
+        return;
+    }
+
+    // killing and reaping the helper is quick, spawning its replacement is left to the respawn thread
+    retire(h, healthy);
+    std::lock_guard lock(mutex_);
+    --running_;
+    ++missing_;
+    respawn_cv_.notify_one();
+}
+
+
+void crypto_helpers::respawn()
+{
+    constexpr std::chrono::seconds max_delay{60};
+    std::chrono::seconds delay{1};
+
+    std::unique_lock lock(mutex_);
+    for (;;) {
+        respawn_cv_.wait(lock, [this] { return stopping_ || missing_ > 0; });
+        if (stopping_)
+            return;
+
+        lock.unlock();
+        std::optional<helper> h;
+        try {
+            h = spawn();
+        } catch (const std::exception &e) {
+            spdlog::error("Unable to replace crypto helper, retrying in {}s: {}", delay.count(), e.what());
+        }
+        lock.lock();
+
+        if (h) {
+            --missing_;
+            ++running_;
+            idle_.push_back(*h);
+            spawn_failing_ = false;
+            delay = std::chrono::seconds{1};
+            cv_.notify_all();
+            continue;
+        }
+
+        if (!spawn_failing_ && running_ == 0)
+            spdlog::warn("No crypto helper is running, encrypting in the milter process meanwhile");
+        spawn_failing_ = true;
+        // waiting callers fall back to in-process encryption
+        cv_.notify_all();
+        respawn_cv_.wait_for(lock, delay, [this] { return stopping_; });
+        delay = std::min(delay * 2, max_delay);
+    }
+}
+
+
+void crypto_helpers::retire(const helper &h, bool healthy)
+{
+    // a healthy helper exits once its socket is closed
+    ::close(h.socket);
+    if (!healthy)
+        kill(h.pid, SIGKILL);
+
+    int status = 0;
+    while (waitpid(h.pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    if (!healthy)
+        spdlog::warn("Crypto helper {} replaced after a failure", h.pid);
+    else
+        spdlog::debug("Crypto helper {} replaced after {} jobs", h.pid, h.jobs);
+}
+
+} // namespace gwmilter::keys
@@ -0,0 +1,83 @@
+#pragma once
+#include "gpgme_context.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <gpgme.h>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+namespace gwmilter::keys {
+
+// Pool of helper processes doing the GPGME encryption on behalf of the milter, so that a crash or a leak in
+// GPGME or in the engines only takes a helper down. The helpers run the gwmilter binary in helper mode;
+// bodies are exchanged as utils::shared_buffer descriptors over a unix socket, without being copied through
+// the socket. A helper is replaced after a number of jobs, when it dies, and when it does not reply in time.
+// Replacements are spawned by a background thread, retrying with a growing delay when the spawn fails.
+class crypto_helpers {
+public:
+    static crypto_helpers &instance();
+
+    ~crypto_helpers();
+    crypto_helpers(const crypto_helpers &) = delete;
+    crypto_helpers &operator=(const crypto_helpers &) = delete;
+
+    // Spawns `count` helpers running `executable -x`; each one is replaced after `max_jobs` jobs (0: never), or
+    // when it takes longer than `timeout` to reply (0: no limit)
+    void start(const std::string &executable, unsigned int count, unsigned int max_jobs,
+               std::chrono::seconds timeout);
+
+    // True once started; encryption is done in-process otherwise
+    [[nodiscard]] bool enabled() const;
+
+    // Encrypts `plain` to the keys with the given fingerprints in a helper, with the same output as
+    // keys::encrypt(). Throws std::runtime_error on failure, including when the helper dies or times out.
+    // Returns std::nullopt when no helper is running and none can be spawned, for the caller to encrypt
+    // in-process.
+    std::optional<std::string> encrypt(gpgme_protocol_t protocol, const std::string &home_dir,
+                                       const std::vector<std::string> &fingerprints, std::string_view plain,
+                                       const encrypt_options &options = {});
+
+    // Helper process: serves requests from `socket` until it is closed; returns the process exit code
+    static int serve(int socket);
+
+private:
+    struct helper {
+        pid_t pid = -1;
+        int socket = -1;
+        unsigned int jobs = 0;
+    };
+
+    crypto_helpers() = default;
+
+    helper spawn() const;
+    // std::nullopt when no helper can be used
+    std::optional<helper> acquire();
+    void release(helper h, bool healthy);
+    static void retire(const helper &h, bool healthy);
+    // Background thread spawning the helpers to replace
+    void respawn();
+
+    std::string executable_;
+    unsigned int max_jobs_ = 0;
+    std::chrono::seconds timeout_{0};
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable respawn_cv_;
+    std::vector<helper> idle_;
+    unsigned int running_ = 0;
+    // helpers retired and not replaced yet
+    unsigned int missing_ = 0;
+    // the last spawn failed, the missing helpers are not expected soon
+    bool spawn_failing_ = false;
+    bool enabled_ = false;
+    bool stopping_ = false;
+    std::thread respawner_;
+};
+
+} // namespace gwmilter::keys
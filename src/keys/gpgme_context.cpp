@@ -0,0 +1,67 @@
+#include "gpgme_context.hpp"
+#include "logger/logger.hpp"
+#include <fmt/core.h>
+#include <stdexcept>
+
+namespace gwmilter::keys {
+
+void check(gpgme_error_t err, const char *operation)
+{
+    if (err != GPG_ERR_NO_ERROR)
+        throw std::runtime_error(fmt::format("{}() failed: {}", operation, gpgme_strerror(err)));
+}
+
+
+gpgme_context::gpgme_context(gpgme_protocol_t protocol, const std::string &home_dir)
+{
+    // required once, before the first context is created
+    static const bool initialized = gpgme_check_version(nullptr) != nullptr;
+    if (!initialized)
+        throw std::runtime_error("gpgme_check_version() failed");
+
+    check(gpgme_new(&ctx_), "gpgme_new");
+    gpgme_error_t err = gpgme_set_protocol(ctx_, protocol);
+    if (err == GPG_ERR_NO_ERROR && !home_dir.empty())
+        // keep the default engine, only change its home directory
+        err = gpgme_ctx_set_engine_info(ctx_, protocol, nullptr, home_dir.c_str());
+
+    if (err != GPG_ERR_NO_ERROR) {
+        gpgme_release(ctx_);
+        check(err, home_dir.empty() ? "gpgme_set_protocol" : "gpgme_ctx_set_engine_info");
+    }
+}
+
+
+gpgme_context::~gpgme_context()
+{
+    gpgme_release(ctx_);
+}
+
+
+void encrypt(const gpgme_context &ctx, std::vector<gpgme_key_t> keys, gpgme_data_t in, gpgme_data_t out,
+             const encrypt_options &options)
+{
+    // with no keys GPGME would fall back to symmetric encryption
+    if (keys.empty())
+        throw std::invalid_argument("No key to encrypt to");
+    keys.push_back(nullptr);
+
+    if (gpgme_get_protocol(ctx.get()) == GPGME_PROTOCOL_CMS)
+        check(gpgme_data_set_encoding(out, GPGME_DATA_ENCODING_BASE64), "gpgme_data_set_encoding");
+    else
+        gpgme_set_armor(ctx.get(), options.armor ? 1 : 0);
+
+    auto flags = static_cast<gpgme_encrypt_flags_t>(GPGME_ENCRYPT_ALWAYS_TRUST);
+    if (!options.compress)
+        flags = static_cast<gpgme_encrypt_flags_t>(flags | GPGME_ENCRYPT_NO_COMPRESS);
+
+    if (const gpgme_error_t err = gpgme_op_encrypt(ctx.get(), keys.data(), flags, in, out); err != GPG_ERR_NO_ERROR) {
+        if (const gpgme_encrypt_result_t result = gpgme_op_encrypt_result(ctx.get()); result != nullptr)
+            for (auto invalid = result->invalid_recipients; invalid != nullptr; invalid = invalid->next)
+                spdlog::warn("Invalid recipient key {}: {}", invalid->fpr != nullptr ? invalid->fpr : "<unknown>",
+                             gpgme_strerror(invalid->reason));
+        check(err, "gpgme_op_encrypt");
+    }
+}
+
+} // namespace gwmilter::keys
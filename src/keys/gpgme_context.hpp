@@ -0,0 +1,39 @@
+#pragma once
+#include <gpgme.h>
+#include <string>
+#include <vector>
+
+namespace gwmilter::keys {
+
+// Throws std::runtime_error describing the failed operation if err is set
+void check(gpgme_error_t err, const char *operation);
+
+
+// RAII wrapper for a GPGME context set up for one protocol and, optionally, a GnuPG home directory
+class gpgme_context {
+public:
+    explicit gpgme_context(gpgme_protocol_t protocol, const std::string &home_dir = {});
+    ~gpgme_context();
+    gpgme_context(const gpgme_context &) = delete;
+    gpgme_context &operator=(const gpgme_context &) = delete;
+
+    [[nodiscard]] gpgme_ctx_t get() const { return ctx_; }
+
+private:
+    gpgme_ctx_t ctx_ = nullptr;
+};
+
+
+struct encrypt_options {
+    // OpenPGP output is ASCII armored unless cleared; S/MIME output is always plain base64
+    bool armor = true;
+    // OpenPGP data is compressed as configured in GnuPG unless cleared
+    bool compress = true;
+};
+
+
+// Encrypts `in` into `out` for the keys, trusting them. Throws std::runtime_error on failure.
+void encrypt(const gpgme_context &ctx, std::vector<gpgme_key_t> keys, gpgme_data_t in, gpgme_data_t out,
+             const encrypt_options &options = {});
+
+} // namespace gwmilter::keys
@@ -0,0 +1,93 @@
+#include "key_cache.hpp"
+#include <mutex>
+
+namespace gwmilter::keys {
+
+namespace {
+
+// expired entries are dropped every so many insertions
+constexpr std::size_t prune_interval = 1024;
+
+} // namespace
+
+
+key_cache &key_cache::instance()
+{
+    static key_cache cache;
+    return cache;
+}
+
+
+std::optional<std::vector<key_ptr>> key_cache::get(const std::string &keyring, const std::string &address) const
+{
+    std::shared_lock lock(mutex_);
+    auto it = entries_.find({keyring, address});
+    if (it == entries_.end() || it->second.expires_at <= clock::now())
+        return std::nullopt;
+    return it->second.keys;
+}
+
+
+void key_cache::put(const std::string &keyring, const std::string &address, std::vector<key_ptr> keys,
+                    std::chrono::seconds ttl)
+{
+    if (ttl.count() <= 0)
+        return;
+
+    const auto now = clock::now();
+    std::unique_lock lock(mutex_);
+    entries_[{keyring, address}] = entry{std::move(keys), now + ttl};
+
+    if (++puts_since_prune_ >= prune_interval)
+        prune(now);
+}
+
+
+void key_cache::erase(const std::string &keyring, const std::string &address)
+{
+    std::unique_lock lock(mutex_);
+    entries_.erase({keyring, address});
+}
+
+
+void key_cache::clear()
+{
+    std::unique_lock lock(mutex_);
+    entries_.clear();
+}
+
+
+std::size_t key_cache::size() const
+{
+    std::shared_lock lock(mutex_);
+    return entries_.size();
+}
+
+
+bool key_cache::usable(gpgme_key_t key, std::time_t now)
+{
+    if (key == nullptr || key->revoked || key->expired || key->disabled || key->invalid || !key->can_encrypt)
+        return false;
+
+    // the key flags reflect the time of the lookup; a subkey may have expired since
+    for (gpgme_subkey_t sk = key->subkeys; sk != nullptr; sk = sk->next)
+        if (sk->can_encrypt && !sk->revoked && !sk->expired && !sk->disabled && !sk->invalid &&
+            (sk->expires == 0 || sk->expires > now))
+            return true;
+
+    return false;
+}
+
+
+void key_cache::prune(clock::time_point now)
+{
+    puts_since_prune_ = 0;
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        if (it->second.expires_at <= now)
+            it = entries_.erase(it);
+        else
+            ++it;
+    }
+}
+
+} // namespace gwmilter::keys
@@ -0,0 +1,60 @@
+#pragma once
+#include <chrono>
+#include <ctime>
+#include <gpgme.h>
+#include <map>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace gwmilter::keys {
+
+// Reference counted GPGME key handle
+using key_ptr = std::shared_ptr<std::remove_pointer_t<gpgme_key_t>>;
+
+// Takes over the reference held by the caller
+inline key_ptr make_key_ptr(gpgme_key_t key)
+{
+    return {key, gpgme_key_unref};
+}
+
+
+// Public keys resolved per address, shared by all messages.
+// Entries are identified by keyring and normalized address, and expire after the TTL given when stored.
+class key_cache {
+public:
+    using clock = std::chrono::steady_clock;
+
+    static key_cache &instance();
+
+    // Returns the cached keys of the address, or nullopt if they are not cached or have expired
+    [[nodiscard]] std::optional<std::vector<key_ptr>> get(const std::string &keyring, const std::string &address) const;
+    void put(const std::string &keyring, const std::string &address, std::vector<key_ptr> keys,
+             std::chrono::seconds ttl);
+    void erase(const std::string &keyring, const std::string &address);
+    void clear();
+    [[nodiscard]] std::size_t size() const;
+
+    // True if the key has a subkey that can currently be used for encryption
+    // (checks the metadata of the key, not the keyring)
+    [[nodiscard]] static bool usable(gpgme_key_t key, std::time_t now);
+
+private:
+    struct entry {
+        std::vector<key_ptr> keys;
+        clock::time_point expires_at;
+    };
+
+    // drops the expired entries; called with the mutex locked
+    void prune(clock::time_point now);
+
+    mutable std::shared_mutex mutex_;
+    std::map<std::pair<std::string, std::string>, entry> entries_;
+    std::size_t puts_since_prune_ = 0;
+};
+
+} // namespace gwmilter::keys
@@ -0,0 +1,97 @@
+#include "key_cache.hpp"
+#include <gtest/gtest.h>
+
+using namespace gwmilter::keys;
+
+class KeyCacheTest : public ::testing::Test {
+protected:
+    key_cache cache;
+
+    // keys built here are not owned by GPGME, hence they are not released with gpgme_key_unref()
+    static key_ptr make_key()
+    {
+        auto *subkey = new _gpgme_subkey{};
+        subkey->can_encrypt = 1;
+
+        auto *key = new _gpgme_key{};
+        key->can_encrypt = 1;
+        key->subkeys = subkey;
+
+        return {key, [](gpgme_key_t k) {
+                    delete k->subkeys;
+                    delete k;
+                }};
+    }
+};
+
+TEST_F(KeyCacheTest, GetReturnsNothingForUnknownAddress)
+{
+    EXPECT_FALSE(cache.get("openpgp", "alice@example.com").has_value());
+}
+
+TEST_F(KeyCacheTest, PutStoresKeysPerKeyring)
+{
+    const key_ptr key = make_key();
+    cache.put("openpgp", "alice@example.com", {key}, std::chrono::seconds{60});
+
+    const auto keys = cache.get("openpgp", "alice@example.com");
+    ASSERT_TRUE(keys.has_value());
+    ASSERT_EQ(keys->size(), 1u);
+    EXPECT_EQ(keys->front().get(), key.get());
+
+    EXPECT_FALSE(cache.get("cms", "alice@example.com").has_value());
+}
+
+TEST_F(KeyCacheTest, PutWithZeroTtlDoesNotCache)
+{
+    cache.put("openpgp", "alice@example.com", {make_key()}, std::chrono::seconds{0});
+    EXPECT_FALSE(cache.get("openpgp", "alice@example.com").has_value());
+    EXPECT_EQ(cache.size(), 0u);
+}
+
+TEST_F(KeyCacheTest, EraseDropsEntry)
+{
+    cache.put("openpgp", "alice@example.com", {make_key()}, std::chrono::seconds{60});
+    cache.erase("openpgp", "alice@example.com");
+    EXPECT_FALSE(cache.get("openpgp", "alice@example.com").has_value());
+}
+
+TEST_F(KeyCacheTest, CachedKeyOutlivesEntry)
+{
+    std::weak_ptr<std::remove_pointer_t<gpgme_key_t>> weak;
+    {
+        const key_ptr key = make_key();
+        weak = key;
+        cache.put("openpgp", "alice@example.com", {key}, std::chrono::seconds{60});
+    }
+
+    auto keys = cache.get("openpgp", "alice@example.com");
+    cache.clear();
+    EXPECT_FALSE(weak.expired());
+
+    keys.reset();
+    EXPECT_TRUE(weak.expired());
+}
+
+TEST_F(KeyCacheTest, UsableRejectsRevokedAndExpiredKeys)
+{
+    const std::time_t now = 1'000'000;
+
+    const key_ptr key = make_key();
+    EXPECT_TRUE(key_cache::usable(key.get(), now));
+
+    key->subkeys->expires = now + 10;
+    EXPECT_TRUE(key_cache::usable(key.get(), now));
+
+    // expired since the key was listed
+    key->subkeys->expires = now - 10;
+    EXPECT_FALSE(key_cache::usable(key.get(), now));
+
+    key->subkeys->expires = 0;
+    key->revoked = 1;
+    EXPECT_FALSE(key_cache::usable(key.get(), now));
+
+    key->revoked = 0;
+    key->subkeys->can_encrypt = 0;
+    EXPECT_FALSE(key_cache::usable(key.get(), now));
+}
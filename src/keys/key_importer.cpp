@@ -0,0 +1,116 @@
+#include "key_importer.hpp"
+#include "logger/logger.hpp"
+#include "utils/string.hpp"
+#include <stdexcept>
+
+namespace gwmilter::keys {
+
+key_importer::key_importer(fetch_function fetch)
+    : fetch_{std::move(fetch)}, thread_{[this] { run(); }}
+{ }
+
+
+key_importer::~key_importer()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+
+key_importer &key_importer::instance()
+{
+    static key_importer importer(
+        [](const keyring &kr, const std::vector<std::string> &addresses) { return kr.import(addresses); });
+    return importer;
+}
+
+
+bool key_importer::import(const keyring &kr, const std::string &address)
+{
+    std::shared_ptr<request> req;
+    {
+        std::lock_guard lock(mutex_);
+        auto &slot = in_flight_[{kr.id(), utils::string::normalize_address(address)}];
+        if (slot == nullptr) {
+            slot = std::make_shared<request>(request{kr, address, {}, {}});
+            slot->result = slot->promise.get_future().share();
+            queue_.push_back(slot);
+            cv_.notify_one();
+        } else {
+            spdlog::debug("Import of the key of {} already in progress, waiting for it", address);
+        }
+        req = slot;
+        ++req->waiters;
+    }
+
+    const bool imported = req->result.get();
+
+    std::lock_guard lock(mutex_);
+    --req->waiters;
+    return imported;
+}
+
+
+std::size_t key_importer::waiting() const
+{
+    std::lock_guard lock(mutex_);
+    std::size_t count = 0;
+    for (const auto &[_, req]: in_flight_)
+        count += req->waiters;
+    return count;
+}
+
+
+void key_importer::run()
+{
+    for (;;) {
+        std::vector<std::shared_ptr<request>> batch;
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (stopping_ && queue_.empty())
+                return;
+            batch.swap(queue_);
+        }
+
+        process(batch);
+    }
+}
+
+
+void key_importer::process(std::vector<std::shared_ptr<request>> &batch)
+{
+    // one fetch per keyring
+    std::map<std::string, std::vector<std::shared_ptr<request>>> per_keyring;
+    for (auto &req: batch)
+        per_keyring[req->kr.id()].push_back(req);
+
+    for (auto &[id, requests]: per_keyring) {
+        std::vector<std::string> addresses;
+        addresses.reserve(requests.size());
+        for (const auto &req: requests)
+            addresses.push_back(req->address);
+
+        std::set<std::string> imported;
+        try {
+            imported = fetch_(requests.front()->kr, addresses);
+        } catch (const std::exception &e) {
+            spdlog::warn("Failed to import public keys in keyring {}: {}", id, e.what());
+        }
+
+        for (auto &req: requests) {
+            {
+                // later requests for the address start a new import
+                std::lock_guard lock(mutex_);
+                in_flight_.erase({id, utils::string::normalize_address(req->address)});
+            }
+            req->promise.set_value(imported.count(req->address) != 0);
+        }
+    }
+}
+
+} // namespace gwmilter::keys
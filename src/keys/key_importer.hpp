@@ -0,0 +1,66 @@
+#pragma once
+#include "keyring.hpp"
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace gwmilter::keys {
+
+// Imports public keys on a single thread, so that concurrent messages don't contend for the keyring lock.
+// Requests for an address already being imported wait for that import instead of fetching the key again.
+// Requests queued while an import is running are handled together: one key server lookup and one
+// keyring write per keyring.
+class key_importer {
+public:
+    // Imports the keys of the addresses in the keyring; returns the addresses that have a key afterwards
+    using fetch_function = std::function<std::set<std::string>(const keyring &, const std::vector<std::string> &)>;
+
+    explicit key_importer(fetch_function fetch);
+    ~key_importer();
+    key_importer(const key_importer &) = delete;
+    key_importer &operator=(const key_importer &) = delete;
+
+    // Process-wide importer, using keyring::import()
+    static key_importer &instance();
+
+    // Blocks until the key of the address is imported in the keyring.
+    // Returns true if the keyring has a key for the address afterwards.
+    bool import(const keyring &kr, const std::string &address);
+
+    // Number of callers currently waiting for an import
+    [[nodiscard]] std::size_t waiting() const;
+
+private:
+    struct request {
+        keyring kr;
+        std::string address;
+        std::promise<bool> promise;
+        std::shared_future<bool> result;
+        std::size_t waiters = 0;
+    };
+    // keyring id and normalized address
+    using request_key = std::pair<std::string, std::string>;
+
+    void run();
+    void process(std::vector<std::shared_ptr<request>> &batch);
+
+    fetch_function fetch_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<request_key, std::shared_ptr<request>> in_flight_;
+    std::vector<std::shared_ptr<request>> queue_;
+    bool stopping_ = false;
+    // started last, once the members above are initialized
+    std::thread thread_;
+};
+
+} // namespace gwmilter::keys
@@ -0,0 +1,108 @@
+#include "key_importer.hpp"
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <thread>
+
+using namespace gwmilter::keys;
+
+class KeyImporterTest : public ::testing::Test {
+protected:
+    keyring kr{GPGME_PROTOCOL_OpenPGP, "", std::chrono::seconds{0}};
+
+    std::mutex mutex;
+    std::vector<std::vector<std::string>> calls;
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+
+    // fetch function blocking until release is fulfilled; every address gets a key
+    key_importer::fetch_function blocking_fetch()
+    {
+        return [this](const keyring &, const std::vector<std::string> &addresses) {
+            {
+                std::lock_guard lock(mutex);
+                calls.push_back(addresses);
+            }
+            released.wait();
+            return std::set<std::string>(addresses.begin(), addresses.end());
+        };
+    }
+
+    static void wait_for(const key_importer &importer, std::size_t waiting)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+        while (importer.waiting() < waiting && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        ASSERT_EQ(importer.waiting(), waiting);
+    }
+
+    void wait_for_calls(std::size_t count)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+        for (;;) {
+            {
+                std::lock_guard lock(mutex);
+                if (calls.size() >= count || std::chrono::steady_clock::now() >= deadline)
+                    break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        }
+    }
+};
+
+TEST_F(KeyImporterTest, ConcurrentRequestsForSameAddressShareOneFetch)
+{
+    key_importer importer(blocking_fetch());
+
+    std::atomic<int> succeeded{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+        threads.emplace_back([&] {
+            if (importer.import(kr, "<Alice@example.com>"))
+                ++succeeded;
+        });
+
+    wait_for(importer, 4);
+    release.set_value();
+    for (auto &t: threads)
+        t.join();
+
+    EXPECT_EQ(succeeded, 4);
+    ASSERT_EQ(calls.size(), 1u);
+    EXPECT_EQ(calls[0].size(), 1u);
+}
+
+TEST_F(KeyImporterTest, QueuedRequestsAreFetchedTogether)
+{
+    key_importer importer(blocking_fetch());
+
+    std::thread first([&] { EXPECT_TRUE(importer.import(kr, "alice@example.com")); });
+    wait_for(importer, 1);
+    wait_for_calls(1);
+
+    // queued while the first import is running
+    std::thread second([&] { EXPECT_TRUE(importer.import(kr, "bob@example.com")); });
+    std::thread third([&] { EXPECT_TRUE(importer.import(kr, "carol@example.com")); });
+    wait_for(importer, 3);
+
+    release.set_value();
+    first.join();
+    second.join();
+    third.join();
+
+    ASSERT_EQ(calls.size(), 2u);
+    EXPECT_EQ(calls[1].size(), 2u);
+}
+
+TEST_F(KeyImporterTest, FailedFetchReturnsFalse)
+{
+    key_importer importer([](const keyring &, const std::vector<std::string> &) -> std::set<std::string> {
+        throw std::runtime_error("key server unreachable");
+    });
+
+    EXPECT_FALSE(importer.import(kr, "alice@example.com"));
+    // a new request starts a new import
+    EXPECT_FALSE(importer.import(kr, "alice@example.com"));
+    EXPECT_EQ(importer.waiting(), 0u);
+}
@@ -0,0 +1,200 @@
+#include "keyring.hpp"
+#include "gpgme_context.hpp"
+#include "logger/logger.hpp"
+#include "utils/string.hpp"
+#include <algorithm>
+#include <utility>
+
+namespace gwmilter::keys {
+
+keyring::keyring(gpgme_protocol_t protocol, std::string home_dir, std::chrono::seconds cache_ttl)
+    : protocol_{protocol}, home_dir_{std::move(home_dir)}, cache_ttl_{cache_ttl},
+      id_{(protocol == GPGME_PROTOCOL_CMS ? "cms:" : "openpgp:") + home_dir_}
+{ }
+
+
+std::map<std::string, std::vector<key_ptr>> keyring::resolve(const std::vector<std::string> &addresses) const
+{
+    std::map<std::string, std::vector<key_ptr>> resolved;
+    if (addresses.empty())
+        return resolved;
+
+    // the same mailbox may be given in different forms (e.g. with or without angle brackets)
+    std::map<std::string, std::vector<const std::string *>> wanted;
+    for (const auto &address: addresses)
+        wanted[utils::string::normalize_address(address)].push_back(&address);
+
+    auto &cache = key_cache::instance();
+    std::map<std::string, std::vector<key_ptr>> looked_up;
+    for (const auto &[address, _]: wanted) {
+        if (auto keys = cache.get(id_, address); keys.has_value()) {
+            if (!keys->empty())
+                looked_up[address] = std::move(*keys);
+        } else {
+            // not cached; the empty entry marks the address to be looked up
+            looked_up[address];
+        }
+    }
+
+    std::vector<const char *> patterns;
+    for (const auto &[address, keys]: looked_up)
+        if (keys.empty())
+            patterns.push_back(address.c_str());
+
+    if (!patterns.empty()) {
+        const std::size_t misses = patterns.size();
+        patterns.push_back(nullptr);
+
+        gpgme_context ctx(protocol_, home_dir_);
+        check(gpgme_op_keylist_ext_start(ctx.get(), patterns.data(), 0, 0), "gpgme_op_keylist_ext_start");
+
+        // patterns are substring matches, hence the user IDs of the returned keys are matched
+        // again against the wanted addresses
+        gpgme_key_t k = nullptr;
+        gpgme_error_t err;
+        while ((err = gpgme_op_keylist_next(ctx.get(), &k)) == GPG_ERR_NO_ERROR) {
+            const key_ptr key = make_key_ptr(k);
+            if (key->invalid || key->disabled)
+                continue;
+
+            for (gpgme_user_id_t uid = key->uids; uid != nullptr; uid = uid->next) {
+                if (uid->email == nullptr)
+                    continue;
+                if (auto it = looked_up.find(utils::string::normalize_address(uid->email)); it != looked_up.end())
+                    if (std::find(it->second.begin(), it->second.end(), key) == it->second.end())
+                        it->second.push_back(key);
+            }
+        }
+        gpgme_op_keylist_end(ctx.get());
+
+        if (gpgme_err_code(err) != GPG_ERR_EOF)
+            check(err, "gpgme_op_keylist_next");
+
+        // only the addresses that have keys are cached, so that keys added later are found right away
+        for (std::size_t i = 0; i < misses; ++i)
+            if (const auto &keys = looked_up[patterns[i]]; !keys.empty())
+                cache.put(id_, patterns[i], keys, cache_ttl_);
+
+        spdlog::debug("keyring {}: {} addresses looked up, {} found in cache", id_, misses,
+                      wanted.size() - misses);
+    }
+
+    for (auto &[address, keys]: looked_up) {
+        if (keys.empty())
+            continue;
+        for (const auto *given: wanted[address])
+            resolved[*given] = keys;
+    }
+
+    return resolved;
+}
+
+
+std::set<std::string> keyring::find(const std::vector<std::string> &addresses) const
+{
+    std::set<std::string> found;
+    for (auto &[address, _]: resolve(addresses))
+        found.insert(address);
+    return found;
+}
+
+
+std::set<std::string> keyring::import(const std::vector<std::string> &addresses) const
+{
+    if (addresses.empty())
+        return {};
+
+    std::set<std::string> wanted;
+    for (const auto &address: addresses)
+        wanted.insert(utils::string::normalize_address(address));
+
+    std::vector<const char *> patterns;
+    patterns.reserve(wanted.size() + 1);
+    for (const auto &address: wanted)
+        patterns.push_back(address.c_str());
+    patterns.push_back(nullptr);
+
+    gpgme_context ctx(protocol_, home_dir_);
+    check(gpgme_set_keylist_mode(ctx.get(), GPGME_KEYLIST_MODE_EXTERN), "gpgme_set_keylist_mode");
+    check(gpgme_op_keylist_ext_start(ctx.get(), patterns.data(), 0, 0), "gpgme_op_keylist_ext_start");
+
+    std::vector<key_ptr> found;
+    gpgme_key_t k = nullptr;
+    gpgme_error_t err;
+    while ((err = gpgme_op_keylist_next(ctx.get(), &k)) == GPG_ERR_NO_ERROR) {
+        key_ptr key = make_key_ptr(k);
+        for (gpgme_user_id_t uid = key->uids; uid != nullptr; uid = uid->next) {
+            if (uid->email != nullptr && wanted.count(utils::string::normalize_address(uid->email)) != 0) {
+                found.push_back(std::move(key));
+                break;
+            }
+        }
+    }
+    gpgme_op_keylist_end(ctx.get());
+
+    if (gpgme_err_code(err) != GPG_ERR_EOF)
+        check(err, "gpgme_op_keylist_next");
+
+    if (!found.empty()) {
+        std::vector<gpgme_key_t> keys;
+        keys.reserve(found.size() + 1);
+        for (const auto &key: found)
+            keys.push_back(key.get());
+        keys.push_back(nullptr);
+
+        check(gpgme_op_import_keys(ctx.get(), keys.data()), "gpgme_op_import_keys");
+        if (const gpgme_import_result_t result = gpgme_op_import_result(ctx.get()); result != nullptr)
+            spdlog::debug("keyring {}: {} keys imported, {} unchanged", id_, result->imported, result->unchanged);
+    }
+
+    // reload the keys from the keyring, so that the cache holds the imported keys
+    for (const auto &address: wanted)
+        key_cache::instance().erase(id_, address);
+    return find(addresses);
+}
+
+
+std::size_t keyring::warm_up() const
+{
+    gpgme_context ctx(protocol_, home_dir_);
+    check(gpgme_op_keylist_start(ctx.get(), nullptr, 0), "gpgme_op_keylist_start");
+
+    // the keys of every address, as resolve() finds them
+    std::map<std::string, std::vector<key_ptr>> keys;
+    std::size_t count = 0;
+    gpgme_key_t k = nullptr;
+    gpgme_error_t err;
+    while ((err = gpgme_op_keylist_next(ctx.get(), &k)) == GPG_ERR_NO_ERROR) {
+        const key_ptr key = make_key_ptr(k);
+        ++count;
+        if (key->invalid || key->disabled)
+            continue;
+
+        for (gpgme_user_id_t uid = key->uids; uid != nullptr; uid = uid->next) {
+            if (uid->email == nullptr)
+                continue;
+            auto &found = keys[utils::string::normalize_address(uid->email)];
+            if (std::find(found.begin(), found.end(), key) == found.end())
+                found.push_back(key);
+        }
+    }
+    gpgme_op_keylist_end(ctx.get());
+
+    if (gpgme_err_code(err) != GPG_ERR_EOF)
+        check(err, "gpgme_op_keylist_next");
+
+    auto &cache = key_cache::instance();
+    for (auto &[address, address_keys]: keys)
+        cache.put(id_, address, std::move(address_keys), cache_ttl_);
+
+    spdlog::debug("keyring {}: {} keys of {} addresses preloaded", id_, count, keys.size());
+    return count;
+}
+
+
+void keyring::forget(const std::string &address) const
+{
+    key_cache::instance().erase(id_, utils::string::normalize_address(address));
+}
+
+} // namespace gwmilter::keys
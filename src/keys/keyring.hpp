@@ -0,0 +1,58 @@
+#pragma once
+#include "key_cache.hpp"
+#include <chrono>
+#include <gpgme.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace gwmilter::keys {
+
+// Public key lookups in a local keyring: the default one of a protocol, or the one in a given GnuPG home.
+// Resolved keys are kept in the process-wide key_cache, so that the key handles found while
+// checking the recipients are reused for encryption.
+// Each operation uses its own GPGME context, hence a keyring can be shared between threads.
+class keyring {
+public:
+    keyring(gpgme_protocol_t protocol, std::string home_dir, std::chrono::seconds cache_ttl);
+
+    // Resolves the keys of all addresses; the addresses missing from the cache are looked up
+    // with a single keylist operation. Returns the keys per address, as given; addresses without
+    // keys are left out.
+    // Throws std::runtime_error if the keyring cannot be searched.
+    [[nodiscard]] std::map<std::string, std::vector<key_ptr>> resolve(const std::vector<std::string> &addresses) const;
+
+    // Returns the addresses, as given, that have a key in the keyring
+    [[nodiscard]] std::set<std::string> find(const std::vector<std::string> &addresses) const;
+
+    // Looks up the keys of all addresses on the configured key servers, and imports them in the keyring
+    // with a single write. The cache is refreshed with the imported keys.
+    // Returns the addresses, as given, that have a key in the keyring after the import.
+    // Throws std::runtime_error on GPGME failures.
+    std::set<std::string> import(const std::vector<std::string> &addresses) const;
+
+    // Starts the engine and reads the whole keyring once, putting the usable keys in the cache under the
+    // addresses of their user IDs, so that the first lookups hit the cache. Done before forking, the
+    // workers inherit the cache. The entries expire after the cache TTL, like the others. Returns the number
+    // of keys.
+    // Throws std::runtime_error on GPGME failures.
+    std::size_t warm_up() const;
+
+    // Drops the cached keys of the address, e.g. after importing a new key
+    void forget(const std::string &address) const;
+
+    [[nodiscard]] gpgme_protocol_t protocol() const { return protocol_; }
+    // empty for the default GnuPG home
+    [[nodiscard]] const std::string &home_dir() const { return home_dir_; }
+    // identifies the keyring (protocol and home directory)
+    [[nodiscard]] const std::string &id() const { return id_; }
+
+private:
+    gpgme_protocol_t protocol_;
+    std::string home_dir_;
+    std::chrono::seconds cache_ttl_;
+    std::string id_;
+};
+
+} // namespace gwmilter::keys
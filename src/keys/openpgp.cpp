@@ -0,0 +1,173 @@
+#include "openpgp.hpp"
+#include <cstdint>
+#include <fmt/core.h>
+#include <stdexcept>
+
+namespace gwmilter::keys::openpgp {
+
+namespace {
+
+constexpr int tag_session_key = 1;
+constexpr std::size_t armor_line_length = 64;
+
+
+std::uint8_t byte_at(std::string_view data, std::size_t pos)
+{
+    if (pos >= data.size())
+        throw std::runtime_error("Truncated OpenPGP packet");
+    return static_cast<std::uint8_t>(data[pos]);
+}
+
+
+std::uint32_t read_be(std::string_view data, std::size_t pos, std::size_t count)
+{
+    std::uint32_t value = 0;
+    for (std::size_t i = 0; i < count; ++i)
+        value = (value << 8) | byte_at(data, pos + i);
+    return value;
+}
+
+
+int packet_tag(std::uint8_t ctb)
+{
+    return (ctb & 0x40) ? ctb & 0x3f : (ctb >> 2) & 0x0f;
+}
+
+
+struct packet_header {
+    int tag;
+    std::size_t header_size;
+    std::size_t body_size;
+};
+
+
+// Partial and indeterminate lengths are rejected: they are only expected for the encrypted data
+packet_header read_header(std::string_view data, std::size_t pos)
+{
+    const std::uint8_t ctb = byte_at(data, pos);
+    if ((ctb & 0x80) == 0)
+        throw std::runtime_error("Invalid OpenPGP packet header");
+
+    const int tag = packet_tag(ctb);
+    if (ctb & 0x40) {
+        // new format
+        const std::uint8_t first = byte_at(data, pos + 1);
+        if (first < 192)
+            return {tag, 2, first};
+        if (first < 224)
+            return {tag, 3, ((first - 192u) << 8) + byte_at(data, pos + 2) + 192u};
+        if (first == 255)
+            return {tag, 6, read_be(data, pos + 2, 4)};
+        throw std::runtime_error("Unexpected partial length OpenPGP packet");
+    }
+
+    // old format
+    switch (ctb & 0x03) {
+    case 0:
+        return {tag, 2, read_be(data, pos + 1, 1)};
+    case 1:
+        return {tag, 3, read_be(data, pos + 1, 2)};
+    case 2:
+        return {tag, 5, read_be(data, pos + 1, 4)};
+    default:
+        throw std::runtime_error("Unexpected indeterminate length OpenPGP packet");
+    }
+}
+
+
+std::uint32_t crc24(std::string_view data)
+{
+    std::uint32_t crc = 0xb704ce;
+    for (const char c: data) {
+        crc ^= static_cast<std::uint32_t>(static_cast<std::uint8_t>(c)) << 16;
+        for (int i = 0; i < 8; ++i) {
+            crc <<= 1;
+            if (crc & 0x1000000)
+                crc ^= 0x1864cfb;
+        }
+    }
+    return crc & 0xffffff;
+}
+
+
+std::string base64(std::string_view data)
+{
+    static constexpr char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+
+    std::size_t i = 0;
+    for (; i + 2 < data.size(); i += 3) {
+        const std::uint32_t v = read_be(data, i, 3);
+        out += alphabet[(v >> 18) & 0x3f];
+        out += alphabet[(v >> 12) & 0x3f];
+        out += alphabet[(v >> 6) & 0x3f];
+        out += alphabet[v & 0x3f];
+    }
+    if (const std::size_t rest = data.size() - i; rest > 0) {
+        const std::uint32_t v = read_be(data, i, rest) << (rest == 1 ? 16 : 8);
+        out += alphabet[(v >> 18) & 0x3f];
+        out += alphabet[(v >> 12) & 0x3f];
+        out += rest == 2 ? alphabet[(v >> 6) & 0x3f] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+} // namespace
+
+
+encrypted_message split(std::string_view binary)
+{
+    encrypted_message message;
+    std::size_t pos = 0;
+    while (pos < binary.size()) {
+        // the first other packet starts the encrypted data, which is kept as is
+        if (packet_tag(byte_at(binary, pos)) != tag_session_key)
+            break;
+
+        const packet_header header = read_header(binary, pos);
+        const std::size_t body = pos + header.header_size;
+        if (header.body_size > binary.size() - body)
+            throw std::runtime_error("Truncated OpenPGP packet");
+
+        const std::uint8_t version = byte_at(binary, body);
+        if (version != 3)
+            throw std::runtime_error(fmt::format("Unsupported session key packet version {}", version));
+        if (header.body_size < 10)
+            throw std::runtime_error("Truncated OpenPGP packet");
+
+        std::string key_id;
+        for (std::size_t i = 0; i < 8; ++i)
+            key_id += fmt::format("{:02X}", byte_at(binary, body + 1 + i));
+
+        const std::size_t size = header.header_size + header.body_size;
+        message.session_keys.push_back({std::move(key_id), binary.substr(pos, size)});
+        pos += size;
+    }
+
+    if (message.session_keys.empty() || pos == binary.size())
+        throw std::runtime_error("Not an OpenPGP public-key encrypted message");
+    message.payload = binary.substr(pos);
+    return message;
+}
+
+
+std::string armor(std::string_view binary)
+{
+    const std::string encoded = base64(binary);
+    const std::uint32_t crc = crc24(binary);
+    const char crc_bytes[] = {static_cast<char>(crc >> 16), static_cast<char>(crc >> 8), static_cast<char>(crc)};
+
+    std::string out = "-----BEGIN PGP MESSAGE-----\n\n";
+    out.reserve(out.size() + encoded.size() + encoded.size() / armor_line_length + 40);
+    for (std::size_t i = 0; i < encoded.size(); i += armor_line_length) {
+        out.append(encoded, i, armor_line_length);
+        out += '\n';
+    }
+    out += '=' + base64({crc_bytes, sizeof(crc_bytes)}) + '\n';
+    out += "-----END PGP MESSAGE-----\n";
+    return out;
+}
+
+} // namespace gwmilter::keys::openpgp
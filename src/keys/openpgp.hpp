@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace gwmilter::keys::openpgp {
+
+// Public-key encrypted session key packet (RFC 4880, 5.1)
+struct session_key_packet {
+    std::string key_id; // 16 uppercase hex digits, as in gpgme_subkey_t::keyid
+    std::string_view packet; // whole packet, header included
+};
+
+// Binary OpenPGP message split into its session key packets and the encrypted data that follows them
+struct encrypted_message {
+    std::vector<session_key_packet> session_keys;
+    std::string_view payload;
+};
+
+// Splits a binary OpenPGP message as produced by gpg. Only version 3 session key packets are supported;
+// throws std::runtime_error for anything else, or if the message is malformed. The views refer to `binary`.
+encrypted_message split(std::string_view binary);
+
+// ASCII armor (RFC 4880, 6.2) of a binary OpenPGP message, with LF line endings like gpg
+std::string armor(std::string_view binary);
+
+} // namespace gwmilter::keys::openpgp
@@ -0,0 +1,76 @@
+#include "openpgp.hpp"
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+
+using namespace gwmilter::keys;
+
+class OpenPgpTest : public ::testing::Test {
+protected:
+    // version 3 public-key encrypted session key packet body: version, key id, algorithm, dummy MPI
+    static std::string session_key_body(const std::string &key_id, char version = 3)
+    {
+        std::string body(1, version);
+        body += key_id;
+        body += "\x01\x00\x01";
+        return body;
+    }
+
+    // old format header, one octet length
+    static std::string old_packet(const std::string &body) { return std::string("\x84") + char(body.size()) + body; }
+
+    // new format header, one octet length
+    static std::string new_packet(const std::string &body) { return std::string("\xc1") + char(body.size()) + body; }
+
+    // symmetrically encrypted integrity protected data packet, with a partial body length
+    const std::string payload = std::string("\xd2\xe1") + "ab" + "\x03" + "cde";
+};
+
+TEST_F(OpenPgpTest, SplitSeparatesSessionKeysFromPayload)
+{
+    const std::string first = old_packet(session_key_body("\x01\x02\x03\x04\x05\x06\x07\x08"));
+    const std::string second = new_packet(session_key_body("\xf0\x9e\x72\x0c\x12\xcb\x5f\x81"));
+    const std::string message = first + second + payload;
+
+    const auto split = openpgp::split(message);
+    ASSERT_EQ(split.session_keys.size(), 2U);
+    EXPECT_EQ(split.session_keys[0].key_id, "0102030405060708");
+    EXPECT_EQ(split.session_keys[0].packet, first);
+    EXPECT_EQ(split.session_keys[1].key_id, "F09E720C12CB5F81");
+    EXPECT_EQ(split.session_keys[1].packet, second);
+    EXPECT_EQ(split.payload, payload);
+}
+
+TEST_F(OpenPgpTest, SplitRejectsUnsupportedSessionKeyVersion)
+{
+    const std::string message = old_packet(session_key_body("\x01\x02\x03\x04\x05\x06\x07\x08", 6)) + payload;
+    EXPECT_THROW((void) openpgp::split(message), std::runtime_error);
+}
+
+TEST_F(OpenPgpTest, SplitRejectsMessagesWithoutSessionKeysOrPayload)
+{
+    EXPECT_THROW((void) openpgp::split(payload), std::runtime_error);
+    EXPECT_THROW((void) openpgp::split(old_packet(session_key_body("\x01\x02\x03\x04\x05\x06\x07\x08"))),
+                 std::runtime_error);
+    // truncated session key packet
+    EXPECT_THROW((void) openpgp::split(std::string("\x84\x20\x03") + payload), std::runtime_error);
+}
+
+TEST_F(OpenPgpTest, ArmorAddsHeadersAndChecksum)
+{
+    EXPECT_EQ(openpgp::armor("hello"), "-----BEGIN PGP MESSAGE-----\n"
+                                       "\n"
+                                       "aGVsbG8=\n"
+                                       "=R/WK\n"
+                                       "-----END PGP MESSAGE-----\n");
+}
+
+TEST_F(OpenPgpTest, ArmorWrapsLines)
+{
+    const std::string armored = openpgp::armor(std::string(100, 'x'));
+    // 100 bytes are 136 base64 characters: two full lines of 64 and one of 8
+    const auto body = armored.find("\n\n") + 2;
+    EXPECT_EQ(armored.find('\n', body), body + 64);
+    EXPECT_EQ(armored.find('\n', body + 65), body + 129);
+    EXPECT_EQ(armored.find('\n', body + 130), body + 138);
+}
@@ -0,0 +1,231 @@
+#include "openssl_cms.hpp"
+#include "logger/logger.hpp"
+#include "utils/string.hpp"
+#include <fmt/core.h>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#ifdef GWMILTER_OPENSSL_CMS
+#include <filesystem>
+#include <openssl/bio.h>
+#include <openssl/cms.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#endif
+
+namespace gwmilter::keys {
+
+namespace {
+
+std::mutex shared_mutex;
+std::map<std::string, std::shared_ptr<const cms_encryptor>> shared_encryptors;
+// error of the directories that could not be loaded, not read again until clear()
+std::map<std::string, std::string> shared_failures;
+
+#ifdef GWMILTER_OPENSSL_CMS
+
+using x509_ptr = std::shared_ptr<X509>;
+using bio_ptr = std::unique_ptr<BIO, decltype(&BIO_free_all)>;
+
+// sk_X509_free() is a macro
+struct x509_stack_deleter {
+    void operator()(STACK_OF(X509) *stack) const { sk_X509_free(stack); }
+};
+
+
+// Throws std::runtime_error with the last OpenSSL error
+[[noreturn]] void throw_openssl_error(const char *operation)
+{
+    char buf[256] = {};
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    ERR_clear_error();
+    throw std::runtime_error(fmt::format("{} failed: {}", operation, buf));
+}
+
+
+bool usable(X509 *cert)
+{
+    if (X509_cmp_current_time(X509_get0_notBefore(cert)) >= 0 ||
+        X509_cmp_current_time(X509_get0_notAfter(cert)) <= 0)
+        return false;
+    if ((X509_get_extension_flags(cert) & EXFLAG_KUSAGE) != 0 &&
+        (X509_get_key_usage(cert) & (KU_KEY_ENCIPHERMENT | KU_KEY_AGREEMENT)) == 0)
+        return false;
+    return true;
+}
+
+#endif
+
+} // namespace
+
+
+#ifdef GWMILTER_OPENSSL_CMS
+
+struct cms_encryptor::impl {
+    // per normalized address
+    std::map<std::string, std::vector<x509_ptr>> certificates;
+    std::size_t count = 0;
+};
+
+
+cms_encryptor::cms_encryptor(const std::string &certificate_dir)
+    : impl_{std::make_unique<impl>()}
+{
+    std::error_code ec;
+    std::filesystem::directory_iterator it(certificate_dir, ec);
+    if (ec)
+        throw std::runtime_error(fmt::format("Unable to read certificate_dir {}: {}", certificate_dir, ec.message()));
+
+    for (const auto &entry: it) {
+        if (!entry.is_regular_file(ec))
+            continue;
+
+        const bio_ptr file{BIO_new_file(entry.path().c_str(), "r"), BIO_free_all};
+        if (!file) {
+            spdlog::warn("Unable to open certificate file {}", entry.path().string());
+            continue;
+        }
+
+        // a file may hold several certificates
+        while (X509 *cert = PEM_read_bio_X509(file.get(), nullptr, nullptr, nullptr)) {
+            const x509_ptr owned{cert, X509_free};
+            STACK_OF(OPENSSL_STRING) *emails = X509_get1_email(cert);
+            for (int i = 0; i < sk_OPENSSL_STRING_num(emails); ++i) {
+                const std::string address = utils::string::normalize_address(sk_OPENSSL_STRING_value(emails, i));
+                impl_->certificates[address].push_back(owned);
+            }
+            X509_email_free(emails);
+            ++impl_->count;
+        }
+        // end of file
+        ERR_clear_error();
+    }
+
+    spdlog::info("Loaded {} certificates for {} addresses from {}", impl_->count, impl_->certificates.size(),
+                 certificate_dir);
+}
+
+
+bool cms_encryptor::has_certificate(const std::string &recipient) const
+{
+    auto it = impl_->certificates.find(utils::string::normalize_address(recipient));
+    if (it == impl_->certificates.end())
+        return false;
+    for (const auto &cert: it->second)
+        if (usable(cert.get()))
+            return true;
+    return false;
+}
+
+
+std::size_t cms_encryptor::size() const
+{
+    return impl_->count;
+}
+
+
+std::string cms_encryptor::encrypt(const std::set<std::string> &recipients, std::string_view plain,
+                                   std::set<std::string> &missing) const
+{
+    const std::unique_ptr<STACK_OF(X509), x509_stack_deleter> certs{sk_X509_new_null()};
+    for (const auto &r: recipients) {
+        bool found = false;
+        if (auto it = impl_->certificates.find(utils::string::normalize_address(r)); it != impl_->certificates.end()) {
+            for (const auto &cert: it->second) {
+                if (usable(cert.get())) {
+                    // the stack does not own the certificates
+                    sk_X509_push(certs.get(), cert.get());
+                    found = true;
+                }
+            }
+        }
+        if (!found)
+            missing.insert(r);
+    }
+
+    if (sk_X509_num(certs.get()) == 0)
+        throw std::runtime_error("None of the recipients has a usable certificate");
+
+    const bio_ptr in{BIO_new_mem_buf(plain.data(), static_cast<int>(plain.size())), BIO_free_all};
+    // CMS_BINARY: the body is a MIME entity with CRLF line endings already
+    const std::unique_ptr<CMS_ContentInfo, decltype(&CMS_ContentInfo_free)> cms{
+        CMS_encrypt(certs.get(), in.get(), EVP_aes_256_cbc(), CMS_BINARY), CMS_ContentInfo_free};
+    if (!cms)
+        throw_openssl_error("CMS_encrypt()");
+
+    // base64 in lines of 64 characters, like gpgsm
+    BIO *mem = BIO_new(BIO_s_mem());
+    const bio_ptr out{BIO_push(BIO_new(BIO_f_base64()), mem), BIO_free_all};
+    if (i2d_CMS_bio(out.get(), cms.get()) != 1 || BIO_flush(out.get()) != 1)
+        throw_openssl_error("i2d_CMS_bio()");
+
+    char *data = nullptr;
+    const long size = BIO_get_mem_data(mem, &data);
+    return {data, static_cast<std::size_t>(size)};
+}
+
+#else
+
+struct cms_encryptor::impl { };
+
+
+cms_encryptor::cms_encryptor(const std::string &)
+{
+    throw std::runtime_error("gwmilter was built without OpenSSL CMS support (ENABLE_OPENSSL_CMS)");
+}
+
+
+bool cms_encryptor::has_certificate(const std::string &) const
+{
+    return false;
+}
+
+
+std::size_t cms_encryptor::size() const
+{
+    return 0;
+}
+
+
+std::string cms_encryptor::encrypt(const std::set<std::string> &, std::string_view, std::set<std::string> &) const
+{
+    throw std::runtime_error("gwmilter was built without OpenSSL CMS support (ENABLE_OPENSSL_CMS)");
+}
+
+#endif
+
+
+cms_encryptor::~cms_encryptor() = default;
+
+
+std::shared_ptr<const cms_encryptor> cms_encryptor::get(const std::string &certificate_dir)
+{
+    std::lock_guard lock(shared_mutex);
+    if (auto it = shared_failures.find(certificate_dir); it != shared_failures.end())
+        throw std::runtime_error(it->second);
+
+    auto &encryptor = shared_encryptors[certificate_dir];
+    if (!encryptor) {
+        try {
+            encryptor = std::make_shared<const cms_encryptor>(certificate_dir);
+        } catch (const std::exception &e) {
+            shared_encryptors.erase(certificate_dir);
+            shared_failures.emplace(certificate_dir, e.what());
+            throw;
+        }
+    }
+    return encryptor;
+}
+
+
+void cms_encryptor::clear()
+{
+    std::lock_guard lock(shared_mutex);
+    shared_encryptors.clear();
+    shared_failures.clear();
+}
+
+} // namespace gwmilter::keys
@@ -0,0 +1,43 @@
+#pragma once
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+
+namespace gwmilter::keys {
+
+// In-process S/MIME encryption with OpenSSL, as an alternative to gpgsm: the recipient certificates are read
+// once from a directory of PEM files, and the CMS EnvelopedData is built without any engine round trip.
+// Available when built with -DENABLE_OPENSSL_CMS=ON; the constructor throws std::runtime_error otherwise.
+class cms_encryptor {
+public:
+    // Loads the certificates of all files in the directory, indexed by their e-mail addresses (subject
+    // emailAddress and subjectAltName). Throws std::runtime_error if the directory cannot be read.
+    explicit cms_encryptor(const std::string &certificate_dir);
+    ~cms_encryptor();
+    cms_encryptor(const cms_encryptor &) = delete;
+    cms_encryptor &operator=(const cms_encryptor &) = delete;
+
+    // Encryptor of the directory, shared by all messages; the certificates are loaded on first use.
+    // A directory that fails to load throws the same error on the next calls, without being read again.
+    static std::shared_ptr<const cms_encryptor> get(const std::string &certificate_dir);
+    // Drops the shared encryptors and failures, e.g. on configuration reload, so that the certificates are
+    // read again
+    static void clear();
+
+    // True if the recipient has a certificate that can currently be used for encryption
+    [[nodiscard]] bool has_certificate(const std::string &recipient) const;
+    [[nodiscard]] std::size_t size() const;
+
+    // Encrypts `plain` to the usable certificates of the recipients, with the same output as gpgsm: base64 in
+    // lines of 64 characters. Recipients without a usable certificate are added to `missing`.
+    // Throws std::runtime_error if none of the recipients has one, or on failure.
+    std::string encrypt(const std::set<std::string> &recipients, std::string_view plain,
+                        std::set<std::string> &missing) const;
+
+private:
+    struct impl;
+    std::unique_ptr<impl> impl_;
+};
+
+} // namespace gwmilter::keys
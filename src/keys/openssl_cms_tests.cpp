@@ -0,0 +1,200 @@
+#include "openssl_cms.hpp"
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <memory>
+#include <openssl/bio.h>
+#include <openssl/cms.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/x509v3.h>
+#include <set>
+#include <stdexcept>
+#include <string>
+
+using namespace gwmilter::keys;
+
+namespace {
+
+using pkey_ptr = std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
+using x509_ptr = std::unique_ptr<X509, decltype(&X509_free)>;
+using bio_ptr = std::unique_ptr<BIO, decltype(&BIO_free_all)>;
+
+} // namespace
+
+class OpensslCmsTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        dir_ = std::filesystem::temp_directory_path() /
+               ("gwmilter_cms_" + std::to_string(::testing::UnitTest::GetInstance()->random_seed()) + "_" +
+                ::testing::UnitTest::GetInstance()->current_test_info()->name());
+        std::filesystem::create_directories(dir_);
+        key_ = generate_key();
+    }
+
+    void TearDown() override
+    {
+        cms_encryptor::clear();
+        std::filesystem::remove_all(dir_);
+    }
+
+    static pkey_ptr generate_key()
+    {
+        EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+        EVP_PKEY *key = nullptr;
+        if (ctx == nullptr || EVP_PKEY_keygen_init(ctx) != 1 || EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) != 1 ||
+            EVP_PKEY_keygen(ctx, &key) != 1)
+            throw std::runtime_error("unable to generate an RSA key");
+        EVP_PKEY_CTX_free(ctx);
+        return {key, EVP_PKEY_free};
+    }
+
+    // Writes a self-signed certificate for `address` to a PEM file of the test directory
+    void write_certificate(const std::string &file, const std::string &address, long valid_from_days = -1,
+                           long valid_to_days = 30, const char *key_usage = "keyEncipherment")
+    {
+        const x509_ptr cert{X509_new(), X509_free};
+        X509_set_version(cert.get(), 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), ++serial_);
+        X509_gmtime_adj(X509_getm_notBefore(cert.get()), valid_from_days * 86400);
+        X509_gmtime_adj(X509_getm_notAfter(cert.get()), valid_to_days * 86400);
+        X509_set_pubkey(cert.get(), key_.get());
+
+        X509_NAME *name = X509_get_subject_name(cert.get());
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("gwmilter test"),
+                                   -1, -1, 0);
+        X509_set_issuer_name(cert.get(), name);
+
+        X509V3_CTX ctx;
+        X509V3_set_ctx_nodb(&ctx);
+        X509V3_set_ctx(&ctx, cert.get(), cert.get(), nullptr, nullptr, 0);
+        const std::string san = "email:" + address;
+        for (const auto &[nid, value]: {std::pair{NID_subject_alt_name, san.c_str()}, {NID_key_usage, key_usage}}) {
+            X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, &ctx, nid, value);
+            ASSERT_NE(ext, nullptr);
+            X509_add_ext(cert.get(), ext, -1);
+            X509_EXTENSION_free(ext);
+        }
+        ASSERT_GT(X509_sign(cert.get(), key_.get(), EVP_sha256()), 0);
+
+        const bio_ptr out{BIO_new_file((dir_ / file).c_str(), "w"), BIO_free_all};
+        ASSERT_TRUE(out);
+        ASSERT_EQ(PEM_write_bio_X509(out.get(), cert.get()), 1);
+    }
+
+    // Decrypts the base64 output of the encryptor with the test key
+    std::string decrypt(const std::string &encrypted, int *content_type = nullptr) const
+    {
+        const bio_ptr in{BIO_push(BIO_new(BIO_f_base64()), BIO_new_mem_buf(encrypted.data(), int(encrypted.size()))),
+                         BIO_free_all};
+        const std::unique_ptr<CMS_ContentInfo, decltype(&CMS_ContentInfo_free)> cms{d2i_CMS_bio(in.get(), nullptr),
+                                                                                    CMS_ContentInfo_free};
+        if (!cms)
+            throw std::runtime_error("unable to parse the CMS structure");
+        if (content_type != nullptr)
+            *content_type = OBJ_obj2nid(CMS_get0_type(cms.get()));
+
+        const bio_ptr out{BIO_new(BIO_s_mem()), BIO_free_all};
+        if (CMS_decrypt(cms.get(), key_.get(), nullptr, nullptr, out.get(), CMS_BINARY) != 1)
+            throw std::runtime_error("unable to decrypt");
+        char *data = nullptr;
+        const long size = BIO_get_mem_data(out.get(), &data);
+        return {data, static_cast<std::size_t>(size)};
+    }
+
+    std::filesystem::path dir_;
+    pkey_ptr key_{nullptr, EVP_PKEY_free};
+    long serial_ = 0;
+};
+
+TEST_F(OpensslCmsTest, LoadsCertificatesByAddress)
+{
+    write_certificate("alice.pem", "Alice@Example.com");
+    write_certificate("bob.pem", "bob@example.com");
+
+    const cms_encryptor encryptor(dir_.string());
+    EXPECT_EQ(encryptor.size(), 2U);
+    EXPECT_TRUE(encryptor.has_certificate("alice@example.com"));
+    EXPECT_TRUE(encryptor.has_certificate("<BOB@example.com>"));
+    EXPECT_FALSE(encryptor.has_certificate("carol@example.com"));
+}
+
+TEST_F(OpensslCmsTest, SkipsUnusableCertificates)
+{
+    write_certificate("expired.pem", "expired@example.com", -30, -1);
+    write_certificate("future.pem", "future@example.com", 1, 30);
+    write_certificate("signing.pem", "signing@example.com", -1, 30, "digitalSignature");
+
+    const cms_encryptor encryptor(dir_.string());
+    EXPECT_EQ(encryptor.size(), 3U);
+    EXPECT_FALSE(encryptor.has_certificate("expired@example.com"));
+    EXPECT_FALSE(encryptor.has_certificate("future@example.com"));
+    EXPECT_FALSE(encryptor.has_certificate("signing@example.com"));
+}
+
+TEST_F(OpensslCmsTest, EncryptsToEnvelopedData)
+{
+    write_certificate("alice.pem", "alice@example.com");
+
+    const std::string plain = "Content-Type: text/plain\r\n\r\n" + std::string(1000, 'x') + "\r\n";
+    const cms_encryptor encryptor(dir_.string());
+    std::set<std::string> missing;
+    const std::string encrypted = encryptor.encrypt({"alice@example.com", "carol@example.com"}, plain, missing);
+
+    EXPECT_EQ(missing, std::set<std::string>{"carol@example.com"});
+
+    // base64 in lines of 64 characters, like gpgsm
+    std::size_t start = 0;
+    for (auto end = encrypted.find('\n'); end != std::string::npos; end = encrypted.find('\n', start)) {
+        EXPECT_LE(end - start, 64U);
+        start = end + 1;
+    }
+    EXPECT_EQ(start, encrypted.size());
+
+    int content_type = NID_undef;
+    EXPECT_EQ(decrypt(encrypted, &content_type), plain);
+    EXPECT_EQ(content_type, NID_pkcs7_enveloped);
+}
+
+TEST_F(OpensslCmsTest, EncryptThrowsWithoutUsableCertificate)
+{
+    write_certificate("expired.pem", "expired@example.com", -30, -1);
+
+    const cms_encryptor encryptor(dir_.string());
+    std::set<std::string> missing;
+    EXPECT_THROW((void) encryptor.encrypt({"expired@example.com"}, "body", missing), std::runtime_error);
+    EXPECT_EQ(missing, std::set<std::string>{"expired@example.com"});
+}
+
+TEST_F(OpensslCmsTest, SharedEncryptorIsReloadedAfterClear)
+{
+    write_certificate("alice.pem", "alice@example.com");
+
+    const auto first = cms_encryptor::get(dir_.string());
+    EXPECT_EQ(cms_encryptor::get(dir_.string()), first);
+    EXPECT_FALSE(first->has_certificate("bob@example.com"));
+
+    write_certificate("bob.pem", "bob@example.com");
+    cms_encryptor::clear();
+    const auto second = cms_encryptor::get(dir_.string());
+    EXPECT_NE(second, first);
+    EXPECT_TRUE(second->has_certificate("bob@example.com"));
+}
+
+TEST_F(OpensslCmsTest, ThrowsForMissingDirectory)
+{
+    EXPECT_THROW(cms_encryptor((dir_ / "missing").string()), std::runtime_error);
+}
+
+TEST_F(OpensslCmsTest, SharedEncryptorKeepsTheFailureUntilClear)
+{
+    const std::string missing = (dir_ / "missing").string();
+    EXPECT_THROW(cms_encryptor::get(missing), std::runtime_error);
+
+    std::filesystem::create_directory(missing);
+    EXPECT_THROW(cms_encryptor::get(missing), std::runtime_error);
+
+    cms_encryptor::clear();
+    EXPECT_EQ(cms_encryptor::get(missing)->size(), 0U);
+}
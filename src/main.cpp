@@ -1,12 +1,18 @@
 #include "cfg2/config_manager.hpp"
+#include "keys/crypto_helpers.hpp"
 #include "logger/logger.hpp"
 #include "logger/spdlog_init.hpp"
 #include "milter/milter.hpp"
 #include "milter/milter_callbacks.hpp"
+#include "prefork_supervisor.hpp"
 #include "signal_manager.hpp"
+#include "socket_handoff.hpp"
+#include "utils/email_journal.hpp"
 #include "utils/string.hpp"
+#include "warmup.hpp"
 #include <cassert>
 #include <cerrno>
+#include <chrono>
 #include <cstdlib>
 #include <fmt/core.h>
 #include <grp.h>
@@ -91,16 +97,22 @@ int main(int argc, char *argv[])
     int ch = 0;
     const char *config_file = nullptr;
 
+    // before getopt(), which may reorder the arguments
+    socket_handoff::save_command(argc, argv);
+
     if (argc == 1) {
         print_help();
         return EXIT_FAILURE;
     }
 
-    while ((ch = getopt(argc, argv, "hc:")) != -1) {
+    while ((ch = getopt(argc, argv, "hc:x")) != -1) {
         switch (ch) {
         case 'c':
             config_file = optarg;
             break;
+        case 'x':
+            // internal: crypto helper process started by keys::crypto_helpers, serving requests from stdin
+            return keys::crypto_helpers::serve(STDIN_FILENO);
         case 'h':
         case '?':
         default:
@@ -131,15 +143,74 @@ int main(int argc, char *argv[])
 
         drop_privileges(general_cfg.user, general_cfg.group);
 
-        // Install signal handling with cfg2 reload support
-        SignalManager signal_manager(config_mgr);
+        // Dumps emails in progress if the process crashes (only when dump_email_on_panic is enabled)
+        utils::email_journal::install_crash_handler("dump");
+
+        // Done before the milter socket is opened, so the MTA connects only once the engines are ready.
+        // Also done before SignalManager blocks the signals, which would be inherited by gpg-agent.
+        if (general_cfg.warm_up)
+            warm_up(*config);
 
         spdlog::info("gwmilter starting");
         gwmilter::milter m(general_cfg.milter_socket,
                            SMFIF_ADDHDRS | SMFIF_CHGHDRS | SMFIF_CHGBODY | SMFIF_ADDRCPT | SMFIF_ADDRCPT_PAR |
                                SMFIF_DELRCPT | SMFIF_QUARANTINE | SMFIF_CHGFROM | SMFIF_SETSYMLIST,
                            general_cfg.milter_timeout);
-        m.run();
+
+        // Started in the process running the milter, i.e. in each worker
+        const auto start_crypto_helpers = []() {
+            const auto &general = callbacks::get_config()->general;
+            // a helper gets as long as the MTA waits for the milter; libmilter's default is 7210 seconds
+            const std::chrono::seconds timeout{general.milter_timeout > 0 ? general.milter_timeout : 7210};
+            if (general.crypto_helpers > 0)
+                keys::crypto_helpers::instance().start(socket_handoff::executable(), general.crypto_helpers,
+                                                       general.crypto_helper_max_jobs, timeout);
+        };
+
+        // Once the milter stopped accepting connections, the ones in progress are given time to finish
+        const auto drain = []() {
+            const std::chrono::seconds timeout{callbacks::get_config()->general.drain_timeout};
+            if (const auto open = callbacks::wait_for_connections(timeout); open > 0)
+                spdlog::warn("{} connections still open after {}s, exiting", open, timeout.count());
+        };
+
+        if (general_cfg.workers > 0) {
+            // The socket is opened once and inherited by the workers, which accept connections from it.
+            // Warm-up was done above, so the workers start with the keyrings already cached.
+            if (socket_handoff::inherited()) {
+                socket_handoff::adopt(general_cfg.milter_socket);
+            } else {
+                m.open_socket();
+                socket_handoff::opened();
+            }
+            prefork_supervisor supervisor(config_mgr, general_cfg.milter_socket, [&]() {
+                callbacks::stop_after(callbacks::get_config()->general.worker_max_messages);
+                start_crypto_helpers();
+                // SIGUSR2 is forwarded by the supervisor once the socket has been handed over
+                SignalManager signal_manager(config_mgr, []() { return true; });
+                m.run();
+                socket_handoff::restore();
+                drain();
+            });
+            socket_handoff::notify_ready();
+            supervisor.run(general_cfg.workers);
+        } else {
+            // opened before smfi_main(), so that the socket is known to socket_handoff
+            if (socket_handoff::inherited()) {
+                socket_handoff::adopt(general_cfg.milter_socket);
+            } else {
+                m.open_socket();
+                socket_handoff::opened();
+            }
+            start_crypto_helpers();
+
+            // Install signal handling with cfg2 reload support
+            SignalManager signal_manager(config_mgr, []() { return socket_handoff::start_successor(); });
+            socket_handoff::notify_ready();
+            m.run();
+            socket_handoff::restore();
+            drain();
+        }
 
         spdlog::info("gwmilter shutting down");
         return EXIT_SUCCESS;
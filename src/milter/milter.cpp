@@ -47,6 +47,19 @@ milter::milter(const std::string &socket, unsigned long flags, int timeout, int
 }
 
 
+void milter::open_socket()
+{
+    errno = 0;
+    if (smfi_opensocket(true) == MI_SUCCESS)
+        return;
+
+    if (const int err = errno; err != 0)
+        throw milter_exception(
+            fmt::format("smfi_opensocket failed for socket '{}': {}", socket_, utils::string::str_err(err)));
+    throw milter_exception(fmt::format("smfi_opensocket failed for socket '{}': unknown error", socket_));
+}
+
+
 void milter::run()
 {
     errno = 0;
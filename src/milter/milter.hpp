@@ -12,6 +12,10 @@ public:
     milter(const milter &) = delete;
     milter &operator=(const milter &) = delete;
 
+    // Opens the milter socket ahead of run(), so that it can be shared by forked workers.
+    // A stale unix socket left by a previous instance is removed.
+    void open_socket();
+
     void run();
 
 private:
@@ -4,8 +4,10 @@
 #include "milter_connection.hpp"
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <exception>
 #include <libmilter/mfapi.h>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -13,6 +15,33 @@ namespace gwmilter {
 
 namespace {
 std::shared_ptr<const cfg2::Config> g_config;
+std::atomic<unsigned long> g_max_messages{0};
+std::atomic<unsigned long> g_messages{0};
+std::mutex g_connections_mutex;
+std::condition_variable g_connections_cv;
+std::size_t g_connections = 0;
+
+void count_message()
+{
+    const unsigned long max_messages = g_max_messages.load(std::memory_order_relaxed);
+    if (max_messages != 0 && ++g_messages == max_messages) {
+        spdlog::info("{} emails processed, stopping milter", max_messages);
+        smfi_stop();
+    }
+}
+
+void connection_opened()
+{
+    std::lock_guard lock(g_connections_mutex);
+    ++g_connections;
+}
+
+void connection_closed()
+{
+    std::lock_guard lock(g_connections_mutex);
+    if (--g_connections == 0)
+        g_connections_cv.notify_all();
+}
 } // namespace
 
 sfsistat xxfi_connect(SMFICTX *ctx, char *hostname, _SOCK_ADDR *hostaddr)
@@ -20,6 +49,7 @@ sfsistat xxfi_connect(SMFICTX *ctx, char *hostname, _SOCK_ADDR *hostaddr)
     try {
         auto *m = new milter_connection(ctx);
         smfi_setpriv(ctx, m);
+        connection_opened();
 
         return m->on_connect(hostname, hostaddr);
     } catch (const std::exception &e) {
@@ -55,6 +85,7 @@ sfsistat xxfi_close(SMFICTX *ctx)
             ret = m->on_close();
             delete m;
             smfi_setpriv(ctx, nullptr);
+            connection_closed();
         }
 
         return ret;
@@ -187,16 +218,18 @@ sfsistat xxfi_body(SMFICTX *ctx, unsigned char *bodyp, size_t len)
 
 sfsistat xxfi_eom(SMFICTX *ctx)
 {
+    sfsistat ret = SMFIS_TEMPFAIL;
     try {
         if (auto *m = static_cast<milter_connection *>(smfi_getpriv(ctx)))
-            return m->on_eom();
+            ret = m->on_eom();
     } catch (const std::exception &e) {
         spdlog::error("std::exception caught: {}", e.what());
     } catch (...) {
         spdlog::error("unknown exception caught");
     }
 
-    return SMFIS_TEMPFAIL;
+    count_message();
+    return ret;
 }
 
 
@@ -231,6 +264,19 @@ std::shared_ptr<const cfg2::Config> get_config()
     return config;
 }
 
+void stop_after(unsigned long max_messages)
+{
+    g_messages = 0;
+    g_max_messages = max_messages;
+}
+
+std::size_t wait_for_connections(std::chrono::seconds timeout)
+{
+    std::unique_lock lock(g_connections_mutex);
+    g_connections_cv.wait_for(lock, timeout, [] { return g_connections == 0; });
+    return g_connections;
+}
+
 } // namespace callbacks
 
 } // namespace gwmilter
@@ -1,4 +1,6 @@
 #pragma once
+#include <chrono>
+#include <cstddef>
 #include <libmilter/mfapi.h>
 #include <memory>
 
@@ -25,6 +27,12 @@ sfsistat xxfi_close(SMFICTX *ctx);
 namespace callbacks {
 void set_config(std::shared_ptr<const cfg2::Config> config);
 std::shared_ptr<const cfg2::Config> get_config();
+// Stops the milter (smfi_stop) once max_messages emails have been processed; 0 disables the limit.
+// Used to recycle worker processes.
+void stop_after(unsigned long max_messages);
+// Waits until all MTA connections are closed, at most `timeout`; returns the number of connections still open.
+// Used to drain the connections in progress once the milter stopped accepting new ones.
+std::size_t wait_for_connections(std::chrono::seconds timeout);
 } // namespace callbacks
 
 } // namespace gwmilter
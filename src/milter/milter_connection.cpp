@@ -1,5 +1,6 @@
 #include "milter_connection.hpp"
 #include "logger/logger.hpp"
+#include "utils/probes.hpp"
 #include <arpa/inet.h>
 #include <libmilter/mfapi.h>
 #include <netinet/in.h>
@@ -10,8 +11,9 @@ namespace gwmilter {
 
 sfsistat milter_connection::on_connect(const std::string &hostname, _SOCK_ADDR *hostaddr)
 {
-    spdlog::info("{}: connect from hostname={}, hostaddr={}", connection_id_, hostname,
-                 milter_connection::hostaddr_to_string(hostaddr));
+    const std::string addr = milter_connection::hostaddr_to_string(hostaddr);
+    spdlog::info("{}: connect from hostname={}, hostaddr={}", connection_id_, hostname, addr);
+    GWMILTER_PROBE(connection__open, connection_id_.c_str(), hostname.c_str(), addr.c_str());
     return SMFIS_CONTINUE;
 }
 
@@ -26,6 +28,7 @@ sfsistat milter_connection::on_helo(const std::string &helohost)
 sfsistat milter_connection::on_close()
 {
     spdlog::info("{}: close-connection", connection_id_);
+    GWMILTER_PROBE(connection__close, connection_id_.c_str());
     msg_.reset();
     return SMFIS_CONTINUE;
 }
@@ -1,13 +1,23 @@
 #include "milter_message.hpp"
 #include "cfg2/config.hpp"
 #include "handlers/body_handler.hpp"
+#include "handlers/encryption_cache.hpp"
+#include "keys/openssl_cms.hpp"
 #include "logger/logger.hpp"
 #include "milter_exception.hpp"
+#include "smtp/relay_pool.hpp"
 #include "smtp/smtp_client.hpp"
-#include "utils/dump_email.hpp"
+#include "utils/admission_control.hpp"
+#include "utils/email_journal.hpp"
+#include "utils/probes.hpp"
 #include "utils/string.hpp"
+#include "utils/task_pool.hpp"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <functional>
 #include <libmilter/mfapi.h>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -18,7 +28,8 @@ const std::string milter_message::x_gwmilter_signature = "X-GWMilter-Signature";
 
 milter_message::milter_message(SMFICTX *ctx, const std::string &connection_id,
                                std::shared_ptr<const cfg2::Config> config)
-    : smfictx_{ctx}, config_{std::move(config)}, connection_id_{connection_id}, message_id_{uid_gen_.generate()}
+    : smfictx_{ctx}, config_{std::move(config)}, connection_id_{connection_id}, message_id_{uid_gen_.generate()},
+      memory_{utils::admission_control::instance()}
 {
     assert(config_ != nullptr && "milter_message requires non-null config");
     spdlog::info("{}: begin message (connection_id={})", message_id_, connection_id_);
@@ -40,6 +51,7 @@ sfsistat milter_message::on_envfrom(const std::vector<std::string> &args)
 
     spdlog::info("{}: from={}", message_id_, args[0]);
     sender_ = args[0];
+    GWMILTER_PROBE(message__envfrom, message_id_.c_str(), sender_.c_str());
     return SMFIS_CONTINUE;
 }
 
@@ -53,6 +65,7 @@ sfsistat milter_message::on_envrcpt(const std::vector<std::string> &args)
 
     const std::string &rcpt = args[0];
     spdlog::info("{}: to={}", message_id_, rcpt);
+    GWMILTER_PROBE(message__envrcpt, message_id_.c_str(), rcpt.c_str());
 
     // Look up encryption section in cfg2
     const cfg2::BaseEncryptionSection *section = config_->find_match(rcpt);
@@ -67,41 +80,23 @@ sfsistat milter_message::on_envrcpt(const std::vector<std::string> &args)
     spdlog::debug("{}: recipient {} was found in section {}", message_id_, rcpt, section->sectionName);
     email_context &context = get_context(section);
 
-    if (context.body_handler->has_public_key(rcpt)) {
+    if (config_->general.batch_key_lookup) {
+        // the keys of all recipients are looked up at once, in on_data()
+        context.pending_recipients.emplace_back(rcpt);
+        recipients_all_.emplace_back(rcpt);
+        return SMFIS_CONTINUE;
+    }
+
+    GWMILTER_PROBE(key__lookup__start, message_id_.c_str(), section->sectionName.c_str(), rcpt.c_str());
+    const bool key_found = context.body_handler->has_public_key(rcpt);
+    GWMILTER_PROBE(key__lookup__done, message_id_.c_str(), section->sectionName.c_str(), rcpt.c_str(),
+                   static_cast<int>(key_found));
+
+    if (key_found) {
         spdlog::debug("{}: found public key in local keyring for {}", message_id_, rcpt);
         context.recipients[rcpt] = true;
-    } else {
-        spdlog::debug("{}: couldn't find public key in local keyring for {}", message_id_, rcpt);
-
-        // Get key_not_found_policy from cfg2 section (only pgp/smime expose a value).
-        const auto policy = section->key_not_found_policy_value();
-        if (!policy.has_value()) {
-            spdlog::error("{}: section {} missing key_not_found_policy for recipient {}", message_id_,
-                          section->sectionName, rcpt);
-            set_reply("451", "4.3.0", "Temporary configuration error");
-            return SMFIS_TEMPFAIL;
-        }
-        switch (*policy) {
-        case cfg2::KeyNotFoundPolicy::Discard:
-            spdlog::warn("{}: discarding recipient {}", message_id_, rcpt);
-            context.recipients[rcpt] = false;
-            break;
-        case cfg2::KeyNotFoundPolicy::Retrieve:
-            // XXX: maybe the key importing should be done in another place to
-            // avoid delays or timeouts in this part of the MTA-to-MTA communication
-            if (context.body_handler->import_public_key(rcpt)) {
-                spdlog::info("{}: imported new public key for {}", message_id_, rcpt);
-                context.recipients[rcpt] = true;
-            } else {
-                spdlog::warn("{}: failed to import new public key for {}", message_id_, rcpt);
-                context.recipients[rcpt] = false;
-            }
-            break;
-        case cfg2::KeyNotFoundPolicy::Reject:
-            set_reply("550", "5.7.1", "Recipient does not have a public key");
-            spdlog::warn("{}: rejected recipient {} due to missing public key", message_id_, rcpt);
-            return SMFIS_REJECT;
-        }
+    } else if (const sfsistat status = on_missing_key(context, rcpt); status != SMFIS_CONTINUE) {
+        return status;
     }
 
     recipients_all_.emplace_back(rcpt);
@@ -113,6 +108,20 @@ sfsistat milter_message::on_data()
 {
     spdlog::debug("{}: data", message_id_);
 
+    // refuse new emails early when overloaded; the MTA retries them later
+    const auto &admission = utils::admission_control::instance();
+    if (admission.over_budget(memory_budget()) ||
+        admission.encryption_stage_full(config_->general.max_concurrent_encryptions))
+    {
+        spdlog::warn("{}: overloaded ({} bytes in use, {} emails being encrypted), rejecting email temporarily",
+                     message_id_, admission.used(), admission.encrypting());
+        set_reply("451", "4.3.2", "System busy, try again later");
+        return SMFIS_TEMPFAIL;
+    }
+
+    if (const sfsistat status = resolve_pending_recipients(); status != SMFIS_CONTINUE)
+        return status;
+
     unsigned int rcpt_count = 0;
     for (auto &[_, context]: contexts_) {
         // put recipients that have public key in good_recipients
@@ -124,11 +133,28 @@ sfsistat milter_message::on_data()
         }
     }
 
+    GWMILTER_PROBE(message__data, message_id_.c_str(), rcpt_count, contexts_.size());
+
     if (rcpt_count == 0) {
         spdlog::warn("{}: no recipient matches the existing configuration sections, rejecting email", message_id_);
         return SMFIS_REJECT;
     }
 
+    // All sections but the first are re-injected: with several, the connection is set up while the body arrives
+    // and is encrypted. Re-injected emails, only known once their headers arrive, drop it unused.
+    const auto sections = std::count_if(contexts_.begin(), contexts_.end(), [](const auto &c) {
+        return !c.second.good_recipients.empty();
+    });
+    if (sections > 1) {
+        try {
+            reinjection_ = make_reinjection_client();
+            reinjection_->prepare();
+        } catch (const std::exception &e) {
+            spdlog::warn("{}: unable to prepare the SMTP connection: {}", message_id_, e.what());
+            reinjection_.reset();
+        }
+    }
+
     return SMFIS_CONTINUE;
 }
 
@@ -139,6 +165,7 @@ sfsistat milter_message::on_header(const std::string &headerf, const std::string
 
     // XXX: debugging
     headers_ += headerf + ": " + headerv + "\r\n";
+    GWMILTER_PROBE(message__header, message_id_.c_str(), headerf.c_str(), headerv.size());
 
     if (headerf == x_gwmilter_signature) {
         signature_header_ = headerv;
@@ -147,6 +174,9 @@ sfsistat milter_message::on_header(const std::string &headerf, const std::string
         return SMFIS_CONTINUE;
     }
 
+    if (utils::string::iequals(headerf.substr(0, 8), "Content-"))
+        content_headers_ += utils::string::to_lower(headerf) + ':' + headerv + '\n';
+
     for (auto &[_, context]: contexts_)
         context.body_handler->add_header(headerf, headerv);
 
@@ -157,6 +187,7 @@ sfsistat milter_message::on_header(const std::string &headerf, const std::string
 sfsistat milter_message::on_eoh()
 {
     spdlog::debug("{}: end-of-headers", message_id_);
+    GWMILTER_PROBE(message__eoh, message_id_.c_str(), headers_.size());
     return SMFIS_CONTINUE;
 }
 
@@ -164,7 +195,16 @@ sfsistat milter_message::on_eoh()
 sfsistat milter_message::on_body(const std::string &body)
 {
     spdlog::debug("{}: body size={}", message_id_, body.size());
+
+    if (!memory_.try_add(body.size(), memory_budget())) {
+        spdlog::warn("{}: memory budget exhausted ({} bytes in use), rejecting email temporarily", message_id_,
+                     utils::admission_control::instance().used());
+        set_reply("452", "4.3.1", "Insufficient system resources, try again later");
+        return SMFIS_TEMPFAIL;
+    }
+
     body_ += body;
+    GWMILTER_PROBE(message__body, message_id_.c_str(), body.size(), body_.size());
     return SMFIS_CONTINUE;
 }
 
@@ -172,9 +212,11 @@ sfsistat milter_message::on_body(const std::string &body)
 sfsistat milter_message::on_eom()
 {
     spdlog::debug("{}: end-of-message", message_id_);
+    GWMILTER_PROBE(message__eom, message_id_.c_str(), headers_.size(), body_.size());
 
-    utils::dump_email dmp("dump", "crash-", connection_id_, message_id_, headers_, body_, true,
-                          config_->general.dump_email_on_panic);
+    // keeps a reference to the email in memory, so it can be dumped if processing crashes or fails
+    const utils::email_journal::entry journal(connection_id_, message_id_, headers_, body_,
+                                              config_->general.dump_email_on_panic);
 
     try {
         if (!signature_header_.empty()) {
@@ -195,6 +237,17 @@ sfsistat milter_message::on_eom()
     }
 
     try {
+        {
+            // bounds the number of emails encrypted at the same time
+            const utils::admission_control::encryption_slot slot(utils::admission_control::instance(),
+                                                                 config_->general.max_concurrent_encryptions);
+            encrypt_all();
+        }
+
+        // the encrypted bodies are kept until the end of the message
+        for (const auto &[_, ctx]: contexts_)
+            memory_.add(ctx.encrypted_body->size());
+
         // process all matching configuration sections for current milter message
         std::vector<smtp::work_item> smtp_work_items;
 
@@ -207,16 +260,8 @@ sfsistat milter_message::on_eom()
                 continue;
             }
 
-            ctx.body_handler->write(body_);
-            ctx.body_handler->encrypt(ctx.good_recipients, *ctx.encrypted_body);
-
-            int i = 1;
-            for (const auto &r: ctx.body_handler->failed_recipients()) {
-                spdlog::debug("{}: failed key #{} = {}", message_id_, i, r);
-                ++i;
-            }
-
             headers_type headers = ctx.body_handler->get_headers();
+            encryption_cache::restore_headers(headers, ctx.cached_headers);
 
             if (!milter_body_replaced) {
                 // If multiple protocols are used to encrypt this email then
@@ -237,28 +282,38 @@ sfsistat milter_message::on_eom()
 
                 update_milter_recipients(ctx.good_recipients);
             } else {
-                // only one key is used to sign
-                std::set<std::string> keys;
-                keys.insert(config_->general.signing_key);
-                std::string signature;
-                sign(keys, *ctx.encrypted_body, signature);
-                pack_header_value(signature, x_gwmilter_signature.size());
-
-                headers.emplace_back(x_gwmilter_signature, signature, 1, true);
-
-                smtp::work_item wi(config_->general.smtp_server);
+                smtp::work_item wi;
                 wi.set_sender(sender_);
                 wi.set_recipients(ctx.good_recipients);
+
+                if (config_->general.smime_transfer_encoding == cfg2::TransferEncoding::Binary &&
+                    dynamic_cast<const smime_body_handler *>(ctx.body_handler.get()) != nullptr)
+                {
+                    // sent instead of the base64 body when the server supports it; the signature covers
+                    // the body as received, hence each form has its own
+                    auto binary_body =
+                        std::make_shared<std::string>(smime_body_handler::to_binary(*ctx.encrypted_body));
+                    memory_.add(binary_body->size());
+                    headers_type binary_headers = headers;
+                    smime_body_handler::set_binary_transfer_encoding(binary_headers);
+                    add_signature(binary_headers, *binary_body);
+                    wi.set_binary_message(binary_headers, binary_body);
+                }
+
+                add_signature(headers, *ctx.encrypted_body);
                 wi.set_message(headers, ctx.encrypted_body);
                 smtp_work_items.push_back(wi);
             }
         }
 
         if (!smtp_work_items.empty()) {
-            smtp::client_multi cm(config_->general.smtp_server_timeout);
+            const auto client = reinjection_ ? std::move(reinjection_) : make_reinjection_client();
 
-            for (const auto &wi: smtp_work_items)
-                cm.add(wi);
+            std::size_t smtp_bytes = 0;
+            for (const auto &wi: smtp_work_items) {
+                client->add(wi);
+                smtp_bytes += wi.size();
+            }
 
             try {
                 // XXX
@@ -268,24 +323,25 @@ sfsistat milter_message::on_eom()
                 // looks like the better choice, although when the message
                 // arrives in milter again, it will end up being sent to the
                 // same recipients once more.
-                int failed_count = cm.perform();
+                GWMILTER_PROBE(smtp__start, message_id_.c_str(), smtp_work_items.size(), smtp_bytes);
+                int failed_count = client->perform();
+                GWMILTER_PROBE(smtp__done, message_id_.c_str(), smtp_work_items.size(), failed_count);
                 if (failed_count != 0) {
                     spdlog::warn("{}: {} out of {} emails failed during delivery, email is rejected temporarily",
                                  message_id_, failed_count, smtp_work_items.size());
                     return SMFIS_TEMPFAIL;
                 }
             } catch (const std::runtime_error &e) {
+                GWMILTER_PROBE(smtp__done, message_id_.c_str(), smtp_work_items.size(), -1);
                 return SMFIS_TEMPFAIL;
             }
         }
     } catch (const std::exception &e) {
         spdlog::error("{}: exception caught: {}", message_id_, e.what());
-        utils::dump_email dmp("dump", "exception-", connection_id_, message_id_, headers_, body_, false,
-                              config_->general.dump_email_on_panic);
+        journal.persist("dump", "exception-");
         return SMFIS_TEMPFAIL;
     } catch (...) {
-        utils::dump_email dmp("dump", "exception-", connection_id_, message_id_, headers_, body_, false,
-                              config_->general.dump_email_on_panic);
+        journal.persist("dump", "exception-");
         spdlog::debug("{}: unknown exception caught", message_id_);
         return SMFIS_TEMPFAIL;
     }
@@ -297,10 +353,215 @@ sfsistat milter_message::on_eom()
 sfsistat milter_message::on_abort()
 {
     spdlog::debug("{}: aborted", message_id_);
+    GWMILTER_PROBE(message__abort, message_id_.c_str(), body_.size());
+    return SMFIS_CONTINUE;
+}
+
+
+sfsistat milter_message::on_missing_key(email_context &context, const std::string &rcpt)
+{
+    const cfg2::BaseEncryptionSection *section = context.section;
+    spdlog::debug("{}: couldn't find public key in local keyring for {}", message_id_, rcpt);
+
+    // Get key_not_found_policy from cfg2 section (only pgp/smime expose a value).
+    const auto policy = section->key_not_found_policy_value();
+    if (!policy.has_value()) {
+        spdlog::error("{}: section {} missing key_not_found_policy for recipient {}", message_id_,
+                      section->sectionName, rcpt);
+        set_reply("451", "4.3.0", "Temporary configuration error");
+        return SMFIS_TEMPFAIL;
+    }
+    switch (*policy) {
+    case cfg2::KeyNotFoundPolicy::Discard:
+        spdlog::warn("{}: discarding recipient {}", message_id_, rcpt);
+        context.recipients[rcpt] = false;
+        break;
+    case cfg2::KeyNotFoundPolicy::Retrieve:
+        // XXX: maybe the key importing should be done in another place to
+        // avoid delays or timeouts in this part of the MTA-to-MTA communication
+        GWMILTER_PROBE(key__import__start, message_id_.c_str(), section->sectionName.c_str(), rcpt.c_str());
+        if (context.body_handler->import_public_key(rcpt)) {
+            spdlog::info("{}: imported new public key for {}", message_id_, rcpt);
+            context.recipients[rcpt] = true;
+        } else {
+            spdlog::warn("{}: failed to import new public key for {}", message_id_, rcpt);
+            context.recipients[rcpt] = false;
+        }
+        GWMILTER_PROBE(key__import__done, message_id_.c_str(), section->sectionName.c_str(), rcpt.c_str(),
+                       static_cast<int>(context.recipients[rcpt]));
+        break;
+    case cfg2::KeyNotFoundPolicy::Reject:
+        set_reply("550", "5.7.1", "Recipient does not have a public key");
+        spdlog::warn("{}: rejected recipient {} due to missing public key", message_id_, rcpt);
+        return SMFIS_REJECT;
+    }
+
+    return SMFIS_CONTINUE;
+}
+
+
+sfsistat milter_message::resolve_pending_recipients()
+{
+    for (auto &[section, context]: contexts_) {
+        if (context.pending_recipients.empty())
+            continue;
+
+        GWMILTER_PROBE(key__batch__lookup__start, message_id_.c_str(), section.c_str(),
+                       context.pending_recipients.size());
+        const auto found = context.body_handler->find_public_keys(context.pending_recipients);
+        GWMILTER_PROBE(key__batch__lookup__done, message_id_.c_str(), section.c_str(), found.size());
+        spdlog::debug("{}: section {}: found public keys for {} out of {} recipients", message_id_, section,
+                      found.size(), context.pending_recipients.size());
+
+        for (const auto &rcpt: context.pending_recipients) {
+            if (found.count(rcpt) != 0) {
+                context.recipients[rcpt] = true;
+                continue;
+            }
+
+            const sfsistat status = on_missing_key(context, rcpt);
+            if (status == SMFIS_REJECT) {
+                // The recipient was already accepted at RCPT TO, hence the rejection is deferred
+                // until now, and applies to the whole email.
+                set_reply("550", "5.7.1", "Email rejected, a recipient does not have a public key");
+                spdlog::warn("{}: rejecting email, recipient {} does not have a public key", message_id_, rcpt);
+            }
+            if (status != SMFIS_CONTINUE)
+                return status;
+        }
+
+        context.pending_recipients.clear();
+    }
+
     return SMFIS_CONTINUE;
 }
 
 
+void milter_message::encrypt_all()
+{
+    // Sections are independent of each other: each one has its own body handler and output buffer.
+    // The encryption tasks are run in parallel on the shared task pool (encryption_threads), the current
+    // (milter) thread taking part. With pgp_encrypt_once, the PGP sections sharing a keyring make a single task.
+    // PGP and S/MIME sections found in the encryption cache are not encrypted again.
+    std::vector<std::function<void()>> tasks;
+    std::map<std::string, std::vector<section_ref>> pgp_groups;
+
+    auto &cache = encryption_cache::instance();
+    const std::size_t cache_size = static_cast<std::size_t>(config_->general.encryption_cache_size) * 1024 * 1024;
+    const std::chrono::seconds cache_ttl{config_->general.encryption_cache_ttl};
+    std::vector<std::pair<const email_context *, std::string>> cache_misses;
+    // sections to encrypt, each body handler making its own copy of the body
+    std::size_t copies = 0;
+
+    for (auto &[section, ctx]: contexts_) {
+        if (ctx.good_recipients.empty())
+            continue;
+
+        if (cache_size > 0 && cache_ttl.count() > 0 &&
+            dynamic_cast<const gpgme_body_handler *>(ctx.body_handler.get()) != nullptr)
+        {
+            std::string key = cache_key(section, ctx);
+            if (auto cached = cache.get(key)) {
+                ctx.encrypted_body = std::move(cached->encrypted_body);
+                ctx.cached_headers = std::move(cached->headers);
+                GWMILTER_PROBE(encrypt__cached, message_id_.c_str(), section.c_str(), ctx.encrypted_body->size());
+                spdlog::debug("{}: section {} taken from the encryption cache", message_id_, section);
+                continue;
+            }
+            cache_misses.emplace_back(&ctx, std::move(key));
+        }
+
+        ++copies;
+        if (config_->general.pgp_encrypt_once) {
+            if (const auto *pgp = dynamic_cast<const pgp_body_handler *>(ctx.body_handler.get()); pgp != nullptr) {
+                pgp_groups[pgp->gnupg_home()].emplace_back(&section, &ctx);
+                continue;
+            }
+        }
+        tasks.emplace_back([this, &section = section, &ctx = ctx] { encrypt(section, ctx); });
+    }
+
+    for (auto &[_, group]: pgp_groups) {
+        if (group.size() == 1)
+            tasks.emplace_back([this, ref = group.front()] { encrypt(*ref.first, *ref.second); });
+        else
+            tasks.emplace_back([this, &group = group] { encrypt_once(group); });
+    }
+
+    if (tasks.empty())
+        return;
+
+    memory_.add(body_.size() * copies);
+    // rethrows the first failure, once all the tasks are done
+    utils::task_pool::instance().run(tasks, static_cast<std::size_t>(config_->general.encryption_threads));
+
+    for (const auto &[ctx, key]: cache_misses) {
+        // only the Content-* headers depend on the encryption, the others are taken from the email
+        headers_type headers;
+        for (const auto &h: ctx->body_handler->get_headers())
+            if (h.modified && utils::string::iequals(h.name.substr(0, 8), "Content-"))
+                headers.push_back(h);
+        cache.put(key, {ctx->encrypted_body, std::move(headers)}, cache_ttl, cache_size);
+    }
+}
+
+
+void milter_message::encrypt(const std::string &section, email_context &ctx)
+{
+    GWMILTER_PROBE(encrypt__start, message_id_.c_str(), section.c_str(), body_.size(), ctx.good_recipients.size());
+    ctx.body_handler->write(body_);
+    ctx.body_handler->encrypt(ctx.good_recipients, *ctx.encrypted_body);
+    encrypted(section, ctx);
+}
+
+
+void milter_message::encrypt_once(const std::vector<section_ref> &group)
+{
+    std::vector<pgp_body_handler::job> jobs;
+    for (const auto &[section, ctx]: group) {
+        GWMILTER_PROBE(encrypt__start, message_id_.c_str(), section->c_str(), body_.size(),
+                       ctx->good_recipients.size());
+        ctx->body_handler->write(body_);
+        jobs.push_back({static_cast<pgp_body_handler *>(ctx->body_handler.get()), &ctx->good_recipients,
+                        ctx->encrypted_body.get()});
+    }
+
+    if (!pgp_body_handler::encrypt_once(jobs)) {
+        for (const auto &j: jobs)
+            j.handler->encrypt(*j.recipients, *j.out);
+    }
+
+    for (const auto &[section, ctx]: group)
+        encrypted(*section, *ctx);
+}
+
+
+void milter_message::encrypted(const std::string &section, const email_context &ctx)
+{
+    GWMILTER_PROBE(encrypt__done, message_id_.c_str(), section.c_str(), ctx.encrypted_body->size(),
+                   ctx.body_handler->failed_recipients().size());
+
+    int i = 1;
+    for (const auto &r: ctx.body_handler->failed_recipients()) {
+        spdlog::debug("{}: section {} failed key #{} = {}", message_id_, section, i, r);
+        ++i;
+    }
+}
+
+
+std::string milter_message::cache_key(const std::string &section, const email_context &ctx) const
+{
+    // good_recipients is sorted
+    std::string recipients;
+    for (const auto &r: ctx.good_recipients)
+        recipients += r + '\n';
+    // a key replaced, revoked or expired since makes a different key, instead of reusing the old encryption
+    const auto &handler = static_cast<const gpgme_body_handler &>(*ctx.body_handler);
+    return encryption_cache::make_key(
+        {section, content_headers_, body_, recipients, handler.key_fingerprints(ctx.good_recipients)});
+}
+
+
 void milter_message::replace_headers(const headers_type &headers)
 {
     for (const auto &h: headers) {
@@ -345,7 +606,11 @@ bool milter_message::verify_signature()
     signature.write("\n-----END PGP SIGNATURE-----");
     signature.seek(0, data_buffer::SET);
 
-    if (c.verify(signature, body)) {
+    GWMILTER_PROBE(verify__start, message_id_.c_str(), body_.size());
+    const bool verified = c.verify(signature, body);
+    GWMILTER_PROBE(verify__done, message_id_.c_str(), static_cast<int>(verified));
+
+    if (verified) {
         spdlog::debug("{}: signature header verifies, removing {} header", message_id_, x_gwmilter_signature);
 
         if (smfi_chgheader(smfictx_, const_cast<char *>(x_gwmilter_signature.c_str()), 1, nullptr) == MI_FAILURE)
@@ -358,11 +623,25 @@ bool milter_message::verify_signature()
 }
 
 
+void milter_message::add_signature(headers_type &headers, const std::string &body)
+{
+    // only one key is used to sign
+    std::set<std::string> keys;
+    keys.insert(config_->general.signing_key);
+    std::string signature;
+    sign(keys, body, signature);
+    pack_header_value(signature, x_gwmilter_signature.size());
+
+    headers.emplace_back(x_gwmilter_signature, signature, 1, true);
+}
+
+
 void milter_message::sign(const std::set<std::string> &keys, const std::string &in, std::string &out)
 {
     using namespace egpgcrypt;
 
     spdlog::debug("{}: signing message size={}", message_id_, in.size());
+    GWMILTER_PROBE(sign__start, message_id_.c_str(), in.size());
 
     // always use PGP to sign
     crypto c(GPGME_PROTOCOL_OpenPGP);
@@ -370,6 +649,7 @@ void milter_message::sign(const std::set<std::string> &keys, const std::string &
     memory_data_buffer out_buf;
     c.sign(keys, in_buf, out_buf);
     out = out_buf.content();
+    GWMILTER_PROBE(sign__done, message_id_.c_str(), out.size());
 
     auto pos = out.find("\n\n");
     if (pos == std::string::npos)
@@ -420,16 +700,33 @@ milter_message::email_context &milter_message::get_context(const cfg2::BaseEncry
     if (it == contexts_.end()) {
         // there's no context for the current section,
         // therefore one needs to be created
+        const std::chrono::seconds key_cache_ttl{config_->general.key_cache_ttl};
         switch (section->encryption_protocol) {
-        case cfg2::EncryptionProtocol::Pgp:
+        case cfg2::EncryptionProtocol::Pgp: {
+            const auto *pgp_section = dynamic_cast<const cfg2::PgpEncryptionSection *>(section);
+            if (pgp_section == nullptr)
+                throw std::runtime_error("PGP section type mismatch for: " + section->sectionName);
             return contexts_
-                .emplace_back(section->sectionName, email_context{.body_handler = std::make_shared<pgp_body_handler>()})
+                .emplace_back(section->sectionName,
+                              email_context{.section = section,
+                                            .body_handler = std::make_shared<pgp_body_handler>(
+                                                pgp_section->gnupg_home, key_cache_ttl, pgp_section->compression)})
                 .second;
-        case cfg2::EncryptionProtocol::Smime:
+        }
+        case cfg2::EncryptionProtocol::Smime: {
+            const auto *smime_section = dynamic_cast<const cfg2::SmimeEncryptionSection *>(section);
+            if (smime_section == nullptr)
+                throw std::runtime_error("S/MIME section type mismatch for: " + section->sectionName);
+            std::shared_ptr<const keys::cms_encryptor> encryptor;
+            if (smime_section->cms_backend == cfg2::CmsBackend::Openssl)
+                encryptor = keys::cms_encryptor::get(smime_section->certificate_dir);
             return contexts_
                 .emplace_back(section->sectionName,
-                              email_context{.body_handler = std::make_shared<smime_body_handler>()})
+                              email_context{.section = section,
+                                            .body_handler = std::make_shared<smime_body_handler>(
+                                                smime_section->gnupg_home, key_cache_ttl, std::move(encryptor))})
                 .second;
+        }
         case cfg2::EncryptionProtocol::Pdf: {
             // Safeguard: encryption_protocol guarantees the type, but verify at runtime
             const auto *pdf_section = dynamic_cast<const cfg2::PdfEncryptionSection *>(section);
@@ -437,13 +734,15 @@ milter_message::email_context &milter_message::get_context(const cfg2::BaseEncry
                 throw std::runtime_error("PDF section type mismatch for: " + section->sectionName);
             return contexts_
                 .emplace_back(section->sectionName,
-                              email_context{.body_handler = std::make_shared<pdf_body_handler>(*pdf_section)})
+                              email_context{.section = section,
+                                            .body_handler = std::make_shared<pdf_body_handler>(*pdf_section)})
                 .second;
         }
         case cfg2::EncryptionProtocol::None:
             return contexts_
                 .emplace_back(section->sectionName,
-                              email_context{.body_handler = std::make_shared<noop_body_handler>()})
+                              email_context{.section = section,
+                                            .body_handler = std::make_shared<noop_body_handler>()})
                 .second;
         }
         throw std::runtime_error("Unknown encryption protocol: " +
@@ -465,6 +764,24 @@ void milter_message::update_milter_recipients(const std::set<std::string> &good_
 }
 
 
+std::size_t milter_message::memory_budget() const
+{
+    return static_cast<std::size_t>(config_->general.memory_budget) * 1024 * 1024;
+}
+
+
+std::unique_ptr<smtp::client> milter_message::make_reinjection_client() const
+{
+    const auto &general = config_->general;
+    const smtp::relay_pool::settings settings{
+        .max_failures = general.smtp_relay_max_failures,
+        .retry_interval = std::chrono::seconds{general.smtp_relay_retry_interval},
+    };
+    return std::make_unique<smtp::relay_client>(smtp::relay_pool::get(general.smtp_server, settings),
+                                                general.smtp_server_timeout);
+}
+
+
 void milter_message::set_reply(const char *p1, const char *p2, const char *p3) const
 {
     smfi_setreply(smfictx_, const_cast<char *>(p1), const_cast<char *>(p2), const_cast<char *>(p3));
@@ -1,6 +1,7 @@
 #pragma once
 #include "handlers/body_handler.hpp"
 #include "smtp/smtp_client.hpp"
+#include "utils/admission_control.hpp"
 #include "utils/uid_generator.hpp"
 #include <crypto.hpp>
 #include <data_buffers.hpp>
@@ -9,6 +10,7 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace cfg2 {
@@ -38,8 +40,25 @@ public:
     sfsistat on_abort();
 
 private:
+    // Applies the section's key_not_found_policy to a recipient without public key
+    sfsistat on_missing_key(email_context &ctx, const std::string &rcpt);
+    // Looks up the public keys of the recipients collected while batch_key_lookup is enabled
+    sfsistat resolve_pending_recipients();
+    // Encrypts the body for all sections that have recipients
+    void encrypt_all();
+    void encrypt(const std::string &section, email_context &ctx);
+    // section name and context
+    using section_ref = std::pair<const std::string *, email_context *>;
+    // Encrypts PGP sections sharing a keyring together (pgp_encrypt_once)
+    void encrypt_once(const std::vector<section_ref> &group);
+    // Reports the outcome of the encryption of a section
+    void encrypted(const std::string &section, const email_context &ctx);
+    // Key of the section's encrypted body in the encryption cache, covering the keys of the recipients
+    std::string cache_key(const std::string &section, const email_context &ctx) const;
     void replace_headers(const headers_type &headers);
     bool verify_signature();
+    // Signs the body of a re-injected email, adding the signature header
+    void add_signature(headers_type &headers, const std::string &body);
     void sign(const std::set<std::string> &keys, const std::string &in, std::string &out);
     static void pack_header_value(std::string &value, std::string::size_type header_name_size,
                                   std::string::size_type max_line_size = RFC5322_MAX_LINE_SIZE);
@@ -49,6 +68,10 @@ private:
     // Removes milter recipients that are not present in good_recipients
     void update_milter_recipients(const std::set<std::string> &good_recipients) const;
     void set_reply(const char *, const char *, const char *) const;
+    // memory_budget setting, in bytes
+    std::size_t memory_budget() const;
+    // Client sending the re-injected emails through the smtp_server relays
+    std::unique_ptr<smtp::client> make_reinjection_client() const;
 
 private:
     const static std::string x_gwmilter_signature;
@@ -67,14 +90,27 @@ private:
     std::string signature_header_;
     // XXX: currently only used for debugging
     std::string headers_;
+    // normalized Content-* headers, part of the encryption cache key
+    std::string content_headers_;
+    // memory held by this message (body and its copies), accounted against memory_budget
+    utils::admission_control::reservation memory_;
+    // re-injection client prepared in on_data(), when re-injection is certain
+    std::unique_ptr<smtp::client> reinjection_;
 
     // holds email details, used to store data per configuration section
     struct email_context {
+        // configuration section; owned by config_
+        const cfg2::BaseEncryptionSection *section = nullptr;
         // bool marks the presence or absence of associated public key
         std::map<std::string, bool> recipients;
         // keeps only the recipients for which public keys were found
         std::set<std::string> good_recipients;
+        // recipients whose public keys are looked up in on_data() (batch_key_lookup)
+        std::vector<std::string> pending_recipients;
         std::shared_ptr<body_handler_base> body_handler;
+        // Content-* headers of the encrypted body taken from the encryption cache, applied over the
+        // headers of the body handler
+        headers_type cached_headers;
 
         // libmilter does not make a copy of the buffer when `smfi_replacebody()` is called.
         // Hence, we need to keep the buffer alive until the end of the message.
@@ -0,0 +1,252 @@
+#include "prefork_supervisor.hpp"
+#include "logger/logger.hpp"
+#include "signal_manager.hpp"
+#include "socket_handoff.hpp"
+#include "utils/string.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utility>
+
+namespace gwmilter {
+
+namespace {
+
+// libmilter accepts "unix:/path", "local:/path" and a bare path for unix sockets
+std::string unix_socket_path(const std::string &milter_socket)
+{
+    const auto colon = milter_socket.find(':');
+    if (colon == std::string::npos)
+        return milter_socket;
+
+    const std::string protocol = milter_socket.substr(0, colon);
+    if (protocol == "unix" || protocol == "local")
+        return milter_socket.substr(colon + 1);
+    return {};
+}
+
+} // namespace
+
+
+prefork_supervisor::prefork_supervisor(cfg2::ConfigManager &config_mgr, std::string milter_socket,
+                                       std::function<void()> worker)
+    : config_mgr_{config_mgr}, socket_path_{unix_socket_path(milter_socket)}, worker_{std::move(worker)}
+{
+    sigemptyset(&set_);
+    sigaddset(&set_, SIGCHLD);
+    sigaddset(&set_, SIGALRM);
+    sigaddset(&set_, SIGHUP);
+    sigaddset(&set_, SIGTERM);
+    sigaddset(&set_, SIGINT);
+    sigaddset(&set_, SIGUSR2);
+
+    if (pthread_sigmask(SIG_BLOCK, &set_, &old_set_) != 0)
+        throw std::runtime_error("prefork_supervisor: Failed to block signals");
+}
+
+
+prefork_supervisor::~prefork_supervisor()
+{
+    // only left when run() failed
+    signal_workers(SIGTERM);
+    if (!socket_link_.empty())
+        ::unlink(socket_link_.c_str());
+    pthread_sigmask(SIG_SETMASK, &old_set_, nullptr);
+}
+
+
+void prefork_supervisor::run(unsigned int workers)
+{
+    // When it exits, smfi_main() removes the unix socket file unless running as root. A second hard link
+    // allows restoring it after a worker is recycled, while the other workers still listen on it.
+    if (!socket_path_.empty()) {
+        socket_link_ = socket_path_ + ".supervisor";
+        ::unlink(socket_link_.c_str());
+        if (::link(socket_path_.c_str(), socket_link_.c_str()) != 0) {
+            spdlog::warn("Unable to link milter socket {} to {}: {}; the socket may disappear when a worker exits",
+                         socket_path_, socket_link_, utils::string::str_err(errno));
+            socket_link_.clear();
+        }
+    }
+
+    for (unsigned int i = 0; i < workers; ++i)
+        spawn();
+    spdlog::info("Supervising {} workers", workers);
+
+    while (!stopping_ || !workers_.empty()) {
+        int sig = 0;
+        if (int rc = sigwait(&set_, &sig); rc != 0)
+            throw std::runtime_error(fmt::format("sigwait() failed: {}", utils::string::str_err(rc)));
+
+        switch (sig) {
+        case SIGCHLD:
+            reap();
+            break;
+        case SIGALRM:
+            for (unsigned int n = std::exchange(pending_, 0); n > 0 && !stopping_; --n) {
+                try {
+                    spawn();
+                } catch (const std::exception &e) {
+                    spdlog::error("Unable to start worker: {}", e.what());
+                    ++pending_;
+                }
+            }
+            if (pending_ > 0)
+                alarm(static_cast<unsigned int>(std::max(backoff_, std::chrono::seconds{1}).count()));
+            break;
+        case SIGHUP:
+            spdlog::info("Received SIGHUP (reload requested); reloading workers");
+            // new workers are forked with the reloaded configuration
+            SignalManager::reload(config_mgr_);
+            signal_workers(SIGHUP);
+            break;
+        case SIGUSR2:
+            spdlog::info("Received SIGUSR2 (upgrade requested)");
+            if (stopping_)
+                break;
+            if (socket_handoff::start_successor()) {
+                // the workers drain their connections while the new instance accepts the new ones
+                spdlog::info("Milter socket handed over; stopping workers");
+                stopping_ = true;
+                pending_ = 0;
+                alarm(0);
+                socket_link_.clear(); // maintained by the new instance from now on
+                signal_workers(SIGUSR2);
+            } else {
+                spdlog::error("Upgrade failed; keeping current workers");
+            }
+            break;
+        case SIGTERM:
+        case SIGINT:
+            if (!stopping_) {
+                spdlog::info("Received {} (shutdown requested); stopping workers",
+                             sig == SIGTERM ? "SIGTERM" : "SIGINT");
+                stopping_ = true;
+                pending_ = 0;
+                alarm(0);
+                signal_workers(SIGTERM);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+
+void prefork_supervisor::spawn()
+{
+    const pid_t pid = fork();
+    if (pid == -1)
+        throw std::runtime_error(fmt::format("fork() failed: {}", utils::string::str_err(errno)));
+
+    if (pid == 0) {
+        // SIGHUP/SIGTERM/SIGINT/SIGUSR2 stay blocked until the worker installs its own signal handling
+        sigset_t set = old_set_;
+        sigaddset(&set, SIGHUP);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGUSR2);
+        pthread_sigmask(SIG_SETMASK, &set, nullptr);
+
+        int status = EXIT_SUCCESS;
+        try {
+            worker_();
+        } catch (const std::exception &e) {
+            spdlog::error("Worker exception caught: {}", e.what());
+            status = EXIT_FAILURE;
+        } catch (...) {
+            spdlog::error("Worker unknown exception caught");
+            status = EXIT_FAILURE;
+        }
+        spdlog::default_logger()->flush();
+        // skip the destructors of the objects copied from the supervisor
+        _exit(status);
+    }
+
+    workers_.emplace(pid, std::chrono::steady_clock::now());
+    spdlog::info("Worker {} started", pid);
+}
+
+
+void prefork_supervisor::reap()
+{
+    int status = 0;
+    pid_t pid = 0;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        auto it = workers_.find(pid);
+        if (it == workers_.end())
+            continue;
+        const auto uptime = std::chrono::steady_clock::now() - it->second;
+        workers_.erase(it);
+        restore_socket();
+
+        if (stopping_) {
+            spdlog::info("Worker {} exited", pid);
+            continue;
+        }
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+            // recycled after worker_max_messages, or stopped on purpose
+            spdlog::info("Worker {} exited, starting a new one", pid);
+            backoff_ = std::chrono::seconds{0};
+        } else {
+            if (WIFSIGNALED(status))
+                spdlog::error("Worker {} killed by signal {}", pid, WTERMSIG(status));
+            else
+                spdlog::error("Worker {} exited with status {}", pid, WEXITSTATUS(status));
+
+            // a worker failing right after start would otherwise be restarted in a tight loop
+            if (uptime < min_uptime)
+                backoff_ = std::clamp(backoff_ * 2, std::chrono::seconds{1}, max_backoff);
+            else
+                backoff_ = std::chrono::seconds{0};
+        }
+
+        restart();
+    }
+}
+
+
+void prefork_supervisor::restart()
+{
+    if (backoff_.count() == 0 && pending_ == 0) {
+        try {
+            spawn();
+            return;
+        } catch (const std::exception &e) {
+            spdlog::error("Unable to start worker: {}", e.what());
+            backoff_ = std::chrono::seconds{1};
+        }
+    }
+
+    spdlog::warn("Restarting worker in {}s", backoff_.count());
+    if (pending_++ == 0)
+        alarm(static_cast<unsigned int>(backoff_.count()));
+}
+
+
+void prefork_supervisor::signal_workers(int sig) const
+{
+    for (const auto &[pid, started]: workers_)
+        if (kill(pid, sig) != 0)
+            spdlog::warn("Unable to signal worker {}: {}", pid, utils::string::str_err(errno));
+}
+
+
+void prefork_supervisor::restore_socket() const
+{
+    if (socket_link_.empty() || stopping_)
+        return;
+
+    if (::link(socket_link_.c_str(), socket_path_.c_str()) == 0)
+        spdlog::debug("Milter socket {} restored after a worker exited", socket_path_);
+    else if (errno != EEXIST)
+        spdlog::error("Unable to restore milter socket {}: {}", socket_path_, utils::string::str_err(errno));
+}
+
+} // namespace gwmilter
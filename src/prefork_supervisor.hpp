@@ -0,0 +1,54 @@
+#pragma once
+
+#include "cfg2/config_manager.hpp"
+#include <chrono>
+#include <csignal>
+#include <functional>
+#include <map>
+#include <string>
+#include <sys/types.h>
+
+namespace gwmilter {
+
+// Forks worker processes that share the milter socket opened by the parent, and supervises them.
+// - SIGCHLD: a worker that exited is replaced; workers dying right after start are restarted with a backoff
+// - SIGHUP: reload configuration via cfg2::ConfigManager, then forward the signal to every worker
+// - SIGTERM/SIGINT: forward SIGTERM to every worker and wait for them to finish
+// - SIGUSR2: hand the milter socket over to a new instance (see socket_handoff), then forward the signal to
+//   every worker, which stops accepting connections and drains the ones in progress
+// Must be used before any thread is started, as the workers are created with fork().
+class prefork_supervisor {
+public:
+    // `worker` runs in each forked process; the process exits with EXIT_SUCCESS when it returns
+    // and with EXIT_FAILURE when it throws.
+    prefork_supervisor(cfg2::ConfigManager &config_mgr, std::string milter_socket, std::function<void()> worker);
+    prefork_supervisor(const prefork_supervisor &) = delete;
+    prefork_supervisor &operator=(const prefork_supervisor &) = delete;
+    ~prefork_supervisor();
+
+    // Starts `workers` processes and supervises them until SIGTERM/SIGINT
+    void run(unsigned int workers);
+
+private:
+    void spawn();
+    void reap();
+    void restart();
+    void signal_workers(int sig) const;
+    void restore_socket() const;
+
+    static constexpr std::chrono::seconds min_uptime{10};
+    static constexpr std::chrono::seconds max_backoff{60};
+
+    cfg2::ConfigManager &config_mgr_;
+    const std::string socket_path_; // empty unless the milter socket is a unix socket
+    std::string socket_link_;
+    std::function<void()> worker_;
+    sigset_t set_{};
+    sigset_t old_set_{};
+    std::map<pid_t, std::chrono::steady_clock::time_point> workers_;
+    unsigned int pending_ = 0; // workers waiting for a delayed restart
+    std::chrono::seconds backoff_{0};
+    bool stopping_ = false;
+};
+
+} // namespace gwmilter
@@ -1,14 +1,17 @@
 #include "signal_manager.hpp"
+#include "handlers/encryption_cache.hpp"
+#include "keys/openssl_cms.hpp"
 #include "logger/logger.hpp"
 #include "logger/spdlog_init.hpp"
 #include "milter/milter_callbacks.hpp"
+#include "socket_handoff.hpp"
 #include <cassert>
 #include <libmilter/mfapi.h>
 
 namespace gwmilter {
 
-SignalManager::SignalManager(cfg2::ConfigManager &config_mgr)
-    : config_mgr_(config_mgr)
+SignalManager::SignalManager(cfg2::ConfigManager &config_mgr, std::function<bool()> upgrade)
+    : config_mgr_(config_mgr), upgrade_(std::move(upgrade))
 {
     // Block signals in the current thread so the dedicated thread can receive them via sigwait()
     sigset_t set;
@@ -16,12 +19,13 @@ SignalManager::SignalManager(cfg2::ConfigManager &config_mgr)
     sigaddset(&set, SIGHUP);
     sigaddset(&set, SIGTERM);
     sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR2);
 
     if (pthread_sigmask(SIG_BLOCK, &set, &old_set_) != 0)
         throw std::runtime_error("SignalManager: Failed to block signals");
 
     signal_thread_ = std::thread([this, set]() { signalLoop(set); });
-    spdlog::info("Signals installed: SIGHUP, SIGINT, SIGTERM");
+    spdlog::info("Signals installed: SIGHUP, SIGINT, SIGTERM, SIGUSR2");
 }
 
 SignalManager::~SignalManager()
@@ -36,6 +40,33 @@ SignalManager::~SignalManager()
     pthread_sigmask(SIG_SETMASK, &old_set_, nullptr);
 }
 
+void SignalManager::reload(cfg2::ConfigManager &config_mgr)
+{
+    if (config_mgr.reload()) {
+        // Reinitialize logging with new configuration
+        auto new_config = config_mgr.getConfig();
+        assert(new_config != nullptr);
+
+        // Update milter callbacks with new config
+        callbacks::set_config(new_config);
+        // sections may have changed under the same name
+        encryption_cache::instance().clear();
+        // certificate directories are read again on first use
+        keys::cms_encryptor::clear();
+
+        try {
+            logging::init_spdlog(new_config->general);
+            spdlog::info("Configuration and logging reloaded successfully. NOTE: changes of milter settings "
+                         "require a restart (SIGUSR2 for a graceful one).");
+        } catch (const std::exception &e) {
+            spdlog::error("Failed to reinitialize logging after config reload: {}", e.what());
+            spdlog::warn("Configuration reloaded but logging settings unchanged");
+        }
+    } else {
+        spdlog::warn("Configuration reload failed; keeping current configuration");
+    }
+}
+
 void SignalManager::signalLoop(sigset_t set)
 {
     int sig = 0;
@@ -51,25 +82,7 @@ void SignalManager::signalLoop(sigset_t set)
         switch (sig) {
         case SIGHUP:
             spdlog::info("Received SIGHUP (reload requested)");
-            if (config_mgr_.reload()) {
-                // Reinitialize logging with new configuration
-                auto new_config = config_mgr_.getConfig();
-                assert(new_config != nullptr);
-
-                // Update milter callbacks with new config
-                callbacks::set_config(new_config);
-
-                try {
-                    logging::init_spdlog(new_config->general);
-                    spdlog::info("Configuration and logging reloaded successfully. NOTE: changes of milter settings "
-                                 "require a full restart.");
-                } catch (const std::exception &e) {
-                    spdlog::error("Failed to reinitialize logging after config reload: {}", e.what());
-                    spdlog::warn("Configuration reloaded but logging settings unchanged");
-                }
-            } else {
-                spdlog::warn("Configuration reload failed; keeping current configuration");
-            }
+            reload(config_mgr_);
             break;
         case SIGTERM:
             spdlog::info("Received SIGTERM (shutdown requested); stopping milter");
@@ -79,6 +92,16 @@ void SignalManager::signalLoop(sigset_t set)
             spdlog::info("Received SIGINT (shutdown requested); stopping milter");
             smfi_stop();
             return; // exit thread
+        case SIGUSR2:
+            spdlog::info("Received SIGUSR2 (upgrade requested)");
+            if (upgrade_ && upgrade_()) {
+                spdlog::info("Milter socket handed over; stopping milter");
+                socket_handoff::release();
+                smfi_stop();
+                return; // exit thread
+            }
+            spdlog::error("Upgrade failed; keeping current process");
+            break;
         default:
             break;
         }
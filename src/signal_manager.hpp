@@ -3,6 +3,7 @@
 #include "cfg2/config_manager.hpp"
 #include <atomic>
 #include <csignal>
+#include <functional>
 #include <thread>
 
 namespace gwmilter {
@@ -10,11 +11,16 @@ namespace gwmilter {
 // Installs a dedicated sigwait() thread to handle POSIX signals.
 // - SIGHUP: reload configuration via cfg2::ConfigManager
 // - SIGTERM/SIGINT: call libmilter's smfi_stop() and exit the thread
+// - SIGUSR2: hand the milter socket over to a new instance (see socket_handoff), then stop like SIGTERM;
+//   `upgrade` returns whether the new instance accepts connections
 class SignalManager {
 public:
-    explicit SignalManager(cfg2::ConfigManager &config_mgr);
+    explicit SignalManager(cfg2::ConfigManager &config_mgr, std::function<bool()> upgrade = {});
     ~SignalManager();
 
+    // Reloads the configuration and reinitializes logging; the current configuration is kept on failure
+    static void reload(cfg2::ConfigManager &config_mgr);
+
 private:
     void signalLoop(sigset_t set);
 
@@ -22,6 +28,7 @@ private:
     std::thread signal_thread_;
     sigset_t old_set_{}; // previous thread signal mask
     cfg2::ConfigManager &config_mgr_;
+    std::function<bool()> upgrade_;
 };
 
 } // namespace gwmilter
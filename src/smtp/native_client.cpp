@@ -0,0 +1,542 @@
+#include "native_client.hpp"
+#include "logger/logger.hpp"
+#include "utils/string.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
+
+namespace gwmilter::smtp {
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+#ifdef MSG_NOSIGNAL
+constexpr int send_flags = MSG_NOSIGNAL;
+#else
+constexpr int send_flags = 0;
+#endif
+
+
+// Makes the socket non-blocking and close-on-exec, without SIGPIPE where MSG_NOSIGNAL is missing (macOS)
+bool configure_socket(int fd)
+{
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+        return false;
+#ifdef SO_NOSIGPIPE
+    const int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one)) == -1)
+        return false;
+#endif
+    return true;
+}
+
+
+struct reply {
+    int code = 0;
+    // text of each line, without the code
+    std::vector<std::string> lines;
+
+    [[nodiscard]] bool positive() const { return code >= 200 && code < 400; }
+    [[nodiscard]] std::string text() const
+    {
+        return std::to_string(code) + " " + (lines.empty() ? std::string{} : lines.back());
+    }
+};
+
+
+// Non-blocking connection, sending queued data while reading replies
+class connection {
+public:
+    // cancel_fd, when not -1, aborts all waits once readable
+    connection(const std::string &host, const std::string &port, std::optional<clock_type::time_point> deadline,
+               int cancel_fd = -1)
+        : deadline_{deadline}, cancel_fd_{cancel_fd}
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *addresses = nullptr;
+        if (const int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses); rc != 0)
+            throw std::runtime_error(fmt::format("Unable to resolve {}: {}", host, gai_strerror(rc)));
+        const std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> guard{addresses, freeaddrinfo};
+
+        std::string error = "no address";
+        for (const addrinfo *ai = addresses; ai != nullptr; ai = ai->ai_next) {
+            fd_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd_ == -1) {
+                error = utils::string::str_err(errno);
+                continue;
+            }
+            if (!configure_socket(fd_)) {
+                error = utils::string::str_err(errno);
+                ::close(fd_);
+                fd_ = -1;
+                continue;
+            }
+            try {
+                if (::connect(fd_, ai->ai_addr, ai->ai_addrlen) == 0 || (errno == EINPROGRESS && connected()))
+                    break;
+            } catch (...) {
+                // timed out or cancelled; the destructor does not run
+                ::close(fd_);
+                throw;
+            }
+            error = utils::string::str_err(errno);
+            ::close(fd_);
+            fd_ = -1;
+        }
+        if (fd_ == -1)
+            throw std::runtime_error(fmt::format("Unable to connect to {}:{}: {}", host, port, error));
+
+        // commands are written in batches already
+        const int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    ~connection()
+    {
+        if (fd_ != -1)
+            ::close(fd_);
+    }
+
+    connection(const connection &) = delete;
+    connection &operator=(const connection &) = delete;
+
+    // The data is sent by the next call of replies(); views must stay valid until then
+    void queue(std::string_view data)
+    {
+        if (!data.empty())
+            out_.push_back(data);
+    }
+
+    void queue(std::string data) { queue(std::string_view{owned_.emplace_back(std::move(data))}); }
+
+    // Sends the queued data while reading `count` replies
+    std::vector<reply> replies(std::size_t count)
+    {
+        std::vector<reply> result;
+        if (count == 0)
+            return result;
+        ++round_trips_;
+
+        for (;;) {
+            reply r;
+            while (result.size() < count && parse(r)) {
+                result.push_back(std::move(r));
+                r = {};
+            }
+            if (result.size() == count)
+                break;
+
+            pollfd pfd{fd_, static_cast<short>(POLLIN | (out_.empty() ? 0 : POLLOUT)), 0};
+            wait(pfd);
+            if ((pfd.revents & POLLOUT) != 0)
+                send();
+            if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+                receive();
+        }
+
+        if (out_.empty())
+            owned_.clear();
+        return result;
+    }
+
+    [[nodiscard]] std::size_t round_trips() const { return round_trips_; }
+
+    void set_deadline(std::optional<clock_type::time_point> deadline) { deadline_ = deadline; }
+
+    // False if the server has sent something, or closed the connection, without being asked: a 421 reply
+    // after an idle timeout, typically
+    [[nodiscard]] bool idle() const
+    {
+        pollfd pfd{fd_, POLLIN, 0};
+        return poll(&pfd, 1, 0) == 0 && in_.empty() && out_.empty();
+    }
+
+private:
+    // Completes a non-blocking connect
+    bool connected()
+    {
+        pollfd pfd{fd_, POLLOUT, 0};
+        wait(pfd);
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+            return false;
+        errno = error;
+        return error == 0;
+    }
+
+    void wait(pollfd &pfd) const
+    {
+        int timeout = -1;
+        if (deadline_) {
+            const auto left = std::chrono::ceil<std::chrono::milliseconds>(*deadline_ - clock_type::now());
+            if (left.count() <= 0)
+                throw std::runtime_error("SMTP session timed out");
+            timeout = static_cast<int>(std::min<long long>(left.count(), INT_MAX));
+        }
+
+        pollfd fds[2] = {pfd, {cancel_fd_, POLLIN, 0}};
+        const nfds_t count = cancel_fd_ == -1 ? 1 : 2;
+        int rc = 0;
+        while ((rc = poll(fds, count, timeout)) == -1 && errno == EINTR) { }
+        if (rc == -1)
+            throw std::runtime_error("poll() failed: " + utils::string::str_err(errno));
+        if (rc == 0)
+            throw std::runtime_error("SMTP session timed out");
+        if (fds[1].revents != 0)
+            throw std::runtime_error("SMTP session cancelled");
+        pfd.revents = fds[0].revents;
+    }
+
+    void send()
+    {
+        std::vector<iovec> iov;
+        for (const auto &data: out_) {
+            if (iov.size() == IOV_MAX)
+                break;
+            iov.push_back({const_cast<char *>(data.data()), data.size()});
+        }
+
+        msghdr msg{};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = iov.size();
+        ssize_t sent = sendmsg(fd_, &msg, send_flags);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            throw std::runtime_error("send() failed: " + utils::string::str_err(errno));
+        }
+
+        while (sent > 0) {
+            auto &front = out_.front();
+            const auto n = std::min(static_cast<std::size_t>(sent), front.size());
+            front.remove_prefix(n);
+            sent -= static_cast<ssize_t>(n);
+            if (front.empty())
+                out_.pop_front();
+        }
+    }
+
+    void receive()
+    {
+        char buf[4096];
+        const ssize_t n = recv(fd_, buf, sizeof(buf), 0);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            throw std::runtime_error("recv() failed: " + utils::string::str_err(errno));
+        }
+        if (n == 0)
+            throw std::runtime_error("Connection closed by the SMTP server");
+        in_.append(buf, static_cast<std::size_t>(n));
+    }
+
+    // Takes a complete reply, possibly multi-line, from the received data
+    bool parse(reply &r)
+    {
+        std::size_t pos = 0;
+        for (;;) {
+            const auto end = in_.find('\n', pos);
+            if (end == std::string::npos)
+                return false;
+
+            std::string_view line{in_.data() + pos, end - pos};
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            const auto digit = [](char c) { return c >= '0' && c <= '9'; };
+            if (line.size() < 3 || !std::all_of(line.begin(), line.begin() + 3, digit))
+                throw std::runtime_error(fmt::format("Malformed SMTP reply: {}", line));
+
+            r.code = std::stoi(std::string{line.substr(0, 3)});
+            r.lines.emplace_back(line.size() > 4 ? line.substr(4) : std::string_view{});
+            pos = end + 1;
+            if (line.size() == 3 || line[3] != '-') {
+                in_.erase(0, pos);
+                return true;
+            }
+        }
+    }
+
+    int fd_ = -1;
+    std::optional<clock_type::time_point> deadline_;
+    int cancel_fd_;
+    std::deque<std::string> owned_;
+    std::deque<std::string_view> out_;
+    std::string in_;
+    std::size_t round_trips_ = 0;
+};
+
+
+// Encloses the address in angle brackets, unless it is already
+std::string path(const std::string &address)
+{
+    if (!address.empty() && address.front() == '<')
+        return address;
+    return "<" + address + ">";
+}
+
+
+// DATA content: lines starting with a dot get another one, and the end of data line is appended
+std::string dot_stuff(std::string_view headers, std::string_view body)
+{
+    std::string out;
+    out.reserve(headers.size() + body.size() + body.size() / 64 + 8);
+    bool line_start = true;
+    for (const std::string_view part: {headers, body}) {
+        for (const char c: part) {
+            if (line_start && c == '.')
+                out += '.';
+            out += c;
+            line_start = c == '\n';
+        }
+    }
+    if (!line_start)
+        out += "\r\n";
+    out += ".\r\n";
+    return out;
+}
+
+
+std::string local_host_name()
+{
+    char name[256] = {};
+    if (gethostname(name, sizeof(name) - 1) != 0 || name[0] == '\0')
+        return "localhost";
+    return name;
+}
+
+} // namespace
+
+
+struct native_client::session {
+    connection conn;
+    bool pipelining = false;
+    bool chunking = false;
+    bool binarymime = false;
+
+    session(const server_url &url, std::optional<clock_type::time_point> deadline, int cancel_fd)
+        : conn{url.host, url.port, deadline, cancel_fd}
+    { }
+};
+
+
+native_client::native_client(server_url url, time_t timeout)
+    : url_{std::move(url)}, timeout_{timeout}
+{ }
+
+
+native_client::~native_client()
+{
+    if (prepared_.valid()) {
+        // the connection was prepared for nothing; stops it if still being set up
+        (void) !write(cancel_[1], "x", 1);
+        prepared_.wait();
+    }
+    for (const int fd: cancel_)
+        if (fd != -1)
+            close(fd);
+}
+
+
+void native_client::prepare()
+{
+    if (prepared_.valid())
+        return;
+    // pipe2() is Linux-only
+    if (pipe(cancel_) != 0)
+        throw std::runtime_error("pipe() failed: " + utils::string::str_err(errno));
+    for (const int fd: cancel_)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    prepared_ = std::async(std::launch::async, [this] { return open(deadline(), cancel_[0]); });
+}
+
+
+void native_client::add(const work_item &wi)
+{
+    items_.push_back(wi);
+}
+
+
+std::optional<std::chrono::steady_clock::time_point> native_client::deadline() const
+{
+    if (timeout_ == -1)
+        return std::nullopt;
+    return clock_type::now() + std::chrono::seconds{timeout_};
+}
+
+
+std::unique_ptr<native_client::session> native_client::open(std::optional<clock_type::time_point> deadline,
+                                                             int cancel_fd) const
+{
+    auto s = std::make_unique<session>(url_, deadline, cancel_fd);
+    connection &conn = s->conn;
+
+    if (const auto greeting = conn.replies(1).front(); greeting.code != 220)
+        throw std::runtime_error("unexpected greeting: " + greeting.text());
+
+    conn.queue("EHLO " + (url_.domain.empty() ? local_host_name() : url_.domain) + "\r\n");
+    const auto ehlo = conn.replies(1).front();
+    if (ehlo.code != 250)
+        throw std::runtime_error("EHLO rejected: " + ehlo.text());
+
+    // the first line is the greeting
+    for (std::size_t i = 1; i < ehlo.lines.size(); ++i) {
+        const std::string keyword = utils::string::to_lower(ehlo.lines[i].substr(0, ehlo.lines[i].find(' ')));
+        s->pipelining = s->pipelining || (keyword == "pipelining" && url_.pipelining);
+        s->chunking = s->chunking || (keyword == "chunking" && url_.chunking);
+        s->binarymime = s->binarymime || keyword == "binarymime";
+    }
+    return s;
+}
+
+
+std::unique_ptr<native_client::session> native_client::take_prepared()
+{
+    if (!prepared_.valid())
+        return nullptr;
+
+    try {
+        auto s = prepared_.get();
+        if (s->conn.idle())
+            return s;
+        spdlog::debug("SMTP: prepared connection to {} was closed by the server", url_.host);
+    } catch (const std::exception &e) {
+        spdlog::debug("SMTP: preparing the connection to {} failed: {}", url_.host, e.what());
+    }
+    return nullptr;
+}
+
+
+int native_client::perform()
+{
+    // replies to read, in the order of the commands: the item whose transaction they belong to,
+    // or none for the commands whose replies do not matter (RSET)
+    enum class kind { envelope, data, other };
+    std::deque<std::pair<kind, std::size_t>> pending;
+
+    std::size_t done = 0;
+    int failed_count = 0;
+    round_trips_ = 0;
+    failed_items_.clear();
+    unanswered_items_.clear();
+
+    try {
+        std::unique_ptr<session> s = take_prepared();
+        const bool prepared = s != nullptr;
+        if (prepared)
+            s->conn.set_deadline(deadline());
+        else
+            s = open(deadline(), -1);
+        connection &conn = s->conn;
+        const std::size_t setup_round_trips = prepared ? conn.round_trips() : 0;
+
+        // the replies of the data of a transaction come with the ones of the next envelope
+        std::vector<reply> envelope;
+        const auto collect = [&] {
+            for (auto &r: conn.replies(pending.size())) {
+                const auto [k, item] = pending.front();
+                pending.pop_front();
+                if (k == kind::envelope) {
+                    envelope.push_back(std::move(r));
+                } else if (k == kind::data) {
+                    ++done;
+                    if (!r.positive()) {
+                        spdlog::error("SMTP server {} rejected the data: {}", url_.host, r.text());
+                        ++failed_count;
+                        failed_items_.push_back(item);
+                    }
+                }
+            }
+        };
+
+        const auto command = [&](std::string line, kind k, std::size_t item) {
+            conn.queue(std::move(line));
+            pending.emplace_back(k, item);
+            if (!s->pipelining)
+                collect();
+        };
+
+        for (std::size_t i = 0; i < items_.size(); ++i) {
+            const work_item &wi = items_[i];
+            const bool binary = s->chunking && s->binarymime && wi.has_binary_message();
+
+            envelope.clear();
+            command("MAIL FROM:" + path(wi.sender()) + (binary ? " BODY=BINARYMIME" : "") + "\r\n", kind::envelope,
+                    i);
+            for (const auto &rcpt: wi.recipients())
+                command("RCPT TO:" + path(rcpt) + "\r\n", kind::envelope, i);
+            collect();
+
+            // like libcurl, a rejected recipient fails the whole transaction
+            auto rejected = std::find_if(envelope.begin(), envelope.end(), [](const reply &r) {
+                return !r.positive();
+            });
+            if (rejected == envelope.end() && !s->chunking) {
+                command("DATA\r\n", kind::envelope, i);
+                collect();
+                rejected = envelope.back().code == 354 ? envelope.end() : envelope.end() - 1;
+            }
+            if (rejected != envelope.end()) {
+                spdlog::error("SMTP server {} rejected the envelope: {}", url_.host, rejected->text());
+                ++failed_count;
+                failed_items_.push_back(i);
+                ++done;
+                command("RSET\r\n", kind::other, i);
+                continue;
+            }
+
+            if (s->chunking) {
+                const std::string &headers = wi.headers(binary);
+                const std::string &body = wi.body(binary);
+                conn.queue(fmt::format("BDAT {} LAST\r\n", headers.size() + body.size()));
+                conn.queue(std::string_view{headers});
+                conn.queue(std::string_view{body});
+            } else {
+                conn.queue(dot_stuff(wi.headers(), wi.body()));
+            }
+            pending.emplace_back(kind::data, i);
+            if (!s->pipelining)
+                collect();
+        }
+
+        conn.queue(std::string{"QUIT\r\n"});
+        pending.emplace_back(kind::other, items_.size());
+        collect();
+        round_trips_ = conn.round_trips() - setup_round_trips;
+        spdlog::debug("SMTP: {} emails sent to {} in {} round trips (prepared={}, pipelining={}, chunking={})",
+                      items_.size(), url_.host, round_trips_, prepared, s->pipelining, s->chunking);
+    } catch (const std::exception &e) {
+        // the emails without a reply are considered failed
+        if (done < items_.size()) {
+            spdlog::error("SMTP session with {} failed: {}", url_.host, e.what());
+            failed_count += static_cast<int>(items_.size() - done);
+            for (std::size_t i = done; i < items_.size(); ++i) {
+                failed_items_.push_back(i);
+                unanswered_items_.push_back(i);
+            }
+        }
+    }
+
+    return failed_count;
+}
+
+} // namespace gwmilter::smtp
@@ -0,0 +1,54 @@
+#pragma once
+#include "smtp_client.hpp"
+#include <chrono>
+#include <ctime>
+#include <future>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace gwmilter::smtp {
+
+// SMTP client sending all work items over a single connection, one transaction after the other.
+// With PIPELINING, the envelope of a transaction is sent in one go, together with the data of the previous
+// transaction. With CHUNKING, the data is sent with BDAT, without dot-stuffing and without waiting for the
+// server to accept it, and binary messages are sent when the server accepts BINARYMIME.
+// Selected with client=native in the smtp_server URL; smtps is not supported.
+class native_client final : public client {
+public:
+    // timeout in seconds for the preparation and, separately, for perform(); -1 for none
+    native_client(server_url url, time_t timeout);
+    // Waits for the preparation, cancelling it if still in progress
+    ~native_client() override;
+    native_client(const native_client &) = delete;
+    native_client &operator=(const native_client &) = delete;
+
+    // Connects and greets the server (EHLO) in a background thread. perform() uses that connection unless
+    // the preparation failed or the server closed it meanwhile, in which case it connects again.
+    void prepare() override;
+    void add(const work_item &wi) override;
+    int perform() override;
+
+    // Round trips of the last perform(), without the ones of the preparation; for logging and tests
+    [[nodiscard]] std::size_t round_trips() const { return round_trips_; }
+
+private:
+    struct session;
+
+    [[nodiscard]] std::optional<std::chrono::steady_clock::time_point> deadline() const;
+    // Connects and greets the server; throws std::runtime_error
+    std::unique_ptr<session> open(std::optional<std::chrono::steady_clock::time_point> deadline,
+                                  int cancel_fd) const;
+    // Session opened by prepare(), if usable
+    std::unique_ptr<session> take_prepared();
+
+    server_url url_;
+    time_t timeout_;
+    std::vector<work_item> items_;
+    std::size_t round_trips_ = 0;
+    std::future<std::unique_ptr<session>> prepared_;
+    // written by the destructor to cancel the preparation
+    int cancel_[2] = {-1, -1};
+};
+
+} // namespace gwmilter::smtp
@@ -0,0 +1,275 @@
+#include "relay_pool.hpp"
+#include "logger/logger.hpp"
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+
+namespace gwmilter::smtp {
+
+namespace {
+
+// the statistics are logged every so many sessions
+constexpr std::uint64_t stats_interval = 1000;
+// weight of the last session in the moving averages
+constexpr double smoothing = 0.2;
+// lowest health used for balancing, so that a failing relay still gets a share once its circuit closes
+constexpr double min_health = 0.05;
+
+} // namespace
+
+
+relay_pool::relay_pool(const std::string &servers, settings s)
+    : servers_{servers}, settings_{s}
+{
+    std::string::size_type start = 0;
+    while (start <= servers.size()) {
+        const auto end = std::min(servers.find(',', start), servers.size());
+        const auto first = servers.find_first_not_of(" \t", start);
+        if (first < end) {
+            const auto last = servers.find_last_not_of(" \t", end - 1);
+            relay_state r;
+            r.url = servers.substr(first, last - first + 1);
+            r.stats.url = r.url;
+            r.stats.weight = server_url::parse(r.url).weight;
+            relays_.push_back(std::move(r));
+        }
+        start = end + 1;
+    }
+
+    if (relays_.empty())
+        throw std::invalid_argument("No SMTP relay in: " + servers);
+}
+
+
+std::shared_ptr<relay_pool> relay_pool::get(const std::string &servers, settings s)
+{
+    static std::mutex mutex;
+    static std::shared_ptr<relay_pool> current;
+
+    const std::lock_guard lock(mutex);
+    if (!current || current->servers_ != servers) {
+        // the previous pool lives on with the messages using it
+        current = std::make_shared<relay_pool>(servers, s);
+    } else {
+        const std::lock_guard pool_lock(current->mutex_);
+        current->settings_ = s;
+    }
+    return current;
+}
+
+
+std::vector<std::size_t> relay_pool::order() const
+{
+    const std::lock_guard lock(mutex_);
+    const auto now = clock_type::now();
+
+    std::vector<std::size_t> result;
+    for (std::size_t i = 0; i < relays_.size(); ++i)
+        if (available(relays_[i], now))
+            result.push_back(i);
+
+    if (result.empty()) {
+        // better late than never: the relays whose retry comes first
+        result.resize(relays_.size());
+        std::iota(result.begin(), result.end(), 0);
+        std::stable_sort(result.begin(), result.end(), [this](std::size_t a, std::size_t b) {
+            return relays_[a].retry_at < relays_[b].retry_at;
+        });
+        return result;
+    }
+
+    // sessions in progress relative to the capacity of the relay, then sessions started, so that equally
+    // loaded relays take turns in proportion to their capacity
+    const auto key = [this](std::size_t i) {
+        const statistics &st = relays_[i].stats;
+        const double capacity = st.weight * std::max(st.health, min_health);
+        return std::pair{static_cast<double>(st.outstanding) / capacity,
+                         static_cast<double>(relays_[i].started) / capacity};
+    };
+    std::stable_sort(result.begin(), result.end(), [&](std::size_t a, std::size_t b) { return key(a) < key(b); });
+    return result;
+}
+
+
+void relay_pool::begin(std::size_t relay)
+{
+    const std::lock_guard lock(mutex_);
+    ++relays_[relay].stats.outstanding;
+    ++relays_[relay].started;
+}
+
+
+void relay_pool::end(std::size_t relay, std::size_t emails, std::size_t failed, bool server_failed,
+                     clock_type::duration elapsed)
+{
+    const std::lock_guard lock(mutex_);
+    relay_state &r = relays_[relay];
+    statistics &st = r.stats;
+
+    --st.outstanding;
+    const double latency_ms = std::chrono::duration<double, std::milli>(elapsed).count();
+    st.latency_ms = st.sessions == 0 ? latency_ms : st.latency_ms + smoothing * (latency_ms - st.latency_ms);
+    ++st.sessions;
+    st.emails += emails;
+    st.failed_emails += failed;
+    // refused emails do not tell anything about the relay
+    st.health += smoothing * ((server_failed ? 0.0 : 1.0) - st.health);
+
+    if (server_failed) {
+        ++st.failed_sessions;
+        if (++r.consecutive_failures >= settings_.max_failures && settings_.max_failures > 0) {
+            r.retry_at = clock_type::now() + settings_.retry_interval;
+            spdlog::warn("SMTP relay {}: {} consecutive failed sessions, not used for the next {} seconds", r.url,
+                         r.consecutive_failures, settings_.retry_interval.count());
+        }
+    } else {
+        if (settings_.max_failures > 0 && r.consecutive_failures >= settings_.max_failures)
+            spdlog::info("SMTP relay {} is used again", r.url);
+        r.consecutive_failures = 0;
+    }
+
+    if (++sessions_ % stats_interval == 0)
+        log_stats();
+}
+
+
+void relay_pool::cancel(std::size_t relay)
+{
+    const std::lock_guard lock(mutex_);
+    --relays_[relay].stats.outstanding;
+}
+
+
+std::vector<relay_pool::statistics> relay_pool::stats() const
+{
+    const std::lock_guard lock(mutex_);
+    const auto now = clock_type::now();
+
+    std::vector<statistics> result;
+    for (const auto &r: relays_) {
+        result.push_back(r.stats);
+        result.back().circuit_open = !available(r, now);
+    }
+    return result;
+}
+
+
+bool relay_pool::available(const relay_state &r, clock_type::time_point now) const
+{
+    return settings_.max_failures <= 0 || r.consecutive_failures < settings_.max_failures || r.retry_at <= now;
+}
+
+
+void relay_pool::log_stats() const
+{
+    for (const auto &r: relays_)
+        spdlog::info("SMTP relay {}: {} sessions ({} failed), {} emails ({} failed), {:.1f} ms average, "
+                     "health {:.2f}, {} in progress",
+                     r.url, r.stats.sessions, r.stats.failed_sessions, r.stats.emails, r.stats.failed_emails,
+                     r.stats.latency_ms, r.stats.health, r.stats.outstanding);
+}
+
+
+relay_client::relay_client(std::shared_ptr<relay_pool> pool, time_t timeout)
+    : pool_{std::move(pool)}, timeout_{timeout}
+{ }
+
+
+relay_client::~relay_client()
+{
+    if (prepared_)
+        pool_->cancel(prepared_relay_);
+}
+
+
+void relay_client::prepare()
+{
+    if (prepared_)
+        return;
+
+    const std::size_t relay = pool_->order().front();
+    auto c = make_client(pool_->url(relay), timeout_);
+    c->prepare();
+    pool_->begin(relay);
+    prepared_relay_ = relay;
+    prepared_ = std::move(c);
+}
+
+
+void relay_client::add(const work_item &wi)
+{
+    items_.push_back(wi);
+}
+
+
+int relay_client::perform()
+{
+    failed_items_.clear();
+    unanswered_items_.clear();
+
+    std::vector<std::size_t> order = pool_->order();
+    if (prepared_) {
+        // used whatever happened to the relay since
+        order.erase(std::remove(order.begin(), order.end(), prepared_relay_), order.end());
+        order.insert(order.begin(), prepared_relay_);
+    }
+
+    // positions in items_ of the emails left to send, and of the ones refused by a relay
+    std::vector<std::size_t> pending(items_.size());
+    std::iota(pending.begin(), pending.end(), 0);
+    std::vector<std::size_t> refused;
+
+    for (const std::size_t relay: order) {
+        if (pending.empty())
+            break;
+
+        std::unique_ptr<client> c;
+        if (prepared_ && relay == prepared_relay_) {
+            c = std::move(prepared_);
+        } else {
+            c = make_client(pool_->url(relay), timeout_);
+            pool_->begin(relay);
+        }
+
+        const auto start = relay_pool::clock_type::now();
+        std::vector<std::size_t> failed(pending.size());
+        std::iota(failed.begin(), failed.end(), 0);
+        std::vector<std::size_t> unanswered = failed;
+        try {
+            for (const std::size_t i: pending)
+                c->add(items_[i]);
+            c->perform();
+            failed = c->failed_items();
+            unanswered = c->unanswered_items();
+        } catch (const std::exception &e) {
+            spdlog::error("SMTP relay {} failed: {}", pool_->url(relay), e.what());
+        }
+        // releases the libcurl handles of the work items, before another client takes them
+        c.reset();
+        pool_->end(relay, pending.size(), failed.size(), !unanswered.empty(), relay_pool::clock_type::now() - start);
+
+        // emails refused by the relay stay failed: the refusal is an answer, not a failure of the relay
+        for (const std::size_t f: failed)
+            if (!std::binary_search(unanswered.begin(), unanswered.end(), f))
+                refused.push_back(pending[f]);
+        std::vector<std::size_t> still_pending;
+        for (const std::size_t u: unanswered)
+            still_pending.push_back(pending[u]);
+        pending = std::move(still_pending);
+
+        if (pending.empty())
+            break;
+        if (relay != order.back())
+            spdlog::warn("SMTP relay {} failed with {} emails not sent, trying the next one", pool_->url(relay),
+                         pending.size());
+    }
+
+    unanswered_items_ = std::move(pending);
+    failed_items_ = refused;
+    failed_items_.insert(failed_items_.end(), unanswered_items_.begin(), unanswered_items_.end());
+    std::sort(failed_items_.begin(), failed_items_.end());
+    return static_cast<int>(failed_items_.size());
+}
+
+} // namespace gwmilter::smtp
@@ -0,0 +1,112 @@
+#pragma once
+#include "smtp_client.hpp"
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace gwmilter::smtp {
+
+// Re-injection relays of the smtp_server setting (comma-separated URLs), shared by all messages.
+// Sessions go to the relay with the fewest sessions in progress relative to its weight and health; the health
+// of a relay follows the outcome of its recent sessions. After max_failures consecutive failed sessions, the
+// circuit of the relay opens: it is left out for retry_interval, then tried again, and a success closes the
+// circuit. When all circuits are open, all the relays are tried anyway.
+class relay_pool {
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    struct settings {
+        // consecutive failed sessions opening the circuit of a relay; 0 never opens it
+        int max_failures = 3;
+        std::chrono::seconds retry_interval{30};
+    };
+
+    struct statistics {
+        std::string url;
+        unsigned int weight = 1;
+        std::size_t outstanding = 0;
+        std::uint64_t sessions = 0;
+        std::uint64_t failed_sessions = 0;
+        std::uint64_t emails = 0;
+        std::uint64_t failed_emails = 0;
+        // moving average of the session duration, in milliseconds
+        double latency_ms = 0;
+        // moving average of the successful sessions, from 0 to 1
+        double health = 1;
+        bool circuit_open = false;
+    };
+
+    // Throws std::invalid_argument like server_url::parse(), or when no relay is given
+    relay_pool(const std::string &servers, settings s);
+
+    // Pool of the servers, shared until the smtp_server setting changes; the settings apply to it from then on
+    static std::shared_ptr<relay_pool> get(const std::string &servers, settings s);
+
+    [[nodiscard]] std::size_t size() const { return relays_.size(); }
+    // URL of the relay, as configured
+    [[nodiscard]] const std::string &url(std::size_t relay) const { return relays_[relay].url; }
+
+    // Relays in the order they should be tried
+    [[nodiscard]] std::vector<std::size_t> order() const;
+    // A session starts on the relay
+    void begin(std::size_t relay);
+    // The session ended: `failed` emails out of `emails` were not sent; server_failed as in client::server_failed()
+    void end(std::size_t relay, std::size_t emails, std::size_t failed, bool server_failed,
+             clock_type::duration elapsed);
+    // The session started with begin() was dropped without sending anything
+    void cancel(std::size_t relay);
+
+    [[nodiscard]] std::vector<statistics> stats() const;
+
+private:
+    struct relay_state {
+        std::string url;
+        statistics stats;
+        // sessions started, for the weighted round-robin between equally loaded relays
+        std::uint64_t started = 0;
+        int consecutive_failures = 0;
+        clock_type::time_point retry_at;
+    };
+
+    // called with the mutex locked
+    [[nodiscard]] bool available(const relay_state &r, clock_type::time_point now) const;
+    void log_stats() const;
+
+    const std::string servers_;
+    mutable std::mutex mutex_;
+    settings settings_;
+    std::vector<relay_state> relays_;
+    std::uint64_t sessions_ = 0;
+};
+
+
+// Client sending the work items through the relays of a pool: to the first relay of relay_pool::order(). The
+// emails without a reply from the relay (client::unanswered_items(): connection failure, timeout, connection lost)
+// go to the next relays, until all are sent or all relays were tried. Emails refused by a relay stay failed.
+class relay_client final : public client {
+public:
+    // timeout in seconds for each session, -1 for none
+    relay_client(std::shared_ptr<relay_pool> pool, time_t timeout);
+    ~relay_client() override;
+    relay_client(const relay_client &) = delete;
+    relay_client &operator=(const relay_client &) = delete;
+
+    // Prepares the client of the first relay
+    void prepare() override;
+    void add(const work_item &wi) override;
+    int perform() override;
+
+private:
+    std::shared_ptr<relay_pool> pool_;
+    time_t timeout_;
+    std::vector<work_item> items_;
+    // relay and client set up by prepare(), counted as a session in progress
+    std::size_t prepared_relay_ = 0;
+    std::unique_ptr<client> prepared_;
+};
+
+} // namespace gwmilter::smtp
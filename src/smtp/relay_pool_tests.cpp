@@ -0,0 +1,207 @@
+#include "relay_pool.hpp"
+#include "test_smtp_sink.hpp"
+#include <arpa/inet.h>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <memory>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace gwmilter::smtp;
+
+class RelayPoolTest : public ::testing::Test {
+protected:
+    static work_item make_item(const std::string &recipient)
+    {
+        work_item wi;
+        wi.set_sender("<sender@example.com>");
+        wi.set_recipients({recipient});
+        wi.set_message({{"Subject", "test", 1, false}}, std::make_shared<std::string>("body\r\n"));
+        return wi;
+    }
+
+    // Sends one email per recipient in a single session; returns the number of failed ones
+    static int send(const std::shared_ptr<relay_pool> &pool, const std::vector<std::string> &recipients)
+    {
+        relay_client client(pool, 10);
+        for (const auto &rcpt: recipients)
+            client.add(make_item(rcpt));
+        return client.perform();
+    }
+
+    void SetUp() override
+    {
+        // a bound socket that does not listen refuses the connections, and keeps the port from other processes
+        down_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        ASSERT_NE(down_fd_, -1);
+        ASSERT_EQ(bind(down_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)), 0);
+        ASSERT_EQ(getsockname(down_fd_, reinterpret_cast<sockaddr *>(&addr), &len), 0);
+        down_port_ = ntohs(addr.sin_port);
+    }
+
+    void TearDown() override
+    {
+        if (down_fd_ != -1)
+            close(down_fd_);
+    }
+
+    // URL of a relay where nothing listens
+    [[nodiscard]] std::string down_url(const std::string &query = "client=native") const
+    {
+        return "smtp://127.0.0.1:" + std::to_string(down_port_) + "/gwmilter.test" + (query.empty() ? "" : "?" + query);
+    }
+
+private:
+    int down_fd_ = -1;
+    std::uint16_t down_port_ = 0;
+};
+
+TEST_F(RelayPoolTest, ParsesCommaSeparatedRelays)
+{
+    const relay_pool pool(" smtp://a.example.com?weight=3 ,smtp://b.example.com,", {});
+    ASSERT_EQ(pool.size(), 2U);
+    EXPECT_EQ(pool.url(0), "smtp://a.example.com?weight=3");
+    EXPECT_EQ(pool.url(1), "smtp://b.example.com");
+    EXPECT_EQ(pool.stats()[0].weight, 3U);
+    EXPECT_EQ(pool.stats()[1].weight, 1U);
+
+    EXPECT_THROW(relay_pool(" , ", {}), std::invalid_argument);
+    EXPECT_THROW(relay_pool("smtp://a.example.com?weight=0", {}), std::invalid_argument);
+}
+
+TEST_F(RelayPoolTest, SharesSessionsByWeight)
+{
+    test_smtp_sink heavy, light;
+    const auto pool = std::make_shared<relay_pool>(heavy.url("client=native&weight=3") + "," + light.url(),
+                                                   relay_pool::settings{});
+    for (int i = 0; i < 8; ++i)
+        ASSERT_EQ(send(pool, {"a@example.com"}), 0);
+
+    EXPECT_EQ(heavy.messages().size(), 6U);
+    EXPECT_EQ(light.messages().size(), 2U);
+}
+
+TEST_F(RelayPoolTest, PrefersTheRelayWithFewerSessionsInProgress)
+{
+    test_smtp_sink first, second;
+    const auto pool = std::make_shared<relay_pool>(first.url() + "," + second.url(), relay_pool::settings{});
+
+    relay_client busy(pool, 10);
+    busy.prepare();
+    EXPECT_EQ(pool->stats()[0].outstanding, 1U);
+    EXPECT_EQ(pool->order().front(), 1U);
+
+    ASSERT_EQ(send(pool, {"a@example.com"}), 0);
+    EXPECT_EQ(second.messages().size(), 1U);
+
+    busy.add(make_item("b@example.com"));
+    ASSERT_EQ(busy.perform(), 0);
+    EXPECT_EQ(first.messages().size(), 1U);
+    EXPECT_EQ(pool->stats()[0].outstanding, 0U);
+}
+
+TEST_F(RelayPoolTest, FailsOverToTheNextRelay)
+{
+    test_smtp_sink sink;
+    const auto pool = std::make_shared<relay_pool>(down_url() + "," + sink.url(), relay_pool::settings{});
+
+    EXPECT_EQ(send(pool, {"a@example.com", "b@example.com"}), 0);
+    EXPECT_EQ(sink.messages().size(), 2U);
+
+    const auto stats = pool->stats();
+    EXPECT_EQ(stats[0].failed_sessions, 1U);
+    EXPECT_EQ(stats[0].failed_emails, 2U);
+    EXPECT_LT(stats[0].health, 1.0);
+    EXPECT_EQ(stats[1].sessions, 1U);
+    EXPECT_EQ(stats[1].emails, 2U);
+    EXPECT_EQ(stats[1].failed_emails, 0U);
+    EXPECT_GT(stats[1].latency_ms, 0.0);
+}
+
+TEST_F(RelayPoolTest, RefusedEmailsAreNotRetriedOnTheNextRelay)
+{
+    test_smtp_sink strict({.rejected_recipients = {"<b@example.com>"}});
+    test_smtp_sink lenient;
+    const auto pool = std::make_shared<relay_pool>(strict.url() + "," + lenient.url(), relay_pool::settings{});
+
+    relay_client client(pool, 10);
+    client.add(make_item("a@example.com"));
+    client.add(make_item("b@example.com"));
+    EXPECT_EQ(client.perform(), 1);
+    EXPECT_EQ(client.failed_items(), std::vector<std::size_t>{1});
+    EXPECT_FALSE(client.server_failed());
+
+    ASSERT_EQ(strict.messages().size(), 1U);
+    EXPECT_EQ(strict.messages()[0].recipients, std::vector<std::string>{"<a@example.com>"});
+    EXPECT_TRUE(lenient.messages().empty());
+
+    // a refusal is not held against the relay
+    EXPECT_EQ(pool->stats()[0].failed_sessions, 0U);
+    EXPECT_EQ(pool->stats()[0].health, 1.0);
+}
+
+TEST_F(RelayPoolTest, OnlyEmailsWithoutReplyAreRetriedOnTheNextRelay)
+{
+    // refuses the first email, accepts the second one and drops the connection before the third one; without
+    // pipelining, the reply to the second one is read before the connection is lost
+    test_smtp_sink failing({.pipelining = false, .rejected_recipients = {"<a@example.com>"}, .drop_after = 1});
+    test_smtp_sink sink;
+    const auto pool = std::make_shared<relay_pool>(failing.url() + "," + sink.url(), relay_pool::settings{});
+
+    relay_client client(pool, 10);
+    client.add(make_item("a@example.com"));
+    client.add(make_item("b@example.com"));
+    client.add(make_item("c@example.com"));
+    EXPECT_EQ(client.perform(), 1);
+    EXPECT_EQ(client.failed_items(), std::vector<std::size_t>{0});
+    EXPECT_TRUE(client.unanswered_items().empty());
+    EXPECT_FALSE(client.server_failed());
+
+    ASSERT_EQ(failing.messages().size(), 1U);
+    EXPECT_EQ(failing.messages()[0].recipients, std::vector<std::string>{"<b@example.com>"});
+    ASSERT_EQ(sink.messages().size(), 1U);
+    EXPECT_EQ(sink.messages()[0].recipients, std::vector<std::string>{"<c@example.com>"});
+    EXPECT_EQ(pool->stats()[0].failed_sessions, 1U);
+}
+
+TEST_F(RelayPoolTest, OpensTheCircuitAfterConsecutiveFailures)
+{
+    test_smtp_sink sink;
+    const auto pool = std::make_shared<relay_pool>(
+        down_url("client=native&weight=1000") + "," + sink.url(),
+        relay_pool::settings{.max_failures = 2, .retry_interval = std::chrono::seconds{3600}});
+
+    for (int i = 0; i < 4; ++i)
+        EXPECT_EQ(send(pool, {"a@example.com"}), 0);
+
+    const auto stats = pool->stats();
+    EXPECT_EQ(stats[0].sessions, 2U);
+    EXPECT_TRUE(stats[0].circuit_open);
+    EXPECT_FALSE(stats[1].circuit_open);
+    EXPECT_EQ(sink.messages().size(), 4U);
+    EXPECT_EQ(pool->order(), std::vector<std::size_t>{1});
+}
+
+TEST_F(RelayPoolTest, TriesRelaysWithOpenCircuitWhenNoOtherIsLeft)
+{
+    const auto pool = std::make_shared<relay_pool>(down_url(), relay_pool::settings{.max_failures = 1});
+
+    EXPECT_EQ(send(pool, {"a@example.com"}), 1);
+    EXPECT_TRUE(pool->stats()[0].circuit_open);
+    EXPECT_EQ(send(pool, {"a@example.com"}), 1);
+    EXPECT_EQ(pool->stats()[0].sessions, 2U);
+}
+
+TEST_F(RelayPoolTest, SharedPoolFollowsTheSetting)
+{
+    const auto first = relay_pool::get("smtp://a.example.com", {});
+    EXPECT_EQ(relay_pool::get("smtp://a.example.com", {}), first);
+    EXPECT_NE(relay_pool::get("smtp://a.example.com,smtp://b.example.com", {}), first);
+}
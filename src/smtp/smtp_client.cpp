@@ -1,18 +1,132 @@
 #include "smtp_client.hpp"
 #include "logger/logger.hpp"
+#include "native_client.hpp"
 #include "utils/string.hpp"
+#include <algorithm>
 #include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <curl/curl.h>
 #include <memory>
 #include <set>
 #include <string>
+#include <string_view>
 
 namespace gwmilter::smtp {
 
 static gwmilter::smtp::sys_initializer curl;
 
 
+namespace {
+
+bool parse_switch(std::string_view name, std::string_view value)
+{
+    const std::string lower = utils::string::to_lower(value);
+    if (lower == "on" || lower == "yes" || lower == "true" || lower == "1")
+        return true;
+    if (lower == "off" || lower == "no" || lower == "false" || lower == "0")
+        return false;
+    throw std::invalid_argument(fmt::format("Invalid value of smtp_server option {}: {} (expected: on, off)", name,
+                                            value));
+}
+
+} // namespace
+
+
+server_url server_url::parse(const std::string &url)
+{
+    server_url result;
+
+    const auto scheme_end = url.find("://");
+    if (scheme_end == std::string::npos)
+        throw std::invalid_argument("Invalid SMTP URL: " + url);
+    result.scheme = utils::string::to_lower(url.substr(0, scheme_end));
+    if (result.scheme != "smtp" && result.scheme != "smtps")
+        throw std::invalid_argument("Invalid SMTP URL scheme: " + url);
+
+    std::string_view rest{url};
+    rest.remove_prefix(scheme_end + 3);
+    const auto query_start = rest.find('?');
+    std::string_view query = query_start == std::string_view::npos ? "" : rest.substr(query_start + 1);
+    rest = rest.substr(0, query_start);
+    result.curl_url = url.substr(0, scheme_end + 3 + rest.size());
+
+    const auto path_start = rest.find('/');
+    std::string_view authority = rest.substr(0, path_start);
+    if (path_start != std::string_view::npos)
+        result.domain = rest.substr(path_start + 1);
+    // user:password@ is only understood by libcurl
+    bool userinfo = false;
+    if (const auto at = authority.rfind('@'); at != std::string_view::npos) {
+        authority.remove_prefix(at + 1);
+        userinfo = true;
+    }
+
+    std::string_view port;
+    if (!authority.empty() && authority.front() == '[') {
+        const auto end = authority.find(']');
+        if (end == std::string_view::npos)
+            throw std::invalid_argument("Invalid SMTP URL: " + url);
+        result.host = authority.substr(1, end - 1);
+        if (end + 1 < authority.size() && authority[end + 1] == ':')
+            port = authority.substr(end + 2);
+    } else {
+        const auto colon = authority.rfind(':');
+        result.host = authority.substr(0, colon);
+        if (colon != std::string_view::npos)
+            port = authority.substr(colon + 1);
+    }
+    if (result.host.empty())
+        throw std::invalid_argument("SMTP URL without host: " + url);
+    result.port = port.empty() ? (result.scheme == "smtps" ? "465" : "25") : std::string{port};
+
+    while (!query.empty()) {
+        const auto end = query.find('&');
+        const std::string_view option = query.substr(0, end);
+        query = end == std::string_view::npos ? "" : query.substr(end + 1);
+        if (option.empty())
+            continue;
+
+        const auto eq = option.find('=');
+        const std::string_view name = option.substr(0, eq);
+        const std::string_view value = eq == std::string_view::npos ? "" : option.substr(eq + 1);
+        if (name == "client") {
+            if (value == "curl")
+                result.client = client_type::curl;
+            else if (value == "native")
+                result.client = client_type::native;
+            else
+                throw std::invalid_argument(fmt::format("Invalid value of smtp_server option client: {} "
+                                                        "(expected: curl, native)",
+                                                        value));
+        } else if (name == "pipelining") {
+            result.pipelining = parse_switch(name, value);
+        } else if (name == "chunking") {
+            result.chunking = parse_switch(name, value);
+        } else if (name == "weight") {
+            char *end = nullptr;
+            const std::string number{value};
+            const unsigned long weight = std::strtoul(number.c_str(), &end, 10);
+            if (number.empty() || *end != '\0' || number.front() == '-' || weight == 0 || weight > 1000)
+                throw std::invalid_argument(fmt::format("Invalid value of smtp_server option weight: {} "
+                                                        "(expected: 1 to 1000)",
+                                                        value));
+            result.weight = static_cast<unsigned int>(weight);
+        } else {
+            throw std::invalid_argument(fmt::format("Unknown smtp_server option: {}", name));
+        }
+    }
+
+    if (result.client == client_type::native && result.scheme == "smtps")
+        throw std::invalid_argument("The native SMTP client does not support smtps: " + url);
+    // the native client does not authenticate; the relay would refuse to relay without saying why
+    if (result.client == client_type::native && userinfo)
+        throw std::invalid_argument("The native SMTP client does not support authentication (user@): " + url);
+
+    return result;
+}
+
+
 sys_initializer::sys_initializer()
 {
     curl_global_init(CURL_GLOBAL_DEFAULT);
@@ -25,11 +139,9 @@ sys_initializer::~sys_initializer()
 }
 
 
-work_item::work_item(const std::string &url)
+work_item::work_item()
     : internals_{std::make_shared<internals_type>()}
 {
-    internals_->url = url;
-    curl_easy_setopt(internals_->curl, CURLOPT_URL, internals_->url.c_str());
     curl_easy_setopt(internals_->curl, CURLOPT_NOSIGNAL, 1L);
     // curl_easy_setopt(internals_->curl, CURLOPT_VERBOSE, 1L);
     curl_easy_setopt(internals_->curl, CURLOPT_ERRORBUFFER, internals_->err_buf);
@@ -48,8 +160,10 @@ void work_item::set_sender(const std::string &s) const
 
 void work_item::set_recipients(const std::set<std::string> &rcpts) const
 {
-    for (const auto &rcpt: rcpts)
+    for (const auto &rcpt: rcpts) {
         internals_->rcpt_list = curl_slist_append(internals_->rcpt_list, rcpt.c_str());
+        internals_->recipients.push_back(rcpt);
+    }
 
     curl_easy_setopt(internals_->curl, CURLOPT_MAIL_RCPT, internals_->rcpt_list);
 }
@@ -58,14 +172,36 @@ void work_item::set_recipients(const std::set<std::string> &rcpts) const
 void work_item::set_message(const headers_type &headers, const std::shared_ptr<std::string> &body) const
 {
     internals_->body = body;
+    internals_->headers = format_headers(headers);
+}
 
-    // for simplicity, create a single buffer for headers
-    for (const auto &header: headers) {
-        // only add headers that are not marked as deleted
-        if (!(header.modified && header.value.empty()))
-            internals_->headers += header.name + ": " + header.value + "\r\n";
-    }
-    internals_->headers += "\r\n";
+
+void work_item::set_binary_message(const headers_type &headers, const std::shared_ptr<std::string> &body) const
+{
+    internals_->binary_body = body;
+    internals_->binary_headers = format_headers(headers);
+}
+
+
+const std::string &work_item::headers(bool binary) const
+{
+    return binary ? internals_->binary_headers : internals_->headers;
+}
+
+
+const std::string &work_item::body(bool binary) const
+{
+    static const std::string empty;
+    const auto &body = binary ? internals_->binary_body : internals_->body;
+    return body ? *body : empty;
+}
+
+
+void work_item::set_url(const std::string &url) const
+{
+    internals_->url = url;
+    internals_->pos = 0;
+    curl_easy_setopt(internals_->curl, CURLOPT_URL, internals_->url.c_str());
 }
 
 
@@ -75,6 +211,12 @@ CURL *work_item::get_curl_handle() const
 }
 
 
+std::size_t work_item::size() const
+{
+    return internals_->headers.size() + (internals_->body ? internals_->body->size() : 0);
+}
+
+
 size_t work_item::read_callback(void *ptr, size_t size, size_t nmemb, void *ud)
 {
     auto *wi = reinterpret_cast<internals_type *>(ud);
@@ -105,8 +247,31 @@ size_t work_item::read_callback(void *ptr, size_t size, size_t nmemb, void *ud)
 }
 
 
-client_multi::client_multi(time_t timeout)
-    : curlm_{curl_multi_init()}, timeout_{timeout}, running_handles_{0}
+std::string work_item::format_headers(const headers_type &headers)
+{
+    // for simplicity, create a single buffer for headers
+    std::string formatted;
+    for (const auto &header: headers) {
+        // only add headers that are not marked as deleted
+        if (!(header.modified && header.value.empty()))
+            formatted += header.name + ": " + header.value + "\r\n";
+    }
+    formatted += "\r\n";
+    return formatted;
+}
+
+
+std::unique_ptr<client> make_client(const std::string &url, time_t timeout)
+{
+    server_url parsed = server_url::parse(url);
+    if (parsed.client == server_url::client_type::native)
+        return std::make_unique<native_client>(std::move(parsed), timeout);
+    return std::make_unique<client_multi>(std::move(parsed.curl_url), timeout);
+}
+
+
+client_multi::client_multi(std::string url, time_t timeout)
+    : curlm_{curl_multi_init()}, url_{std::move(url)}, timeout_{timeout}, running_handles_{0}
 {
     if (curlm_ == nullptr)
         throw std::runtime_error("curl_multi_init() failed");
@@ -128,6 +293,7 @@ client_multi::~client_multi()
 
 void client_multi::add(const work_item &wi)
 {
+    wi.set_url(url_);
     curl_handles_.push_back(wi.get_curl_handle());
 
     if (timeout_ != -1)
@@ -143,6 +309,9 @@ void client_multi::add(const work_item &wi)
 
 int client_multi::perform()
 {
+    failed_items_.clear();
+    unanswered_items_.clear();
+
     // TODO: improve handling of CURLM (ie. timeouts, error handling...)
     while (running_handles_ != 0) {
         int maxfd = -1;
@@ -198,10 +367,16 @@ int client_multi::perform()
                 spdlog::error("SMTP worker failed (response_code={}, errno={}, err={})", resp_code, os_errno,
                               utils::string::str_err(os_errno));
                 ++failed_count;
+                const auto it = std::find(curl_handles_.begin(), curl_handles_.end(), msg->easy_handle);
+                failed_items_.push_back(static_cast<std::size_t>(it - curl_handles_.begin()));
+                if (resp_code == 0)
+                    unanswered_items_.push_back(failed_items_.back());
             }
         }
     }
 
+    std::sort(failed_items_.begin(), failed_items_.end());
+    std::sort(unanswered_items_.begin(), unanswered_items_.end());
     return failed_count;
 }
 
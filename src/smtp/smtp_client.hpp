@@ -5,6 +5,7 @@
 #include <set>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 namespace gwmilter::smtp {
 
@@ -19,17 +20,57 @@ public:
 };
 
 
+// smtp_server URL: scheme://host[:port][/ehlo-domain][?option=value&...]
+// Options:
+// - client=curl|native: SMTP client sending the re-injected emails (curl by default)
+// - pipelining=on|off, chunking=on|off: use of these extensions by the native client, when the server offers them
+// - weight=N: share of the emails sent to this relay when several are configured (1 by default)
+struct server_url {
+    enum class client_type { curl, native };
+
+    std::string scheme;
+    std::string host;
+    std::string port;
+    // EHLO domain, the local host name when empty
+    std::string domain;
+    client_type client = client_type::curl;
+    bool pipelining = true;
+    bool chunking = true;
+    unsigned int weight = 1;
+    // URL without the options, as given to libcurl
+    std::string curl_url;
+
+    // Throws std::invalid_argument for malformed URLs and unknown options
+    static server_url parse(const std::string &url);
+};
+
+
+// Email to send; the server is given by the client sending it
 class work_item {
 public:
-    explicit work_item(const std::string &url);
+    work_item();
 
     void set_sender(const std::string &s) const;
     void set_recipients(const std::set<std::string> &rcpts) const;
     void set_message(const headers_type &headers, const std::shared_ptr<std::string> &body) const;
+    // Same message with a binary body, sent instead when the server accepts BINARYMIME and CHUNKING
+    void set_binary_message(const headers_type &headers, const std::shared_ptr<std::string> &body) const;
+    [[nodiscard]] bool has_binary_message() const { return internals_->binary_body != nullptr; }
+    [[nodiscard]] const std::string &sender() const { return internals_->sender; }
+    [[nodiscard]] const std::vector<std::string> &recipients() const { return internals_->recipients; }
+    // Headers as sent and body, of the binary message when `binary` is set
+    [[nodiscard]] const std::string &headers(bool binary = false) const;
+    [[nodiscard]] const std::string &body(bool binary = false) const;
+    // Points the libcurl handle to the URL and rewinds the message, for a new transfer
+    void set_url(const std::string &url) const;
     CURL *get_curl_handle() const;
+    // total size of the message (headers and body) in bytes
+    std::size_t size() const;
 
 private:
     static size_t read_callback(void *ptr, size_t size, size_t nmemb, void *ud);
+    // headers as sent, deleted ones left out
+    static std::string format_headers(const headers_type &headers);
 
 private:
     // CURL wrapper
@@ -51,8 +92,11 @@ private:
         curl_slist *rcpt_list;
         std::string url;
         std::string sender;
+        std::vector<std::string> recipients;
         std::string headers;
         std::shared_ptr<std::string> body;
+        std::string binary_headers;
+        std::shared_ptr<std::string> binary_body;
         size_t pos;
         char err_buf[CURL_ERROR_SIZE + 1];
     };
@@ -61,19 +105,52 @@ private:
 };
 
 
-class client_multi {
+// Sends work items to the SMTP server
+class client {
+public:
+    virtual ~client() = default;
+
+    // Starts setting up the connection in the background, ahead of perform(), when the client supports it
+    virtual void prepare() { }
+    virtual void add(const work_item &wi) = 0;
+    // Sends all work items at once; returns the number of failed ones
+    virtual int perform() = 0;
+
+    // Work items that failed in the last perform(), by position in the order of add()
+    [[nodiscard]] const std::vector<std::size_t> &failed_items() const { return failed_items_; }
+    // Failed work items without a reply from the server (connection failure, timeout), as opposed to the ones
+    // refused by it; sorted, a subset of failed_items()
+    [[nodiscard]] const std::vector<std::size_t> &unanswered_items() const { return unanswered_items_; }
+    // True if some work items failed in the last perform() without a reply from the server
+    [[nodiscard]] bool server_failed() const { return !unanswered_items_.empty(); }
+
+protected:
+    std::vector<std::size_t> failed_items_;
+    std::vector<std::size_t> unanswered_items_;
+};
+
+
+// Client selected by the options of the smtp_server URL; timeout in seconds, -1 for none.
+// Throws std::invalid_argument like server_url::parse().
+std::unique_ptr<client> make_client(const std::string &url, time_t timeout);
+
+
+// libcurl client: one connection per work item, all of them in parallel
+class client_multi final : public client {
 public:
-    explicit client_multi(time_t timeout);
-    ~client_multi();
+    // url without the options (server_url::curl_url)
+    client_multi(std::string url, time_t timeout);
+    ~client_multi() override;
     client_multi(const client_multi &) = delete;
     client_multi &operator=(const client_multi &) = delete;
 
-    void add(const work_item &wi);
-    int perform();
+    void add(const work_item &wi) override;
+    int perform() override;
 
 private:
     CURLM *curlm_;
     std::vector<CURL *> curl_handles_;
+    std::string url_;
     time_t timeout_;
     int running_handles_;
 };
@@ -0,0 +1,234 @@
+#pragma once
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <netinet/in.h>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace gwmilter::smtp {
+
+// In-process SMTP server for the client tests: listens on a loopback port, accepts every connection in its
+// own thread and records the messages it receives
+class test_smtp_sink {
+public:
+    struct options {
+        bool pipelining = true;
+        bool chunking = true;
+        bool binarymime = true;
+        // answered with 550
+        std::set<std::string> rejected_recipients;
+        // delay of every reply
+        std::chrono::milliseconds reply_delay{0};
+        // the connection is dropped once this many messages are stored, 0 for never
+        std::size_t drop_after = 0;
+    };
+
+    struct message {
+        std::string sender;
+        std::string mail_parameters;
+        std::vector<std::string> recipients;
+        std::string data;
+        bool chunked = false;
+    };
+
+    test_smtp_sink()
+        : test_smtp_sink(options{})
+    { }
+
+    explicit test_smtp_sink(options opts)
+        : options_{std::move(opts)}
+    {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (listen_fd_ == -1 || bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            listen(listen_fd_, 16) != 0 || getsockname(listen_fd_, reinterpret_cast<sockaddr *>(&addr), &len) != 0)
+            throw std::runtime_error("unable to start the SMTP sink");
+        port_ = ntohs(addr.sin_port);
+
+        acceptor_ = std::thread([this] {
+            for (;;) {
+                const int fd = accept(listen_fd_, nullptr, nullptr);
+                if (fd == -1)
+                    return;
+                const std::lock_guard lock(mutex_);
+                ++connections_;
+                sessions_.emplace_back([this, fd] { serve(fd); });
+            }
+        });
+    }
+
+    ~test_smtp_sink()
+    {
+        shutdown(listen_fd_, SHUT_RDWR);
+        close(listen_fd_);
+        acceptor_.join();
+        for (auto &session: sessions_)
+            session.join();
+    }
+
+    test_smtp_sink(const test_smtp_sink &) = delete;
+    test_smtp_sink &operator=(const test_smtp_sink &) = delete;
+
+    [[nodiscard]] std::string url(const std::string &query = "client=native") const
+    {
+        return "smtp://127.0.0.1:" + std::to_string(port_) + "/gwmilter.test" + (query.empty() ? "" : "?" + query);
+    }
+
+    [[nodiscard]] std::vector<message> messages() const
+    {
+        const std::lock_guard lock(mutex_);
+        return messages_;
+    }
+
+    [[nodiscard]] std::size_t connections() const
+    {
+        const std::lock_guard lock(mutex_);
+        return connections_;
+    }
+
+    // Commands received before the replies of the previous ones were sent
+    [[nodiscard]] std::size_t pipelined_commands() const { return pipelined_; }
+
+private:
+    void serve(int fd)
+    {
+        timeval tv{5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        std::string in;
+        const auto fill = [&]() {
+            char buf[4096];
+            const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+                return false;
+            in.append(buf, static_cast<std::size_t>(n));
+            return true;
+        };
+        const auto line = [&](std::string &out) {
+            std::size_t end;
+            while ((end = in.find("\r\n")) == std::string::npos)
+                if (!fill())
+                    return false;
+            out = in.substr(0, end);
+            in.erase(0, end + 2);
+            return true;
+        };
+        const auto reply = [&](const std::string &text) {
+            if (options_.reply_delay.count() > 0)
+                std::this_thread::sleep_for(options_.reply_delay);
+            (void) send(fd, text.data(), text.size(), MSG_NOSIGNAL);
+        };
+
+        message current;
+        std::string cmd;
+        reply("220 sink ESMTP\r\n");
+        while (line(cmd)) {
+            if (!in.empty())
+                ++pipelined_;
+            const std::string verb = cmd.substr(0, cmd.find_first_of(" :"));
+
+            if (verb == "EHLO") {
+                std::string ehlo = "250-sink\r\n";
+                ehlo += options_.pipelining ? "250-PIPELINING\r\n" : "";
+                ehlo += options_.chunking ? "250-CHUNKING\r\n" : "";
+                ehlo += options_.binarymime ? "250-BINARYMIME\r\n" : "";
+                reply(ehlo + "250 8BITMIME\r\n");
+            } else if (verb == "MAIL") {
+                current = {};
+                const auto end = cmd.find('>');
+                current.sender = cmd.substr(10, end - 9);
+                current.mail_parameters = end + 1 < cmd.size() ? cmd.substr(end + 2) : "";
+                reply("250 ok\r\n");
+            } else if (verb == "RCPT") {
+                const std::string rcpt = cmd.substr(8);
+                if (options_.rejected_recipients.count(rcpt) != 0) {
+                    reply("550 no such user\r\n");
+                } else {
+                    current.recipients.push_back(rcpt);
+                    reply("250 ok\r\n");
+                }
+            } else if (verb == "DATA") {
+                if (current.recipients.empty()) {
+                    reply("554 no valid recipients\r\n");
+                    continue;
+                }
+                reply("354 go ahead\r\n");
+                std::string data_line;
+                while (line(data_line) && data_line != ".")
+                    current.data += (data_line.rfind('.', 0) == 0 ? data_line.substr(1) : data_line) + "\r\n";
+                store(current);
+                reply("250 queued\r\n");
+                if (dropping())
+                    break;
+            } else if (verb == "BDAT") {
+                const std::size_t size = std::strtoul(cmd.c_str() + 5, nullptr, 10);
+                while (in.size() < size && fill()) { }
+                if (in.size() < size)
+                    break;
+                current.data += in.substr(0, size);
+                in.erase(0, size);
+                current.chunked = true;
+                if (cmd.find(" LAST") == std::string::npos) {
+                    reply("250 chunk\r\n");
+                } else if (current.recipients.empty()) {
+                    reply("554 no valid recipients\r\n");
+                } else {
+                    store(current);
+                    reply("250 queued\r\n");
+                    if (dropping())
+                        break;
+                }
+            } else if (verb == "RSET") {
+                current = {};
+                reply("250 ok\r\n");
+            } else if (verb == "QUIT") {
+                reply("221 bye\r\n");
+                break;
+            } else {
+                reply("500 unknown command\r\n");
+            }
+        }
+        if (dropping()) {
+            // the replies sent so far reach the client before the connection ends
+            shutdown(fd, SHUT_WR);
+            while (fill()) { }
+        }
+        close(fd);
+    }
+
+    [[nodiscard]] bool dropping() const
+    {
+        const std::lock_guard lock(mutex_);
+        return options_.drop_after != 0 && messages_.size() >= options_.drop_after;
+    }
+
+    void store(message &m)
+    {
+        const std::lock_guard lock(mutex_);
+        messages_.push_back(std::move(m));
+        m = {};
+    }
+
+    options options_;
+    int listen_fd_ = -1;
+    unsigned short port_ = 0;
+    std::thread acceptor_;
+    std::vector<std::thread> sessions_;
+    mutable std::mutex mutex_;
+    std::vector<message> messages_;
+    std::size_t connections_ = 0;
+    std::atomic<std::size_t> pipelined_{0};
+};
+
+} // namespace gwmilter::smtp
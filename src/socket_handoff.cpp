@@ -0,0 +1,379 @@
+#include "socket_handoff.hpp"
+#include "logger/logger.hpp"
+#include "milter/milter_exception.hpp"
+#include "utils/string.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fmt/core.h>
+#include <libmilter/mfapi.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+namespace gwmilter::socket_handoff {
+
+namespace {
+
+constexpr char listen_fd_env[] = "GWMILTER_LISTEN_FD";
+constexpr char ready_fd_env[] = "GWMILTER_READY_FD";
+
+std::string g_path;
+std::vector<std::string> g_argv;
+std::string g_cwd;
+bool g_inherited = false;
+int g_listen_fd = -1;
+// listening socket of libmilter, once opened
+int g_milter_fd = -1;
+// unix socket file and its second hard link, set by release()
+std::string g_socket_path;
+std::string g_socket_link;
+int g_ready_fd = -1;
+
+
+// Takes a descriptor passed by the old instance, so that it is not passed on again
+int take_fd(const char *name)
+{
+    const char *value = std::getenv(name);
+    if (value == nullptr)
+        return -1;
+
+    char *end = nullptr;
+    const long fd = std::strtol(value, &end, 10);
+    unsetenv(name);
+    if (*end != '\0' || fd < 0 || fcntl(static_cast<int>(fd), F_SETFD, FD_CLOEXEC) == -1) {
+        spdlog::warn("Ignoring invalid {}", name);
+        return -1;
+    }
+    return static_cast<int>(fd);
+}
+
+
+// Looks up argv[0] in PATH, as the lookup cannot be done between fork() and exec()
+std::string executable_path(const std::string &name)
+{
+    if (name.find('/') != std::string::npos)
+        return name;
+
+    const char *env_path = std::getenv("PATH");
+    const std::string path = env_path != nullptr ? env_path : "";
+    std::size_t start = 0;
+    while (start <= path.size()) {
+        std::size_t end = path.find(':', start);
+        if (end == std::string::npos)
+            end = path.size();
+        const std::string dir = path.substr(start, end - start);
+        const std::string candidate = (dir.empty() ? std::string{"."} : dir) + "/" + name;
+        if (access(candidate.c_str(), X_OK) == 0)
+            return candidate;
+        start = end + 1;
+    }
+    return name;
+}
+
+
+bool is_listening_socket(int fd)
+{
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+    return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 && listening != 0;
+}
+
+
+// libmilter does not expose its listening socket, which is the only one in the process; looked up among the
+// open descriptors when the socket is opened
+int find_listening_socket(int skip = -1)
+{
+    for (const char *dir: {"/proc/self/fd", "/dev/fd"}) {
+        std::error_code ec;
+        std::filesystem::directory_iterator it(dir, ec);
+        if (ec)
+            continue;
+
+        for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+            const std::string name = it->path().filename().string();
+            char *end = nullptr;
+            const long fd = std::strtol(name.c_str(), &end, 10);
+            if (*end == '\0' && fd != skip && is_listening_socket(static_cast<int>(fd)))
+                return static_cast<int>(fd);
+        }
+        return -1;
+    }
+    return -1;
+}
+
+
+// Type and path or port of a bound socket, in the format of describe_setting()
+std::string describe_socket(int fd)
+{
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) != 0)
+        return {};
+
+    switch (addr.ss_family) {
+    case AF_UNIX:
+        return fmt::format("unix:{}", reinterpret_cast<const sockaddr_un &>(addr).sun_path);
+    case AF_INET:
+        return fmt::format("inet:{}", ntohs(reinterpret_cast<const sockaddr_in &>(addr).sin_port));
+    case AF_INET6:
+        return fmt::format("inet6:{}", ntohs(reinterpret_cast<const sockaddr_in6 &>(addr).sin6_port));
+    default:
+        return {};
+    }
+}
+
+
+// Type and path or port of a milter_socket setting ("{unix|local}:path", "path", "{inet|inet6}:port@host"); the
+// host is not compared, nor ports given as service names (empty result)
+std::string describe_setting(const std::string &conn)
+{
+    const auto colon = conn.find(':');
+    if (colon == std::string::npos)
+        return "unix:" + conn;
+
+    const std::string protocol = utils::string::to_lower(conn.substr(0, colon));
+    const std::string rest = conn.substr(colon + 1);
+    if (protocol == "unix" || protocol == "local")
+        return "unix:" + rest;
+
+    const std::string port = rest.substr(0, rest.find('@'));
+    if ((protocol != "inet" && protocol != "inet6") || port.empty() ||
+        port.find_first_not_of("0123456789") != std::string::npos)
+        return {};
+    return fmt::format("{}:{}", protocol, std::stoul(port));
+}
+
+} // namespace
+
+
+void save_command(int argc, char *argv[])
+{
+    g_argv.assign(argv, argv + argc);
+    if (char *cwd = getcwd(nullptr, 0); cwd != nullptr) {
+        g_cwd = cwd;
+        std::free(cwd);
+    }
+    // made absolute, as daemon() changes to / before the crypto helpers are spawned; symlinks are kept, so that
+    // an upgrade replacing the link target starts the new binary
+    g_path = executable_path(g_argv.front());
+    if (!g_path.empty() && g_path.front() != '/' && !g_cwd.empty())
+        g_path = (std::filesystem::path{g_cwd} / g_path).lexically_normal().string();
+
+    g_listen_fd = take_fd(listen_fd_env);
+    g_ready_fd = take_fd(ready_fd_env);
+    g_inherited = g_listen_fd != -1;
+}
+
+
+const std::string &executable()
+{
+    return g_path;
+}
+
+
+bool start_successor(std::chrono::seconds timeout)
+{
+    if (g_argv.empty())
+        throw std::logic_error("socket_handoff::save_command() was not called");
+
+    const int listen_fd = g_milter_fd;
+    if (listen_fd == -1) {
+        spdlog::error("Upgrade: milter socket not opened");
+        return false;
+    }
+
+    int ready[2];
+    if (pipe(ready) != 0) {
+        spdlog::error("Upgrade: pipe() failed: {}", utils::string::str_err(errno));
+        return false;
+    }
+    // not inherited by processes spawned meanwhile, e.g. by gpgme
+    fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+    fcntl(ready[1], F_SETFD, FD_CLOEXEC);
+
+    // everything is allocated before fork(), as only async-signal-safe calls are allowed in the child
+    std::vector<std::string> env_strings;
+    for (char **e = environ; *e != nullptr; ++e)
+        if (std::strncmp(*e, listen_fd_env, sizeof(listen_fd_env) - 1) != 0 &&
+            std::strncmp(*e, ready_fd_env, sizeof(ready_fd_env) - 1) != 0)
+            env_strings.emplace_back(*e);
+    env_strings.push_back(fmt::format("{}={}", listen_fd_env, listen_fd));
+    env_strings.push_back(fmt::format("{}={}", ready_fd_env, ready[1]));
+
+    std::vector<char *> env;
+    for (auto &s: env_strings)
+        env.push_back(s.data());
+    env.push_back(nullptr);
+
+    std::vector<std::string> argv_strings = g_argv;
+    std::vector<char *> argv;
+    for (auto &s: argv_strings)
+        argv.push_back(s.data());
+    argv.push_back(nullptr);
+
+    const pid_t pid = fork();
+    if (pid == -1) {
+        spdlog::error("Upgrade: fork() failed: {}", utils::string::str_err(errno));
+        ::close(ready[0]);
+        ::close(ready[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, nullptr);
+        fcntl(listen_fd, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        // relative paths on the command line, e.g. the configuration file, refer to the original directory
+        if (!g_cwd.empty() && chdir(g_cwd.c_str()) != 0)
+            _exit(127);
+        execve(g_path.c_str(), argv.data(), env.data());
+        _exit(127);
+    }
+
+    ::close(ready[1]);
+    spdlog::info("Upgrade: started {} (pid {}), waiting for it to accept connections", g_path, pid);
+
+    pollfd pfd{ready[0], POLLIN, 0};
+    int rc = 0;
+    do {
+        rc = poll(&pfd, 1, static_cast<int>(std::chrono::milliseconds(timeout).count()));
+    } while (rc == -1 && errno == EINTR);
+
+    char byte = 0;
+    const bool ready_received = rc == 1 && ::read(ready[0], &byte, 1) == 1;
+    ::close(ready[0]);
+
+    if (!ready_received) {
+        if (rc == 0) {
+            spdlog::error("Upgrade: new instance not ready after {}s, terminating it", timeout.count());
+            kill(pid, SIGTERM);
+        } else {
+            spdlog::error("Upgrade: new instance exited before accepting connections");
+        }
+    }
+
+    // a daemonized new instance forks and its first process exits right away
+    waitpid(pid, nullptr, WNOHANG);
+    return ready_received;
+}
+
+
+void release()
+{
+    if (g_milter_fd == -1)
+        return;
+
+    // On exit, libmilter removes the unix socket file when it matches its listening socket, even though the
+    // socket is now shared with the new instance. A second hard link allows restore() to put it back.
+    sockaddr_un addr{};
+    socklen_t len = sizeof(addr);
+    if (getsockname(g_milter_fd, reinterpret_cast<sockaddr *>(&addr), &len) != 0 || addr.sun_family != AF_UNIX ||
+        addr.sun_path[0] == '\0')
+        return;
+
+    g_socket_path = addr.sun_path;
+    g_socket_link = fmt::format("{}.handoff.{}", g_socket_path, getpid());
+    ::unlink(g_socket_link.c_str());
+    if (::link(g_socket_path.c_str(), g_socket_link.c_str()) != 0) {
+        spdlog::warn("Upgrade: unable to link milter socket {} to {}: {}; the socket may disappear on exit",
+                     g_socket_path, g_socket_link, utils::string::str_err(errno));
+        g_socket_link.clear();
+    }
+}
+
+
+void restore()
+{
+    if (g_socket_link.empty())
+        return;
+
+    // replaces the path atomically if it is still there; the link is left in that case
+    if (::rename(g_socket_link.c_str(), g_socket_path.c_str()) != 0)
+        spdlog::error("Upgrade: unable to restore milter socket {}: {}", g_socket_path,
+                      utils::string::str_err(errno));
+    ::unlink(g_socket_link.c_str());
+    g_socket_link.clear();
+}
+
+
+void opened()
+{
+    g_milter_fd = find_listening_socket();
+    if (g_milter_fd == -1)
+        spdlog::error("Milter socket not found, graceful upgrades are not available");
+}
+
+
+bool inherited()
+{
+    return g_inherited;
+}
+
+
+void adopt(const std::string &milter_socket)
+{
+    if (g_listen_fd == -1)
+        throw std::logic_error("No inherited milter socket");
+    if (!is_listening_socket(g_listen_fd))
+        throw std::runtime_error(fmt::format("Inherited descriptor {} is not a listening socket", g_listen_fd));
+
+    const std::string inherited_socket = describe_socket(g_listen_fd);
+    if (const std::string configured = describe_setting(milter_socket);
+        !configured.empty() && !inherited_socket.empty() && configured != inherited_socket)
+        spdlog::error("milter_socket changed to '{}', still listening on the inherited socket {}; restart to "
+                      "apply the change",
+                      milter_socket, inherited_socket);
+
+    const std::string path =
+        (std::filesystem::temp_directory_path() / fmt::format("gwmilter-{}.sock", getpid())).string();
+    const std::string conn = "unix:" + path;
+    if (smfi_setconn(const_cast<char *>(conn.c_str())) == MI_FAILURE)
+        throw milter_exception("smfi_setconn failed");
+    if (smfi_opensocket(true) == MI_FAILURE)
+        throw milter_exception(fmt::format("smfi_opensocket failed for socket '{}'", conn));
+
+    const int fd = find_listening_socket(g_listen_fd);
+    ::unlink(path.c_str());
+    if (fd == -1)
+        throw std::runtime_error("Unable to find the libmilter socket among the open descriptors");
+
+    if (dup2(g_listen_fd, fd) == -1)
+        throw std::runtime_error(fmt::format("dup2() failed: {}", utils::string::str_err(errno)));
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    ::close(g_listen_fd);
+    g_listen_fd = -1;
+    g_milter_fd = fd;
+
+    spdlog::info("Listening on the milter socket inherited from the previous instance");
+}
+
+
+void notify_ready()
+{
+    if (g_ready_fd == -1)
+        return;
+
+    const char byte = 1;
+    if (::write(g_ready_fd, &byte, 1) != 1)
+        spdlog::warn("Unable to notify the previous instance: {}", utils::string::str_err(errno));
+    ::close(g_ready_fd);
+    g_ready_fd = -1;
+}
+
+} // namespace gwmilter::socket_handoff
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+namespace gwmilter::socket_handoff {
+
+// Graceful upgrade: the running process starts a new instance of the binary which inherits the listening
+// milter socket, so that connections are queued by the kernel instead of being refused while the processes
+// are swapped. Once the new instance accepts connections, the old one stops accepting and drains the
+// connections in progress.
+//
+// libmilter always opens its listening socket itself and does not expose it, so the new instance lets it open a
+// temporary unix socket and replaces that descriptor with the inherited one before calling smfi_main(). This
+// relies on libmilter internals: smfi_opensocket() keeps the only listening socket of the process, which is found
+// among the descriptors listed in /proc/self/fd (or /dev/fd), and smfi_main() accepts from that descriptor.
+// The inherited socket keeps its address: a changed milter_socket only applies after a full restart.
+
+// Saves the command line and working directory used to start the new instance; call early in main()
+void save_command(int argc, char *argv[]);
+
+// Absolute path of the running binary, as resolved by save_command()
+const std::string &executable();
+
+// Old instance: starts the new instance with the listening milter socket, and waits at most `timeout` for it
+// to be ready (it warms up first).
+// Returns false, and leaves the current process untouched, if the new instance failed to start.
+bool start_successor(std::chrono::seconds timeout = std::chrono::seconds{300});
+
+// Old instance: keeps a second hard link to the unix socket file it now shares with the new instance, which
+// libmilter removes when smfi_main() returns. Call right before smfi_stop().
+void release();
+
+// Old instance: once smfi_main() returned, puts back the socket file kept by release()
+void restore();
+
+// Records the listening socket opened by libmilter (smfi_opensocket()), for start_successor() and release();
+// adopt() records the inherited one
+void opened();
+
+// New instance: true if this process was started by start_successor()
+bool inherited();
+
+// New instance: makes libmilter listen on the inherited socket; call after smfi_register() and instead of
+// smfi_opensocket(). Logs an error when milter_socket differs from the inherited socket, which is kept;
+// throws when the inherited descriptor is not a listening socket, or the one of libmilter is not found.
+void adopt(const std::string &milter_socket);
+
+// New instance: tells the old instance that it can stop accepting connections
+void notify_ready();
+
+} // namespace gwmilter::socket_handoff
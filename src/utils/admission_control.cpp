@@ -0,0 +1,80 @@
+#include "admission_control.hpp"
+
+namespace gwmilter::utils {
+
+admission_control::reservation::reservation(admission_control &owner)
+    : owner_{owner}
+{ }
+
+
+admission_control::reservation::~reservation()
+{
+    owner_.used_.fetch_sub(size_, std::memory_order_relaxed);
+}
+
+
+bool admission_control::reservation::try_add(std::size_t size, std::size_t limit)
+{
+    std::size_t used = owner_.used_.load(std::memory_order_relaxed);
+    do {
+        if (limit != 0 && used + size > limit)
+            return false;
+    } while (!owner_.used_.compare_exchange_weak(used, used + size, std::memory_order_relaxed));
+
+    size_ += size;
+    return true;
+}
+
+
+void admission_control::reservation::add(std::size_t size)
+{
+    owner_.used_.fetch_add(size, std::memory_order_relaxed);
+    size_ += size;
+}
+
+
+admission_control::encryption_slot::encryption_slot(admission_control &owner, std::size_t limit)
+    : owner_{owner}
+{
+    std::unique_lock lock(owner_.mutex_);
+    owner_.stage_cv_.wait(lock, [this, limit] { return limit == 0 || owner_.encrypting_ < limit; });
+    ++owner_.encrypting_;
+}
+
+
+admission_control::encryption_slot::~encryption_slot()
+{
+    {
+        std::lock_guard lock(owner_.mutex_);
+        --owner_.encrypting_;
+    }
+    owner_.stage_cv_.notify_one();
+}
+
+
+admission_control &admission_control::instance()
+{
+    static admission_control ac;
+    return ac;
+}
+
+
+bool admission_control::over_budget(std::size_t limit) const
+{
+    return limit != 0 && used() >= limit;
+}
+
+
+bool admission_control::encryption_stage_full(std::size_t limit) const
+{
+    return limit != 0 && encrypting() >= limit;
+}
+
+
+std::size_t admission_control::encrypting() const
+{
+    std::lock_guard lock(mutex_);
+    return encrypting_;
+}
+
+} // namespace gwmilter::utils
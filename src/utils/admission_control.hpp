@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+namespace gwmilter::utils {
+
+// Process-wide accounting of the memory held by the messages in progress, and of the number of
+// messages in the encryption stage. Limits are passed by the callers (0 means unlimited), so that
+// they follow configuration reloads.
+class admission_control {
+public:
+    // Memory charged by one message; released when destroyed
+    class reservation {
+    public:
+        explicit reservation(admission_control &owner);
+        ~reservation();
+        reservation(const reservation &) = delete;
+        reservation &operator=(const reservation &) = delete;
+
+        // Charges size bytes if the total stays within limit; returns false, charging nothing, otherwise
+        [[nodiscard]] bool try_add(std::size_t size, std::size_t limit);
+        // Charges memory that is already allocated, regardless of the limit
+        void add(std::size_t size);
+
+        [[nodiscard]] std::size_t size() const { return size_; }
+
+    private:
+        admission_control &owner_;
+        std::size_t size_ = 0;
+    };
+
+    // Place in the encryption stage; blocks until the stage holds less than limit messages.
+    // Released when destroyed.
+    class encryption_slot {
+    public:
+        encryption_slot(admission_control &owner, std::size_t limit);
+        ~encryption_slot();
+        encryption_slot(const encryption_slot &) = delete;
+        encryption_slot &operator=(const encryption_slot &) = delete;
+
+    private:
+        admission_control &owner_;
+    };
+
+    static admission_control &instance();
+
+    // True if the memory in use reached the limit
+    [[nodiscard]] bool over_budget(std::size_t limit) const;
+    // True if the encryption stage holds limit messages
+    [[nodiscard]] bool encryption_stage_full(std::size_t limit) const;
+
+    [[nodiscard]] std::size_t used() const { return used_.load(std::memory_order_relaxed); }
+    [[nodiscard]] std::size_t encrypting() const;
+
+private:
+    std::atomic<std::size_t> used_{0};
+
+    mutable std::mutex mutex_;
+    std::condition_variable stage_cv_;
+    std::size_t encrypting_ = 0;
+};
+
+} // namespace gwmilter::utils
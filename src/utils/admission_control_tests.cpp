@@ -0,0 +1,67 @@
+#include "admission_control.hpp"
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+
+using namespace gwmilter::utils;
+
+TEST(AdmissionControlTest, ReservationIsReleasedWhenDestroyed)
+{
+    admission_control ac;
+    {
+        admission_control::reservation r(ac);
+        EXPECT_TRUE(r.try_add(100, 1000));
+        r.add(50);
+        EXPECT_EQ(r.size(), 150u);
+        EXPECT_EQ(ac.used(), 150u);
+    }
+    EXPECT_EQ(ac.used(), 0u);
+}
+
+TEST(AdmissionControlTest, TryAddFailsWhenBudgetWouldBeExceeded)
+{
+    admission_control ac;
+    admission_control::reservation r1(ac);
+    admission_control::reservation r2(ac);
+
+    EXPECT_TRUE(r1.try_add(600, 1000));
+    EXPECT_FALSE(r2.try_add(500, 1000));
+    EXPECT_EQ(r2.size(), 0u);
+    EXPECT_TRUE(r2.try_add(400, 1000));
+
+    EXPECT_TRUE(ac.over_budget(1000));
+    EXPECT_FALSE(ac.over_budget(0));
+}
+
+TEST(AdmissionControlTest, ZeroLimitMeansUnlimited)
+{
+    admission_control ac;
+    admission_control::reservation r(ac);
+    EXPECT_TRUE(r.try_add(static_cast<std::size_t>(1) << 40, 0));
+    EXPECT_FALSE(ac.over_budget(0));
+    EXPECT_FALSE(ac.encryption_stage_full(0));
+}
+
+TEST(AdmissionControlTest, EncryptionStageIsBounded)
+{
+    admission_control ac;
+    std::atomic<bool> entered{false};
+
+    auto first = std::make_unique<admission_control::encryption_slot>(ac, 1);
+    EXPECT_TRUE(ac.encryption_stage_full(1));
+
+    std::thread t([&] {
+        admission_control::encryption_slot second(ac, 1);
+        entered = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{20});
+    EXPECT_FALSE(entered);
+
+    first.reset();
+    t.join();
+    EXPECT_TRUE(entered);
+    EXPECT_EQ(ac.encrypting(), 0u);
+}
@@ -0,0 +1,61 @@
+#include "cached_file.hpp"
+#include "utils/string.hpp"
+#include <cerrno>
+#include <fmt/core.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/stat.h>
+
+namespace gwmilter::utils {
+
+cached_file::cached_file(std::string path)
+    : path_{std::move(path)}
+{ }
+
+
+std::shared_ptr<const std::string> cached_file::content() const
+{
+    const metadata current = stat();
+
+    std::lock_guard lock(mutex_);
+    if (content_ != nullptr && metadata_ == current)
+        return content_;
+
+    std::ifstream file(path_, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Unable to open file: " + path_);
+
+    content_ = std::make_shared<const std::string>(normalize(file));
+    metadata_ = current;
+    return content_;
+}
+
+
+std::string cached_file::normalize(std::istream &is)
+{
+    std::string content;
+    std::string line;
+    while (std::getline(is, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        content += line;
+        content += "\r\n";
+    }
+    return content;
+}
+
+
+cached_file::metadata cached_file::stat() const
+{
+    struct stat st{};
+    if (::stat(path_.c_str(), &st) != 0)
+        throw std::runtime_error(fmt::format("Unable to stat file {}: {}", path_, string::str_err(errno)));
+
+#ifdef __APPLE__
+    return {st.st_dev, st.st_ino, st.st_size, st.st_mtimespec};
+#else
+    return {st.st_dev, st.st_ino, st.st_size, st.st_mtim};
+#endif
+}
+
+} // namespace gwmilter::utils
@@ -0,0 +1,52 @@
+#pragma once
+#include <ctime>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <sys/types.h>
+
+namespace gwmilter::utils {
+
+// Text file loaded in memory and normalized to CRLF line endings.
+// The content is shared as an immutable buffer; the file is read again only when
+// its metadata (inode, size, modification time) changes on disk.
+class cached_file {
+public:
+    explicit cached_file(std::string path);
+    cached_file(const cached_file &) = delete;
+    cached_file &operator=(const cached_file &) = delete;
+
+    // Returns the normalized content, reloading the file if it changed on disk.
+    // Throws std::runtime_error if the file cannot be read.
+    [[nodiscard]] std::shared_ptr<const std::string> content() const;
+
+    [[nodiscard]] const std::string &path() const { return path_; }
+
+    // Converts line endings to CRLF; the last line is always terminated
+    [[nodiscard]] static std::string normalize(std::istream &is);
+
+private:
+    struct metadata {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        timespec mtime;
+
+        bool operator==(const metadata &other) const
+        {
+            return dev == other.dev && ino == other.ino && size == other.size &&
+                   mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec;
+        }
+    };
+
+    [[nodiscard]] metadata stat() const;
+
+    const std::string path_;
+    mutable std::mutex mutex_;
+    mutable std::optional<metadata> metadata_;
+    mutable std::shared_ptr<const std::string> content_;
+};
+
+} // namespace gwmilter::utils
@@ -0,0 +1,72 @@
+#include "cached_file.hpp"
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <unistd.h>
+
+using namespace gwmilter::utils;
+
+class CachedFileTest : public ::testing::Test {
+protected:
+    std::filesystem::path file;
+
+    void SetUp() override
+    {
+        file = std::filesystem::temp_directory_path() / ("gwmilter_cached_file_" + std::to_string(getpid()) + ".txt");
+    }
+
+    void TearDown() override { std::filesystem::remove(file); }
+
+    void write(const std::string &content) const
+    {
+        std::ofstream ofs(file, std::ios::binary | std::ios::trunc);
+        ofs << content;
+    }
+};
+
+TEST_F(CachedFileTest, NormalizeConvertsLineEndingsToCrlf)
+{
+    std::istringstream lf("line 1\nline 2\n");
+    EXPECT_EQ(cached_file::normalize(lf), "line 1\r\nline 2\r\n");
+
+    std::istringstream crlf("line 1\r\nline 2\r\n");
+    EXPECT_EQ(cached_file::normalize(crlf), "line 1\r\nline 2\r\n");
+}
+
+TEST_F(CachedFileTest, NormalizeTerminatesLastLine)
+{
+    std::istringstream is("no newline");
+    EXPECT_EQ(cached_file::normalize(is), "no newline\r\n");
+}
+
+TEST_F(CachedFileTest, ContentIsSharedWhileFileIsUnchanged)
+{
+    write("hello\n");
+    cached_file cf(file.string());
+
+    auto first = cf.content();
+    auto second = cf.content();
+    EXPECT_EQ(*first, "hello\r\n");
+    EXPECT_EQ(first.get(), second.get());
+}
+
+TEST_F(CachedFileTest, ContentIsReloadedWhenFileChanges)
+{
+    write("before\n");
+    cached_file cf(file.string());
+    auto before = cf.content();
+
+    write("after, with a different size\n");
+    auto after = cf.content();
+
+    EXPECT_EQ(*after, "after, with a different size\r\n");
+    // buffers already handed out are immutable
+    EXPECT_EQ(*before, "before\r\n");
+}
+
+TEST_F(CachedFileTest, ContentThrowsForMissingFile)
+{
+    cached_file cf((file.parent_path() / "gwmilter_missing_file.txt").string());
+    EXPECT_THROW((void) cf.content(), std::runtime_error);
+}
@@ -0,0 +1,168 @@
+#include "email_journal.hpp"
+#include "logger/logger.hpp"
+#include "utils/string.hpp"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace gwmilter::utils {
+
+std::array<std::atomic<const email_journal::record *>, email_journal::max_entries> email_journal::slots_{};
+char email_journal::crash_path_[256] = {0};
+
+namespace {
+
+// async-signal-safe helpers (no allocation, no stdio)
+bool append(char *dst, std::size_t dst_size, std::size_t &pos, const char *src) noexcept
+{
+    for (; *src != '\0'; ++src) {
+        if (pos + 1 >= dst_size)
+            return false;
+        dst[pos++] = *src;
+    }
+    dst[pos] = '\0';
+    return true;
+}
+
+bool write_all(int fd, const char *data, std::size_t size) noexcept
+{
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+
+email_journal::entry::entry(const std::string &conn_id, const std::string &msg_id, const std::string &headers,
+                            const std::string &body, bool enabled)
+    : enabled_{enabled}, slot_{max_entries}
+{
+    if (!enabled_)
+        return;
+
+    std::size_t pos = 0;
+    append(record_.name, sizeof(record_.name), pos, conn_id.c_str());
+    append(record_.name, sizeof(record_.name), pos, "-");
+    append(record_.name, sizeof(record_.name), pos, msg_id.c_str());
+    append(record_.name, sizeof(record_.name), pos, ".eml");
+    record_.headers = headers.data();
+    record_.headers_size = headers.size();
+    record_.body = body.data();
+    record_.body_size = body.size();
+
+    for (std::size_t i = 0; i < max_entries; ++i) {
+        const record *expected = nullptr;
+        if (slots_[i].compare_exchange_strong(expected, &record_, std::memory_order_release)) {
+            slot_ = i;
+            return;
+        }
+    }
+
+    spdlog::warn("{}: email journal is full ({} entries), email will not be dumped on crash", msg_id, max_entries);
+}
+
+
+email_journal::entry::~entry()
+{
+    if (slot_ < max_entries)
+        slots_[slot_].store(nullptr, std::memory_order_release);
+}
+
+
+void email_journal::entry::persist(const char *path, const char *prefix) const
+{
+    if (!enabled_)
+        return;
+
+    if (write_record(path, prefix, record_))
+        spdlog::debug("Email dumped into {}/{}{}", path, prefix, record_.name);
+    else
+        spdlog::error("Failed to dump email into {}/{}{}: {}", path, prefix, record_.name,
+                      utils::string::str_err(errno));
+}
+
+
+void email_journal::install_crash_handler(const std::string &path)
+{
+    if (path.size() >= sizeof(crash_path_))
+        throw std::invalid_argument(fmt::format("Email dump path is too long: {}", path));
+    std::memcpy(crash_path_, path.c_str(), path.size() + 1);
+
+    struct sigaction sa{};
+    sa.sa_handler = email_journal::crash_handler;
+    sigemptyset(&sa.sa_mask);
+    // restore the default action once triggered, so that re-raising the signal terminates the process
+    sa.sa_flags = SA_RESETHAND;
+
+    for (int sig: {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT})
+        if (sigaction(sig, &sa, nullptr) != 0)
+            throw std::runtime_error(fmt::format("sigaction() failed: {}", utils::string::str_err(errno)));
+}
+
+
+std::size_t email_journal::dump_all(const char *path, const char *prefix) noexcept
+{
+    std::size_t count = 0;
+    for (const auto &slot: slots_)
+        if (const record *r = slot.load(std::memory_order_acquire); r != nullptr && write_record(path, prefix, *r))
+            ++count;
+    return count;
+}
+
+
+std::size_t email_journal::size() noexcept
+{
+    std::size_t count = 0;
+    for (const auto &slot: slots_)
+        if (slot.load(std::memory_order_relaxed) != nullptr)
+            ++count;
+    return count;
+}
+
+
+bool email_journal::write_record(const char *path, const char *prefix, const record &r) noexcept
+{
+    if (::mkdir(path, 0700) == -1 && errno != EEXIST)
+        return false;
+
+    char file_name[512];
+    std::size_t pos = 0;
+    if (!append(file_name, sizeof(file_name), pos, path) || !append(file_name, sizeof(file_name), pos, "/") ||
+        !append(file_name, sizeof(file_name), pos, prefix) || !append(file_name, sizeof(file_name), pos, r.name))
+        return false;
+
+    int fd = ::open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return false;
+
+    const bool ok = write_all(fd, r.headers, r.headers_size) && write_all(fd, "\r\n", 2) &&
+                    write_all(fd, r.body, r.body_size);
+    ::close(fd);
+    return ok;
+}
+
+
+void email_journal::crash_handler(int sig)
+{
+    const int saved_errno = errno;
+    dump_all(crash_path_, "crash-");
+    errno = saved_errno;
+    // SA_RESETHAND restored the default action
+    ::raise(sig);
+}
+
+} // namespace gwmilter::utils
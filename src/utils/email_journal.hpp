@@ -0,0 +1,64 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+namespace gwmilter::utils {
+
+// In-memory journal of the emails currently being processed.
+//
+// Emails are only registered here (no copy, no disk I/O); they are written to disk
+// when processing fails with an exception (entry::persist()), or when the process
+// crashes, from the signal handler installed by install_crash_handler().
+class email_journal {
+    struct record {
+        char name[96];
+        const char *headers;
+        std::size_t headers_size;
+        const char *body;
+        std::size_t body_size;
+    };
+
+public:
+    static constexpr std::size_t max_entries = 1024;
+
+    // RAII registration of an email. The headers and body buffers are referenced,
+    // not copied, hence they must outlive the entry and must not be modified meanwhile.
+    class entry {
+    public:
+        entry(const std::string &conn_id, const std::string &msg_id, const std::string &headers,
+              const std::string &body, bool enabled);
+        ~entry();
+        entry(const entry &) = delete;
+        entry &operator=(const entry &) = delete;
+
+        // Writes the email to <path>/<prefix><conn_id>-<msg_id>.eml; no-op when disabled
+        void persist(const char *path, const char *prefix) const;
+
+    private:
+        record record_{};
+        bool enabled_;
+        std::size_t slot_;
+    };
+
+    // Installs handlers for SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT which dump
+    // all registered emails into `path` (with "crash-" prefix) before the process dies.
+    static void install_crash_handler(const std::string &path);
+
+    // Writes all registered emails into `path`; async-signal-safe.
+    // Returns the number of emails written.
+    static std::size_t dump_all(const char *path, const char *prefix) noexcept;
+
+    // Number of registered emails
+    static std::size_t size() noexcept;
+
+private:
+    static bool write_record(const char *path, const char *prefix, const record &r) noexcept;
+    static void crash_handler(int sig);
+
+    static std::array<std::atomic<const record *>, max_entries> slots_;
+    static char crash_path_[256];
+};
+
+} // namespace gwmilter::utils
@@ -0,0 +1,84 @@
+#include "email_journal.hpp"
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <unistd.h>
+
+using namespace gwmilter::utils;
+
+class EmailJournalTest : public ::testing::Test {
+protected:
+    std::filesystem::path dir;
+
+    void SetUp() override
+    {
+        dir = std::filesystem::temp_directory_path() / ("gwmilter_journal_" + std::to_string(getpid()));
+        std::filesystem::remove_all(dir);
+    }
+
+    void TearDown() override { std::filesystem::remove_all(dir); }
+
+    static std::string read(const std::filesystem::path &file)
+    {
+        std::ifstream ifs(file, std::ios::binary);
+        std::stringstream ss;
+        ss << ifs.rdbuf();
+        return ss.str();
+    }
+};
+
+TEST_F(EmailJournalTest, DisabledEntryIsNotRegistered)
+{
+    const std::string headers = "Subject: test\r\n";
+    const std::string body = "body\r\n";
+    const std::size_t before = email_journal::size();
+
+    email_journal::entry e("conn", "msg", headers, body, false);
+    EXPECT_EQ(email_journal::size(), before);
+
+    e.persist(dir.c_str(), "exception-");
+    EXPECT_FALSE(std::filesystem::exists(dir));
+}
+
+TEST_F(EmailJournalTest, EntryIsRegisteredForItsLifetime)
+{
+    const std::string headers = "Subject: test\r\n";
+    const std::string body = "body\r\n";
+    const std::size_t before = email_journal::size();
+
+    {
+        email_journal::entry e("conn", "msg", headers, body, true);
+        EXPECT_EQ(email_journal::size(), before + 1);
+    }
+
+    EXPECT_EQ(email_journal::size(), before);
+}
+
+TEST_F(EmailJournalTest, PersistWritesHeadersAndBody)
+{
+    const std::string headers = "Subject: test\r\nFrom: a@example.com\r\n";
+    const std::string body = "line 1\r\nline 2\r\n";
+
+    email_journal::entry e("CONN", "MSG", headers, body, true);
+    e.persist(dir.c_str(), "exception-");
+
+    const auto file = dir / "exception-CONN-MSG.eml";
+    ASSERT_TRUE(std::filesystem::exists(file));
+    EXPECT_EQ(read(file), headers + "\r\n" + body);
+}
+
+TEST_F(EmailJournalTest, DumpAllWritesEveryRegisteredEmail)
+{
+    const std::string headers1 = "Subject: one\r\n";
+    const std::string body1 = "first\r\n";
+    const std::string headers2 = "Subject: two\r\n";
+    const std::string body2 = "second\r\n";
+
+    email_journal::entry e1("C1", "M1", headers1, body1, true);
+    email_journal::entry e2("C2", "M2", headers2, body2, true);
+
+    EXPECT_EQ(email_journal::dump_all(dir.c_str(), "crash-"), email_journal::size());
+    EXPECT_EQ(read(dir / "crash-C1-M1.eml"), headers1 + "\r\n" + body1);
+    EXPECT_EQ(read(dir / "crash-C2-M2.eml"), headers2 + "\r\n" + body2);
+}
@@ -0,0 +1,111 @@
+#include "mime.hpp"
+#include "string.hpp"
+#include <array>
+#include <string>
+
+namespace gwmilter::utils::mime {
+
+namespace {
+
+bool starts_with(std::string_view s, std::string_view prefix)
+{
+    return s.substr(0, prefix.size()) == prefix;
+}
+
+
+// lowercase type/subtype of a Content-Type header value
+std::string media_type(std::string_view value)
+{
+    value = value.substr(0, value.find(';'));
+    const auto first = value.find_first_not_of(" \t");
+    if (first == std::string_view::npos)
+        return {};
+    const auto last = value.find_last_not_of(" \t\r");
+    return string::to_lower(value.substr(first, last - first + 1));
+}
+
+} // namespace
+
+
+bool compressed_type(std::string_view type)
+{
+    static constexpr std::array compressed_prefixes = {
+        std::string_view{"audio/"},
+        std::string_view{"video/"},
+        std::string_view{"application/vnd.openxmlformats-officedocument."},
+        std::string_view{"application/vnd.oasis.opendocument."},
+    };
+    static constexpr std::array compressed_types = {
+        std::string_view{"image/jpeg"},
+        std::string_view{"image/png"},
+        std::string_view{"image/gif"},
+        std::string_view{"image/webp"},
+        std::string_view{"image/heic"},
+        std::string_view{"application/pdf"},
+        std::string_view{"application/zip"},
+        std::string_view{"application/gzip"},
+        std::string_view{"application/x-gzip"},
+        std::string_view{"application/x-bzip2"},
+        std::string_view{"application/x-xz"},
+        std::string_view{"application/zstd"},
+        std::string_view{"application/x-7z-compressed"},
+        std::string_view{"application/x-rar-compressed"},
+        std::string_view{"application/vnd.rar"},
+        std::string_view{"application/java-archive"},
+        std::string_view{"application/epub+zip"},
+    };
+
+    for (const auto prefix: compressed_prefixes)
+        if (starts_with(type, prefix))
+            return true;
+    for (const auto t: compressed_types)
+        if (type == t)
+            return true;
+    return false;
+}
+
+
+double compressed_share(std::string_view body)
+{
+    if (body.empty())
+        return 0.0;
+
+    std::size_t compressed = 0;
+    bool in_headers = true;
+    std::string type;
+    std::size_t part_start = 0;
+
+    std::size_t pos = 0;
+    while (pos < body.size()) {
+        auto end = body.find('\n', pos);
+        if (end == std::string_view::npos)
+            end = body.size();
+        std::string_view line = body.substr(pos, end - pos);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+
+        if (in_headers) {
+            if (line.empty()) {
+                in_headers = false;
+                part_start = end + 1;
+            } else if (string::iequals(line.substr(0, 13), "content-type:")) {
+                type = media_type(line.substr(13));
+            }
+        } else if (starts_with(line, "--")) {
+            // boundary: ends the current part, followed by the headers of the next one
+            if (compressed_type(type))
+                compressed += pos - part_start;
+            in_headers = true;
+            type.clear();
+        }
+
+        pos = end + 1;
+    }
+
+    if (!in_headers && compressed_type(type) && part_start < body.size())
+        compressed += body.size() - part_start;
+
+    return static_cast<double>(compressed) / static_cast<double>(body.size());
+}
+
+} // namespace gwmilter::utils::mime
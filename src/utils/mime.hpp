@@ -0,0 +1,15 @@
+#pragma once
+#include <string_view>
+
+namespace gwmilter::utils::mime {
+
+// True if data of the MIME type is normally compressed already (images, audio, video, archives, PDF and
+// office documents); `type` is the lowercase type/subtype, without parameters
+bool compressed_type(std::string_view type);
+
+// Fraction, between 0 and 1, of the body taken by parts whose Content-Type is compressed_type().
+// The body starts with its Content-* headers. Parts are delimited by the lines starting with "--",
+// without matching them to the boundaries, which is enough for an estimate.
+double compressed_share(std::string_view body);
+
+} // namespace gwmilter::utils::mime
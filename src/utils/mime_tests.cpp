@@ -0,0 +1,53 @@
+#include "mime.hpp"
+#include <gtest/gtest.h>
+#include <string>
+
+using namespace gwmilter::utils::mime;
+
+TEST(MimeUtilsTest, CompressedTypeRecognizesCompressedMedia)
+{
+    EXPECT_TRUE(compressed_type("image/jpeg"));
+    EXPECT_TRUE(compressed_type("video/mp4"));
+    EXPECT_TRUE(compressed_type("application/zip"));
+    EXPECT_TRUE(compressed_type("application/vnd.openxmlformats-officedocument.wordprocessingml.document"));
+    EXPECT_FALSE(compressed_type("text/plain"));
+    EXPECT_FALSE(compressed_type("image/bmp"));
+    EXPECT_FALSE(compressed_type("multipart/mixed"));
+    EXPECT_FALSE(compressed_type(""));
+}
+
+TEST(MimeUtilsTest, CompressedShareOfSinglePartBody)
+{
+    EXPECT_EQ(compressed_share(""), 0.0);
+    EXPECT_EQ(compressed_share("Content-Type: text/plain\r\n\r\nhello\r\n"), 0.0);
+
+    const std::string image = "Content-Type: image/JPEG; name=\"a.jpg\"\r\n"
+                              "Content-Transfer-Encoding: base64\r\n"
+                              "\r\n" +
+                              std::string(900, 'A') + "\r\n";
+    EXPECT_GT(compressed_share(image), 0.9);
+}
+
+TEST(MimeUtilsTest, CompressedShareCountsCompressedParts)
+{
+    const std::string text(300, 't');
+    const std::string zip(600, 'z');
+    const std::string body = "Content-Type: multipart/mixed; boundary=\"b\"\r\n"
+                             "\r\n"
+                             "--b\r\n"
+                             "Content-Type: text/plain\r\n"
+                             "\r\n" +
+                             text +
+                             "\r\n"
+                             "--b\r\n"
+                             "Content-Type: application/zip\r\n"
+                             "Content-Transfer-Encoding: base64\r\n"
+                             "\r\n" +
+                             zip +
+                             "\r\n"
+                             "--b--\r\n";
+
+    const double share = compressed_share(body);
+    // the zip part body (and its line ending) over the whole body
+    EXPECT_DOUBLE_EQ(share, static_cast<double>(zip.size() + 2) / static_cast<double>(body.size()));
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// USDT (user-level statically defined tracing) probes, usable from bpftrace/systemtap:
+//
+//   bpftrace -e 'usdt:./gwmilter:gwmilter:encrypt__done { printf("%s %s %d\n", str(arg0), str(arg1), arg2); }'
+//
+// Probes are compiled in with -DENABLE_USDT_PROBES=ON. Each probe site is a single nop
+// until a tracer attaches to it. Without the option the macro expands to nothing and
+// the probe arguments are not evaluated.
+#ifdef GWMILTER_USDT_PROBES
+#include <sys/sdt.h>
+#define GWMILTER_PROBE(name, ...) STAP_PROBEV(gwmilter, name, __VA_ARGS__)
+#else
+#define GWMILTER_PROBE(name, ...)                                                                                      \
+    do {                                                                                                               \
+    } while (0)
+#endif
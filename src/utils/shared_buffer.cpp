@@ -0,0 +1,248 @@
+#include "shared_buffer.hpp"
+#include "utils/string.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace gwmilter::utils {
+
+namespace {
+
+#ifdef MSG_NOSIGNAL
+constexpr int send_flags = MSG_NOSIGNAL;
+#else
+constexpr int send_flags = 0;
+#endif
+
+#ifdef MSG_CMSG_CLOEXEC
+constexpr int receive_flags = MSG_CMSG_CLOEXEC;
+#else
+constexpr int receive_flags = 0;
+#endif
+
+[[noreturn]] void throw_errno(const char *operation)
+{
+    throw std::runtime_error(fmt::format("{}() failed: {}", operation, string::str_err(errno)));
+}
+
+
+int create_anonymous_file()
+{
+#ifdef __linux__
+    const int fd = memfd_create("gwmilter", MFD_CLOEXEC);
+    if (fd == -1)
+        throw_errno("memfd_create");
+    return fd;
+#else
+    std::string path = (std::filesystem::temp_directory_path() / "gwmilter-XXXXXX").string();
+    const int fd = mkstemp(path.data());
+    if (fd == -1)
+        throw_errno("mkstemp");
+    ::unlink(path.c_str());
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+#endif
+}
+
+
+void send_all(int socket, const char *data, std::size_t size)
+{
+    while (size > 0) {
+        const ssize_t n = ::send(socket, data, size, send_flags);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("send");
+        }
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+}
+
+
+// returns false on end of file
+bool receive_all(int socket, char *data, std::size_t size)
+{
+    while (size > 0) {
+        const ssize_t n = ::recv(socket, data, size, 0);
+        if (n == 0)
+            return false;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("recv");
+        }
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+
+shared_buffer::shared_buffer()
+    : fd_{create_anonymous_file()}
+{ }
+
+
+shared_buffer::shared_buffer(int fd)
+    : fd_{fd}
+{ }
+
+
+shared_buffer::~shared_buffer()
+{
+    unmap();
+    if (fd_ != -1)
+        ::close(fd_);
+}
+
+
+void shared_buffer::assign(std::string_view data)
+{
+    unmap();
+    if (ftruncate(fd_, 0) == -1 || ftruncate(fd_, static_cast<off_t>(data.size())) == -1)
+        throw_errno("ftruncate");
+
+    std::size_t offset = 0;
+    while (offset < data.size()) {
+        const ssize_t n = ::pwrite(fd_, data.data() + offset, data.size() - offset, static_cast<off_t>(offset));
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("pwrite");
+        }
+        offset += static_cast<std::size_t>(n);
+    }
+}
+
+
+std::string_view shared_buffer::view() const
+{
+    const std::size_t current_size = size();
+    if (current_size == 0)
+        return {};
+
+    if (map_ == nullptr || map_size_ != current_size) {
+        unmap();
+        void *map = mmap(nullptr, current_size, PROT_READ, MAP_SHARED, fd_, 0);
+        if (map == MAP_FAILED)
+            throw_errno("mmap");
+        map_ = map;
+        map_size_ = current_size;
+    }
+
+    return {static_cast<const char *>(map_), map_size_};
+}
+
+
+std::size_t shared_buffer::size() const
+{
+    struct stat st{};
+    if (fstat(fd_, &st) == -1)
+        throw_errno("fstat");
+    return static_cast<std::size_t>(st.st_size);
+}
+
+
+void shared_buffer::unmap() const
+{
+    if (map_ != nullptr) {
+        munmap(map_, map_size_);
+        map_ = nullptr;
+        map_size_ = 0;
+    }
+}
+
+
+void send_message(int socket, std::string_view payload, int fd)
+{
+    // a length prefix delimits the messages on the stream; the descriptor travels with its first byte
+    const auto length = static_cast<std::uint32_t>(payload.size());
+    char header[sizeof(length)];
+    std::memcpy(header, &length, sizeof(length));
+
+    iovec iov{header, sizeof(header)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    if (fd != -1) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t n = 0;
+    do {
+        n = ::sendmsg(socket, &msg, send_flags);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1)
+        throw_errno("sendmsg");
+
+    send_all(socket, header + n, sizeof(header) - static_cast<std::size_t>(n));
+    send_all(socket, payload.data(), payload.size());
+}
+
+
+bool receive_message(int socket, std::string &payload, int &fd)
+{
+    fd = -1;
+    char header[sizeof(std::uint32_t)];
+    iovec iov{header, sizeof(header)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = 0;
+    do {
+        n = ::recvmsg(socket, &msg, receive_flags);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1)
+        throw_errno("recvmsg");
+    if (n == 0)
+        return false;
+
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            if (receive_flags == 0)
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    std::uint32_t length = 0;
+    bool complete = receive_all(socket, header + n, sizeof(header) - static_cast<std::size_t>(n));
+    if (complete) {
+        std::memcpy(&length, header, sizeof(length));
+        payload.resize(length);
+        complete = receive_all(socket, payload.data(), length);
+    }
+
+    if (!complete) {
+        if (fd != -1)
+            ::close(fd);
+        fd = -1;
+        throw std::runtime_error("Connection closed in the middle of a message");
+    }
+    return true;
+}
+
+} // namespace gwmilter::utils
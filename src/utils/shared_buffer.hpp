@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace gwmilter::utils {
+
+// Anonymous in-memory file (memfd on Linux, an unlinked temporary file elsewhere) used to hand
+// message bodies to another process: only the descriptor is sent, and both sides map the same pages.
+class shared_buffer {
+public:
+    // Creates an empty buffer
+    shared_buffer();
+    // Takes ownership of a descriptor received from another process
+    explicit shared_buffer(int fd);
+    ~shared_buffer();
+    shared_buffer(const shared_buffer &) = delete;
+    shared_buffer &operator=(const shared_buffer &) = delete;
+
+    // Replaces the content
+    void assign(std::string_view data);
+
+    // Maps the content in memory; the view is valid until the buffer is modified or destroyed
+    [[nodiscard]] std::string_view view() const;
+
+    [[nodiscard]] std::size_t size() const;
+    [[nodiscard]] int fd() const { return fd_; }
+
+private:
+    void unmap() const;
+
+    int fd_ = -1;
+    mutable void *map_ = nullptr;
+    mutable std::size_t map_size_ = 0;
+};
+
+
+// Sends a message, and optionally a descriptor, over a unix stream socket
+void send_message(int socket, std::string_view payload, int fd = -1);
+
+// Receives a message sent by send_message(); fd is set to the received descriptor, or -1.
+// Returns false when the peer closed the socket before sending anything.
+bool receive_message(int socket, std::string &payload, int &fd);
+
+} // namespace gwmilter::utils
@@ -0,0 +1,78 @@
+#include "shared_buffer.hpp"
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace gwmilter::utils;
+
+class SharedBufferTest : public ::testing::Test {
+protected:
+    int sockets[2] = {-1, -1};
+
+    void SetUp() override { ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0); }
+
+    void TearDown() override
+    {
+        ::close(sockets[0]);
+        ::close(sockets[1]);
+    }
+};
+
+TEST_F(SharedBufferTest, AssignReplacesContent)
+{
+    shared_buffer buffer;
+    EXPECT_EQ(buffer.size(), 0U);
+    EXPECT_TRUE(buffer.view().empty());
+
+    buffer.assign("first content");
+    EXPECT_EQ(buffer.view(), "first content");
+
+    buffer.assign("second");
+    EXPECT_EQ(buffer.size(), 6U);
+    EXPECT_EQ(buffer.view(), "second");
+}
+
+TEST_F(SharedBufferTest, MessageCarriesPayloadAndDescriptor)
+{
+    const std::string body(100000, 'x');
+    shared_buffer sent;
+    sent.assign(body);
+    send_message(sockets[0], "encrypt", sent.fd());
+
+    std::string payload;
+    int fd = -1;
+    ASSERT_TRUE(receive_message(sockets[1], payload, fd));
+    EXPECT_EQ(payload, "encrypt");
+    ASSERT_NE(fd, -1);
+
+    // the receiver maps the same pages
+    shared_buffer received(fd);
+    EXPECT_EQ(received.view(), body);
+}
+
+TEST_F(SharedBufferTest, MessageWithoutDescriptor)
+{
+    send_message(sockets[0], "");
+    send_message(sockets[0], "error\nsomething failed");
+
+    std::string payload;
+    int fd = 0;
+    ASSERT_TRUE(receive_message(sockets[1], payload, fd));
+    EXPECT_EQ(payload, "");
+    EXPECT_EQ(fd, -1);
+
+    ASSERT_TRUE(receive_message(sockets[1], payload, fd));
+    EXPECT_EQ(payload, "error\nsomething failed");
+    EXPECT_EQ(fd, -1);
+}
+
+TEST_F(SharedBufferTest, ReceiveReportsClosedPeer)
+{
+    ::close(sockets[0]);
+    sockets[0] = -1;
+
+    std::string payload;
+    int fd = -1;
+    EXPECT_FALSE(receive_message(sockets[1], payload, fd));
+}
@@ -41,4 +41,18 @@ bool iequals(std::string_view a, std::string_view b)
                       [](unsigned char ac, unsigned char bc) { return std::tolower(ac) == std::tolower(bc); });
 }
 
+std::string normalize_address(std::string_view address)
+{
+    const auto is_blank = [](unsigned char c) { return std::isspace(c) != 0; };
+    while (!address.empty() && is_blank(address.front()))
+        address.remove_prefix(1);
+    while (!address.empty() && is_blank(address.back()))
+        address.remove_suffix(1);
+
+    if (address.size() >= 2 && address.front() == '<' && address.back() == '>')
+        address = address.substr(1, address.size() - 2);
+
+    return to_lower(address);
+}
+
 } // namespace gwmilter::utils::string
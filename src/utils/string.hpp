@@ -15,4 +15,7 @@ std::string to_lower(std::string_view src);
 
 bool iequals(std::string_view a, std::string_view b);
 
+// Returns the mailbox of an SMTP address in lowercase, without surrounding blanks and angle brackets
+std::string normalize_address(std::string_view address);
+
 } // namespace gwmilter::utils::string
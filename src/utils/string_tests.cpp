@@ -60,3 +60,25 @@ TEST(StringUtilsTest, SetToStringMultipleElements)
     // Sets are ordered, so we can predict the output
     EXPECT_EQ(set_to_string(multi_set), "alice@example.com, bob@example.com, charlie@example.com");
 }
+
+// ============================================
+// normalize_address tests
+// ============================================
+
+TEST(StringUtilsTest, NormalizeAddressStripsAngleBrackets)
+{
+    EXPECT_EQ(normalize_address("<alice@example.com>"), "alice@example.com");
+    EXPECT_EQ(normalize_address(" <alice@example.com> "), "alice@example.com");
+    EXPECT_EQ(normalize_address("alice@example.com"), "alice@example.com");
+}
+
+TEST(StringUtilsTest, NormalizeAddressConvertsToLowercase)
+{
+    EXPECT_EQ(normalize_address("<Alice@EXAMPLE.com>"), "alice@example.com");
+}
+
+TEST(StringUtilsTest, NormalizeAddressKeepsUnbalancedBrackets)
+{
+    EXPECT_EQ(normalize_address("<alice@example.com"), "<alice@example.com");
+    EXPECT_EQ(normalize_address(""), "");
+}
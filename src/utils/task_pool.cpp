@@ -0,0 +1,139 @@
+#include "task_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+namespace gwmilter::utils {
+
+// Tasks of one run() call, shared by the calling thread and the pool threads
+struct task_pool::batch {
+    explicit batch(const std::vector<std::function<void()>> &t)
+        : tasks{t}, count{t.size()}
+    { }
+
+    // Runs a task not started yet; returns false if there is none left
+    bool run_one()
+    {
+        const std::size_t i = next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= count)
+            return false;
+
+        std::exception_ptr e;
+        try {
+            tasks[i]();
+        } catch (...) {
+            e = std::current_exception();
+        }
+
+        const std::lock_guard lock(mutex);
+        if (e && !error)
+            error = e;
+        if (++done == count)
+            cv.notify_all();
+        return true;
+    }
+
+    // only used while a task is left, run() waits for all of them
+    const std::vector<std::function<void()>> &tasks;
+    const std::size_t count;
+    std::atomic<std::size_t> next{0};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::size_t done = 0;
+    std::exception_ptr error;
+};
+
+
+task_pool::~task_pool()
+{
+    {
+        const std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t: threads_)
+        t.join();
+}
+
+
+task_pool &task_pool::instance()
+{
+    static task_pool pool;
+    return pool;
+}
+
+
+void task_pool::run(const std::vector<std::function<void()>> &tasks, std::size_t threads)
+{
+    if (tasks.empty())
+        return;
+
+    const auto b = std::make_shared<batch>(tasks);
+    // the calling thread takes one of the tasks in any case
+    const std::size_t tickets = std::min(tasks.size() - 1, threads);
+    if (tickets > 0) {
+        {
+            const std::lock_guard lock(mutex_);
+            limit_ = threads;
+            while (threads_.size() < limit_)
+                threads_.emplace_back(&task_pool::work, this);
+            queue_.insert(queue_.end(), tickets, b);
+        }
+        cv_.notify_all();
+    }
+
+    while (b->run_one()) { }
+
+    if (tickets > 0) {
+        // the tasks are all started, the tickets left in the queue have nothing to do
+        const std::lock_guard lock(mutex_);
+        queue_.erase(std::remove(queue_.begin(), queue_.end(), b), queue_.end());
+    }
+
+    std::unique_lock lock(b->mutex);
+    b->cv.wait(lock, [&b] { return b->done == b->count; });
+    if (b->error)
+        std::rethrow_exception(b->error);
+}
+
+
+std::size_t task_pool::threads() const
+{
+    const std::lock_guard lock(mutex_);
+    return threads_.size();
+}
+
+
+std::size_t task_pool::busy() const
+{
+    const std::lock_guard lock(mutex_);
+    return busy_;
+}
+
+
+void task_pool::work()
+{
+    std::unique_lock lock(mutex_);
+    for (;;) {
+        // threads beyond a lowered limit stay idle
+        cv_.wait(lock, [this] { return stopping_ || (!queue_.empty() && busy_ < limit_); });
+        if (stopping_)
+            return;
+
+        std::shared_ptr<batch> b = std::move(queue_.front());
+        queue_.pop_front();
+        ++busy_;
+        lock.unlock();
+
+        b->run_one();
+        b.reset();
+
+        lock.lock();
+        --busy_;
+        if (!queue_.empty())
+            cv_.notify_one();
+    }
+}
+
+} // namespace gwmilter::utils
@@ -0,0 +1,50 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gwmilter::utils {
+
+// Process-wide threads running the tasks of a message in parallel (e.g. the encryption of its sections).
+// The calling thread takes part in the work, so that the tasks still complete, one after the other, when all
+// the threads are busy with other messages. The number of threads is passed by the callers, so that it follows
+// configuration reloads; threads are started on first use.
+class task_pool {
+public:
+    task_pool() = default;
+    ~task_pool();
+    task_pool(const task_pool &) = delete;
+    task_pool &operator=(const task_pool &) = delete;
+
+    static task_pool &instance();
+
+    // Runs the tasks on the calling thread and on up to `threads` pool threads; returns once all of them are
+    // done, rethrowing the first exception thrown by a task. 0 threads runs them on the calling thread.
+    void run(const std::vector<std::function<void()>> &tasks, std::size_t threads);
+
+    // Threads started so far
+    [[nodiscard]] std::size_t threads() const;
+    // Pool threads running a task
+    [[nodiscard]] std::size_t busy() const;
+
+private:
+    struct batch;
+
+    void work();
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    // one entry for each task of a batch that a pool thread may take
+    std::deque<std::shared_ptr<batch>> queue_;
+    std::vector<std::thread> threads_;
+    std::size_t limit_ = 0;
+    std::size_t busy_ = 0;
+    bool stopping_ = false;
+};
+
+} // namespace gwmilter::utils
@@ -0,0 +1,105 @@
+#include "task_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <thread>
+
+using namespace gwmilter::utils;
+
+namespace {
+
+// Tasks recording how many of them run at the same time
+struct concurrency_probe {
+    std::vector<std::function<void()>> tasks(std::size_t n)
+    {
+        std::vector<std::function<void()>> result;
+        for (std::size_t i = 0; i < n; ++i)
+            result.emplace_back([this] {
+                const int now = ++running;
+                int seen = peak.load();
+                while (now > seen && !peak.compare_exchange_weak(seen, now)) { }
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                --running;
+                ++done;
+            });
+        return result;
+    }
+
+    std::atomic<int> running{0};
+    std::atomic<int> peak{0};
+    std::atomic<int> done{0};
+};
+
+} // namespace
+
+TEST(TaskPoolTest, RunsAllTasksInParallel)
+{
+    task_pool pool;
+    concurrency_probe probe;
+    pool.run(probe.tasks(3), 4);
+
+    EXPECT_EQ(probe.done, 3);
+    EXPECT_EQ(probe.peak, 3);
+    EXPECT_EQ(pool.threads(), 4u);
+}
+
+TEST(TaskPoolTest, ZeroThreadsRunsTasksOnTheCallingThread)
+{
+    task_pool pool;
+    std::vector<std::thread::id> ids;
+    pool.run({[&ids] { ids.push_back(std::this_thread::get_id()); },
+              [&ids] { ids.push_back(std::this_thread::get_id()); }},
+             0);
+
+    EXPECT_EQ(ids, std::vector<std::thread::id>(2, std::this_thread::get_id()));
+    EXPECT_EQ(pool.threads(), 0u);
+}
+
+TEST(TaskPoolTest, ThreadsAreBoundedAcrossCallers)
+{
+    task_pool pool;
+    concurrency_probe probe;
+
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 4; ++i)
+        callers.emplace_back([&pool, &probe] { pool.run(probe.tasks(5), 2); });
+    for (auto &t: callers)
+        t.join();
+
+    EXPECT_EQ(probe.done, 20);
+    EXPECT_EQ(pool.threads(), 2u);
+    // the callers and the pool threads
+    EXPECT_LE(probe.peak, 6);
+    EXPECT_EQ(pool.busy(), 0u);
+}
+
+TEST(TaskPoolTest, LoweredLimitLeavesExtraThreadsIdle)
+{
+    task_pool pool;
+    concurrency_probe first;
+    pool.run(first.tasks(4), 3);
+    EXPECT_EQ(pool.threads(), 3u);
+
+    concurrency_probe second;
+    pool.run(second.tasks(6), 1);
+    EXPECT_EQ(second.done, 6);
+    EXPECT_LE(second.peak, 2);
+}
+
+TEST(TaskPoolTest, RethrowsAfterAllTasksAreDone)
+{
+    task_pool pool;
+    std::atomic<int> done{0};
+    const std::vector<std::function<void()>> tasks{
+        [] { throw std::runtime_error("first"); },
+        [&done] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            ++done;
+        },
+        [&done] { ++done; }};
+
+    EXPECT_THROW(pool.run(tasks, 2), std::runtime_error);
+    EXPECT_EQ(done, 2);
+}
@@ -0,0 +1,108 @@
+#include "warmup.hpp"
+#include "cfg2/config.hpp"
+#include "keys/gpgme_context.hpp"
+#include "keys/keyring.hpp"
+#include "keys/openssl_cms.hpp"
+#include "logger/logger.hpp"
+#include <chrono>
+#include <crypto.hpp>
+#include <data_buffers.hpp>
+#include <set>
+#include <string>
+#include <utility>
+
+namespace gwmilter {
+
+namespace {
+
+void warm_up_engine(gpgme_protocol_t protocol)
+{
+    keys::gpgme_context ctx(protocol);
+    keys::check(gpgme_engine_check_version(protocol), "gpgme_engine_check_version");
+}
+
+
+void warm_up_keyring(const std::string &section, gpgme_protocol_t protocol, const std::string &gnupg_home,
+                     std::chrono::seconds key_cache_ttl)
+{
+    const keys::keyring kr(protocol, gnupg_home, key_cache_ttl);
+    const std::size_t count = kr.warm_up();
+    spdlog::debug("Warm-up: keyring of section {} has {} keys", section, count);
+}
+
+
+void warm_up_signing(const std::string &signing_key)
+{
+    using namespace egpgcrypt;
+
+    // starts gpg-agent and loads the secret key, as done for every re-injected email
+    crypto c(GPGME_PROTOCOL_OpenPGP);
+    memory_data_buffer in("gwmilter warm-up");
+    memory_data_buffer out;
+    c.sign({signing_key}, in, out);
+}
+
+
+template<typename F> void step(const char *name, F &&f)
+{
+    try {
+        f();
+    } catch (const std::exception &e) {
+        spdlog::warn("Warm-up: {} failed: {}", name, e.what());
+    }
+}
+
+} // namespace
+
+
+void warm_up(const cfg2::Config &config)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const std::chrono::seconds key_cache_ttl{config.general.key_cache_ttl};
+
+    bool uses_cms = false;
+    for (const auto &section: config.encryptionSections) {
+        const auto *smime = dynamic_cast<const cfg2::SmimeEncryptionSection *>(section.get());
+        uses_cms = uses_cms || (smime != nullptr && smime->cms_backend == cfg2::CmsBackend::Gpgsm);
+    }
+
+    // OpenPGP is always needed, to sign re-injected emails and to verify them
+    step("OpenPGP engine", [] { warm_up_engine(GPGME_PROTOCOL_OpenPGP); });
+    if (uses_cms)
+        step("S/MIME engine", [] { warm_up_engine(GPGME_PROTOCOL_CMS); });
+
+    // keyrings shared by several sections (e.g. the default GnuPG home) are listed once
+    std::set<std::pair<gpgme_protocol_t, std::string>> keyrings;
+    const auto warm_up_once = [&](const std::string &section, gpgme_protocol_t protocol, const std::string &home) {
+        if (keyrings.emplace(protocol, home).second)
+            warm_up_keyring(section, protocol, home, key_cache_ttl);
+        else
+            spdlog::debug("Warm-up: keyring of section {} already loaded", section);
+    };
+
+    for (const auto &section: config.encryptionSections) {
+        if (const auto *pgp = dynamic_cast<const cfg2::PgpEncryptionSection *>(section.get()); pgp != nullptr)
+            step("PGP keyring",
+                 [&] { warm_up_once(pgp->sectionName, GPGME_PROTOCOL_OpenPGP, pgp->gnupg_home); });
+        else if (const auto *smime = dynamic_cast<const cfg2::SmimeEncryptionSection *>(section.get());
+                 smime != nullptr && smime->cms_backend == cfg2::CmsBackend::Openssl)
+            step("S/MIME certificates", [&] {
+                const auto encryptor = keys::cms_encryptor::get(smime->certificate_dir);
+                spdlog::debug("Warm-up: section {} has {} certificates", smime->sectionName, encryptor->size());
+            });
+        else if (smime != nullptr)
+            step("S/MIME keyring", [&] { warm_up_once(smime->sectionName, GPGME_PROTOCOL_CMS, smime->gnupg_home); });
+    }
+
+    if (!config.general.signing_key.empty())
+        step("signing", [&] { warm_up_signing(config.general.signing_key); });
+
+    // evaluates the match patterns of every section once
+    step("matchers", [&] { (void) config.find_match("warm-up@gwmilter.invalid"); });
+
+    const auto elapsed =
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    spdlog::info("Warm-up completed in {} ms", elapsed.count());
+}
+
+} // namespace gwmilter
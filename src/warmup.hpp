@@ -0,0 +1,14 @@
+#pragma once
+
+namespace cfg2 {
+struct Config;
+}
+
+namespace gwmilter {
+
+// Prepares everything that is otherwise initialized by the first messages: GPGME engines,
+// section keyrings, gpg-agent (with a dummy signature using signing_key) and the section matchers.
+// Failures are logged and don't stop the warm-up.
+void warm_up(const cfg2::Config &config);
+
+} // namespace gwmilter